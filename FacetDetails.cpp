@@ -20,7 +20,9 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "FacetDetails.h"
 #include "GLApp/GLToolkit.h"
 #include "GLApp/GLMessageBox.h"
+#include "GLApp/GLFileBox.h"
 #include "GLApp/MathTools.h"
+#include <algorithm> //std::find
 #include "Geometry_shared.h"
 #include "Facet_shared.h"
 
@@ -64,6 +66,10 @@ static COLUMN allColumn[] = {
   {"Equiv.hits"           , 80 , ALIGN_CENTER, COLOR_BLUE } ,
   {"Des."           , 80 , ALIGN_CENTER, COLOR_BLUE } ,
   {"Equiv.abs."           , 80 , ALIGN_CENTER, COLOR_BLUE } ,
+  {"Est.imping.rate"      , 80 , ALIGN_CENTER, COLOR_BLUE } ,
+  {"Est.equiv.hits"       , 80 , ALIGN_CENTER, COLOR_BLUE } ,
+  {"Adj.transfer"         , 80 , ALIGN_CENTER, 0 } ,
+  {"Adj.flux [1/s]"       , 80 , ALIGN_CENTER, 0 } ,
 };
 
 static const char *desStr[] = {
@@ -90,14 +96,14 @@ static const char *ynStr[] = {
 
 FacetDetails::FacetDetails():GLWindow() {
 
-  int wD = 502;
+  int wD = 600;
   int hD = 400;
   worker = NULL;
 
   SetTitle("Facets details");
   SetIconfiable(true);
   SetResizable(true);
-  SetMinimumSize(502,200);
+  SetMinimumSize(600,200);
 
   checkAllButton = new GLButton(0,"Check All");
   Add(checkAllButton);
@@ -105,6 +111,10 @@ FacetDetails::FacetDetails():GLWindow() {
   Add(uncheckAllButton);
   updateButton = new GLButton(0,"Update");
   Add(updateButton);
+  channelCombo = new GLCombo(0);
+  Add(channelCombo);
+  exportButton = new GLButton(0,"Export");
+  Add(exportButton);
   dismissButton = new GLButton(0,"Dismiss");
   Add(dismissButton);
 
@@ -199,6 +209,18 @@ FacetDetails::FacetDetails():GLWindow() {
   show[26] = new GLToggle(26,"Equiv.Abs.");
   show[26]->SetState(true);
   sPanel->Add(show[26]);
+  show[27] = new GLToggle(27,"Est.imping.rate");
+  show[27]->SetState(true);
+  sPanel->Add(show[27]);
+  show[28] = new GLToggle(28,"Est.equiv.hits");
+  show[28]->SetState(true);
+  sPanel->Add(show[28]);
+  show[29] = new GLToggle(29,"Adj.transfer");
+  show[29]->SetState(true);
+  sPanel->Add(show[29]);
+  show[30] = new GLToggle(30,"Adj.flux");
+  show[30]->SetState(true);
+  sPanel->Add(show[30]);
 
   // Center dialog
   int wS,hS;
@@ -230,6 +252,8 @@ void FacetDetails::PlaceComponents() {
   checkAllButton->SetBounds(5,height-45,90,19);
   uncheckAllButton->SetBounds(100,height-45,90,19);
   updateButton->SetBounds(195,height-45,90,19);
+  channelCombo->SetBounds(290,height-45,120,19);
+  exportButton->SetBounds(415,height-45,70,19);
   dismissButton->SetBounds(width-100,height-45,90,19);
 
 }
@@ -251,10 +275,15 @@ char *FacetDetails::GetCountStr(Facet *f) {
   return ret;
 }
 
-char *FacetDetails::FormatCell(size_t idx,Facet *f,size_t mode) {
+char *FacetDetails::FormatCell(size_t idx,Facet *f,size_t mode,const FACETRESULT& res) {
   static char ret[256];
   strcpy(ret,"");
 
+  if (res.isAdjoint && ((mode>=18 && mode<=22) || mode==27)) {
+    sprintf(ret,"Adjoint run"); //Adjoint particles don't carry the forward flux, see the Adj. columns
+    return ret;
+  }
+
   switch(mode) {
     case 0:
       sprintf(ret,"%zd",idx+1);
@@ -324,45 +353,63 @@ char *FacetDetails::FormatCell(size_t idx,Facet *f,size_t mode) {
 	case 18: //imp.rate
 	{
 	double dCoef = 1E4 * worker->GetMoleculesPerTP(worker->displayedMoment);  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar
-	sprintf(ret, "%g", f->facetHitCache.hit.nbHitEquiv / f->GetArea()*dCoef);
+	sprintf(ret, "%g", res.hit.nbHitEquiv / f->GetArea()*dCoef);
 	//11.77=sqrt(8*8.31*293.15/3.14/0.028)/4/10
 	break; }
 	case 19: //particle density
 	{
 	double dCoef = 1E4 * worker->GetMoleculesPerTP(worker->displayedMoment)*f->DensityCorrection();  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar	
 	
-	sprintf(ret, "%g", f->facetHitCache.hit.sum_1_per_ort_velocity / f->GetArea()*dCoef);
+	sprintf(ret, "%g", res.hit.sum_1_per_ort_velocity / f->GetArea()*dCoef);
 
 	break; }
 	case 20: //gas density
 	{
 	double dCoef =  1E4 * worker->GetMoleculesPerTP(worker->displayedMoment)*f->DensityCorrection();  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar
 	
-	sprintf(ret, "%g", f->facetHitCache.hit.sum_1_per_ort_velocity / f->GetArea()*dCoef*mApp->worker.wp.gasMass / 1000.0 / 6E23);
+	sprintf(ret, "%g", res.hit.sum_1_per_ort_velocity / f->GetArea()*dCoef*res.gasMass / 1000.0 / 6E23);
 	break; }
 	case 21: //avg.pressure
 	{
-	double dCoef = 1E4 * worker->GetMoleculesPerTP(worker->displayedMoment) * (worker->wp.gasMass / 1000 / 6E23) * 0.0100;  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar
+	double dCoef = 1E4 * worker->GetMoleculesPerTP(worker->displayedMoment) * (res.gasMass / 1000 / 6E23) * 0.0100;  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar
 	
-	sprintf(ret, "%g", f->facetHitCache.hit.sum_v_ort*dCoef / f->GetArea());
+	sprintf(ret, "%g", res.hit.sum_v_ort*dCoef / f->GetArea());
 	break; }
 	case 22: //avg. gas speed (estimate)
-		/*sprintf(ret, "%g", 4.0*(double)(f->facetHitCache.hit.nbMCHit+f->facetHitCache.hit.nbDesorbed) / f->facetHitCache.hit.sum_1_per_ort_velocity);*/
-		sprintf(ret, "%g", (f->facetHitCache.hit.nbHitEquiv + static_cast<double>(f->facetHitCache.hit.nbDesorbed)) / f->facetHitCache.hit.sum_1_per_velocity);
+		/*sprintf(ret, "%g", 4.0*(double)(res.hit.nbMCHit+res.hit.nbDesorbed) / res.hit.sum_1_per_ort_velocity);*/
+		sprintf(ret, "%g", (res.hit.nbHitEquiv + static_cast<double>(res.hit.nbDesorbed)) / res.hit.sum_1_per_velocity);
 		//<v_surf>=2*<v_surf_ort>
 		//<v_gas>=1/<1/v_surf>
 		break;
 	case 23:
-		sprintf(ret,"%I64d",f->facetHitCache.hit.nbMCHit);
+		sprintf(ret,"%I64d",res.hit.nbMCHit);
 		break;
 	case 24:
-		sprintf(ret, "%g", f->facetHitCache.hit.nbHitEquiv);
+		sprintf(ret, "%g", res.hit.nbHitEquiv);
 		break;
 	case 25:
-		sprintf(ret,"%I64d",f->facetHitCache.hit.nbDesorbed);
+		sprintf(ret,"%I64d",res.hit.nbDesorbed);
 		break;
 	case 26:
-		sprintf(ret,"%g",f->facetHitCache.hit.nbAbsEquiv);
+		sprintf(ret,"%g",res.hit.nbAbsEquiv);
+		break;
+	case 27: //forced detection estimate of the imp.rate, incoming flux only like col.18
+	{
+	if (!res.isEstimatorTarget) { sprintf(ret, "-"); break; }
+	double dCoef = 1E4 * worker->GetMoleculesPerTP(worker->displayedMoment);
+	sprintf(ret, "%g", res.estimate.hit.nbHitEquiv / f->GetArea()*dCoef);
+	break; }
+	case 28:
+		if (res.isEstimatorTarget) sprintf(ret, "%g", res.estimate.hit.nbHitEquiv);
+		else sprintf(ret, "-");
+		break;
+	case 29: //molecules emitted by this facet reaching the adjoint target, per emitted molecule
+		if (res.isAdjoint) sprintf(ret, "%g", res.adjointTransfer);
+		else sprintf(ret, "-");
+		break;
+	case 30: //molecules/s from this facet's outgassing reaching the adjoint target
+		if (res.isAdjoint) sprintf(ret, "%g", res.adjointFlux);
+		else sprintf(ret, "-");
 		break;
   }
 
@@ -406,20 +453,141 @@ void FacetDetails::UpdateTable() {
 	facetListD->SetColumnColors(tmpColor);
   
 
+  std::vector<FACETRESULT> results;
+  ReadResults(channelCombo->GetSelectedIndex(),selectedFacets,results);
+
   size_t nbS = 0;
   for(auto& sel:selectedFacets) {
     Facet *f = geom->GetFacet(sel);
     for(size_t j=0;j<nbCol;j++)
-        facetListD->SetValueAt(j,nbS,FormatCell(sel,f,shown[j]));
+        facetListD->SetValueAt(j,nbS,FormatCell(sel,f,shown[j],results[nbS]));
 	nbS++;
 	}
 }
 
+void FacetDetails::RefreshChannelCombo() {
+  //Simulated gas, then the extra species tallied on the same trajectories, then the sticking sweep scenarios
+  const std::vector<double>& speciesMasses = mApp->engineParams.speciesMasses;
+  const std::vector<std::vector<double>>& sweepStickings = mApp->engineParams.sweepStickings;
+  size_t nbScenarios = sweepStickings.empty() ? 0 : sweepStickings[0].size();
+  int selected = channelCombo->GetSelectedIndex();
+  size_t nbChannel = 1 + speciesMasses.size() + nbScenarios;
+  channelCombo->SetSize(nbChannel);
+  channelCombo->SetValueAt(0,"Simulation");
+  for(size_t s=0;s<speciesMasses.size();s++) {
+    char tmp[64];
+    sprintf(tmp,"Species %zd (%g g/mol)",s+1,speciesMasses[s]);
+    channelCombo->SetValueAt(1+s,tmp);
+  }
+  for(size_t k=0;k<nbScenarios;k++) {
+    char tmp[64];
+    sprintf(tmp,"Sweep scenario %zd",k+1);
+    channelCombo->SetValueAt(1+speciesMasses.size()+k,tmp);
+  }
+  channelCombo->SetSelectedIndex((selected>0 && selected<(int)nbChannel)?selected:0);
+  channelCombo->SetEnabled(nbChannel>1);
+}
+
+void FacetDetails::ReadResults(size_t channel,const std::vector<size_t>& selectedFacets,std::vector<FACETRESULT>& results) {
+
+  MolflowGeometry *geom = worker->GetMolflowGeometry();
+  const EngineParams& ep = mApp->engineParams;
+  size_t nbSpecies = ep.speciesMasses.size();
+  results.resize(selectedFacets.size());
+  memset(results.data(),0,results.size()*sizeof(FACETRESULT));
+  for(size_t i=0;i<selectedFacets.size();i++) {
+    results[i].gasMass = (channel>0 && channel<=nbSpecies) ? ep.speciesMasses[channel-1] : worker->wp.gasMass;
+    if(channel==0) results[i].hit = geom->GetFacet(selectedFacets[i])->facetHitCache.hit;
+    results[i].isAdjoint = ep.adjointTarget>=0;
+  }
+  if(worker->needsReload) return; //Engine blocks not laid out for the current settings yet
+
+  size_t nbMoments = worker->moments.size();
+  size_t nbFacet = geom->GetNbFacet();
+  BYTE *buffer = worker->GetHits();
+  try {
+    if(buffer) {
+      if(channel>0) {
+        // Extra species counters [species][facet][moment], then sweep counters [scenario][facet][moment]
+        size_t block = (channel<=nbSpecies) ? HITS_SPECIES : HITS_SWEEP;
+        size_t index = (channel<=nbSpecies) ? channel-1 : channel-1-nbSpecies;
+        FacetHitBuffer *counters = (FacetHitBuffer *)(buffer + geom->GetHitsOffset(block,nbMoments));
+        for(size_t i=0;i<selectedFacets.size();i++)
+          results[i].hit = counters[(index*nbFacet + selectedFacets[i])*(1+nbMoments) + worker->displayedMoment];
+      }
+      else if(!ep.estimatorFacets.empty()) {
+        // Forced detection counters [target][moment], targets in estimatorFacets order
+        FacetHitBuffer *estimates = (FacetHitBuffer *)(buffer + geom->GetHitsOffset(HITS_ESTIMATOR,nbMoments));
+        for(size_t i=0;i<selectedFacets.size();i++) {
+          auto target = std::find(ep.estimatorFacets.begin(),ep.estimatorFacets.end(),selectedFacets[i]);
+          if(target==ep.estimatorFacets.end()) continue;
+          results[i].isEstimatorTarget = true;
+          results[i].estimate = estimates[(target-ep.estimatorFacets.begin())*(1+nbMoments) + worker->displayedMoment];
+        }
+      }
+      if(ep.adjointTarget>=0) {
+        // Adjoint results, one per facet, normalized by the launched adjoint particles
+        AdjointResult *adjoint = (AdjointResult *)(buffer + geom->GetHitsOffset(HITS_ADJOINT,nbMoments));
+        double nbLaunched = (double)worker->globalHitCache.globalHits.hit.nbDesorbed;
+        if(nbLaunched>0.0) {
+          for(size_t i=0;i<selectedFacets.size();i++) {
+            results[i].adjointTransfer = adjoint[selectedFacets[i]].transfer / nbLaunched;
+            results[i].adjointFlux = adjoint[selectedFacets[i]].flux / nbLaunched;
+          }
+        }
+      }
+      worker->ReleaseHits();
+    }
+  }
+  catch (...) { //incorrect hits reference
+    worker->ReleaseHits();
+  }
+
+}
+
+void FacetDetails::ExportTable() {
+
+  Geometry *geom = worker->GetGeometry();
+  auto selectedFacets = geom->GetSelectedFacets();
+  if(selectedFacets.empty()) return;
+
+  FILENAME *fn = GLFileBox::SaveFile(mApp->currentDir,NULL,"Export facet details","Text files\0*.txt\0All files\0*.*\0",0);
+  if(!fn) return;
+
+  FILE *file = fopen(fn->fullName,"w");
+  if(file==NULL) {
+    char errMsg[512];
+    sprintf(errMsg,"Cannot open file\nFile:%s",fn->fullName);
+    GLMessageBox::Display(errMsg,"Error",GLDLG_OK,GLDLG_ICONERROR);
+    return;
+  }
+
+  // Shown columns of every result channel, tab separated
+  for(size_t channel=0;channel<(size_t)channelCombo->GetNbRow();channel++) {
+    std::vector<FACETRESULT> results;
+    ReadResults(channel,selectedFacets,results);
+    fprintf(file,"%s\n",channelCombo->GetValueAt(channel));
+    for(size_t i=0;i<NB_FDCOLUMN;i++)
+      if(i==0 || show[i]->GetState()) fprintf(file,"%s\t",allColumn[i].name);
+    fprintf(file,"\n");
+    for(size_t r=0;r<selectedFacets.size();r++) {
+      Facet *f = geom->GetFacet(selectedFacets[r]);
+      for(size_t i=0;i<NB_FDCOLUMN;i++)
+        if(i==0 || show[i]->GetState()) fprintf(file,"%s\t",FormatCell(selectedFacets[r],f,i,results[r]));
+      fprintf(file,"\n");
+    }
+    fprintf(file,"\n");
+  }
+  fclose(file);
+
+}
+
 void FacetDetails::Update() {
 
   if(!worker) return;
   if(!IsVisible()) return;
 
+  RefreshChannelCombo();
   Geometry *s = worker->GetGeometry();
   size_t nbS = s->GetNbSelectedFacets();
   
@@ -455,9 +623,15 @@ void FacetDetails::ProcessMessage(GLComponent *src,int message) {
         UpdateTable();
 	  }	else if (src==updateButton) {
         UpdateTable();
+      } else if (src==exportButton) {
+        ExportTable();
       }
       break;
 
+    case MSG_COMBO:
+      if(src==channelCombo) UpdateTable();
+      break;
+
     case MSG_TOGGLE:
       UpdateTable();
       break;
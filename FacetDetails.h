@@ -25,11 +25,23 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/GLButton.h"
 #include "GLApp/GLToggle.h"
 #include "GLApp/GLTitledPanel.h"
+#include "GLApp/GLCombo.h"
 #include "Worker.h"
 
 class Facet;
 
-#define NB_FDCOLUMN 27
+#define NB_FDCOLUMN 31
+
+// Results of a facet row read from the hits dataport, displayed moment
+typedef struct {
+  FacetHitBuffer hit;       // Counters of the shown result channel
+  double gasMass;           // Molar mass of the channel's gas (g/mol)
+  bool isEstimatorTarget;   // Forced detection target, simulation channel only
+  FacetHitBuffer estimate;  // Forced detection estimate of the incoming flux
+  bool isAdjoint;           // Adjoint run: forward physical values not available
+  double adjointTransfer;   // Adjoint results per launched adjoint particle
+  double adjointFlux;
+} FACETRESULT;
 
 class FacetDetails : public GLWindow {
 
@@ -50,8 +62,11 @@ private:
 
   char *GetCountStr(Facet *f);
   void UpdateTable();
-  char *FormatCell(size_t idx,Facet *f,size_t mode);
+  char *FormatCell(size_t idx,Facet *f,size_t mode,const FACETRESULT& res);
   void PlaceComponents();
+  void RefreshChannelCombo();
+  void ReadResults(size_t channel,const std::vector<size_t>& selectedFacets,std::vector<FACETRESULT>& results);
+  void ExportTable();
 
   Worker      *worker;
   GLList      *facetListD;
@@ -64,6 +79,8 @@ private:
   GLButton    *uncheckAllButton;
   GLButton    *dismissButton;
   GLButton	  *updateButton;
+  GLButton    *exportButton;
+  GLCombo     *channelCombo;    // Result channel of the hit columns: simulation, extra species, sweep scenarios
 
 };
 
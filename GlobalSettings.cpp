@@ -34,6 +34,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/GLToggle.h"
 #include "GLApp/GLTitledPanel.h"
 #include "Buffer_shared.h"
+#include <sstream>
 //#include "AppUpdater.h"
 #ifdef MOLFLOW
 #include "MolFlow.h"
@@ -165,6 +166,30 @@ GlobalSettings::GlobalSettings(Worker *w) :GLWindow() {
 	cutoffText->SetEditable(false);
 	simuSettingsPanel->Add(cutoffText);
 
+	GLLabel *splitLabel = new GLLabel("Split copies:");
+	splitLabel->SetBounds(450, 150, 60, 19);
+	simuSettingsPanel->Add(splitLabel);
+
+	splitFactorText = new GLTextField(0, "");
+	splitFactorText->SetBounds(520, 150, 40, 19);
+	simuSettingsPanel->Add(splitFactorText);
+
+	GLLabel *rouletteLabel = new GLLabel("Roulette:");
+	rouletteLabel->SetBounds(450, 175, 60, 19);
+	simuSettingsPanel->Add(rouletteLabel);
+
+	rouletteText = new GLTextField(0, "");
+	rouletteText->SetBounds(520, 175, 40, 19);
+	simuSettingsPanel->Add(rouletteText);
+
+	GLLabel *speciesLabel = new GLLabel("Extra species (g/mol):");
+	speciesLabel->SetBounds(290, 200, 150, 19);
+	simuSettingsPanel->Add(speciesLabel);
+
+	speciesText = new GLTextField(0, "");
+	speciesText->SetBounds(460, 195, 100, 19);
+	simuSettingsPanel->Add(speciesText);
+
 	applyButton = new GLButton(0, "Apply above settings");
 	applyButton->SetBounds(wD / 2 - 65, 235, 130, 19);
 	Add(applyButton);
@@ -193,6 +218,24 @@ GlobalSettings::GlobalSettings(Worker *w) :GLWindow() {
 	coreLabel->SetBounds(10, hD - 74, 120, 19);
 	panel3->Add(coreLabel);
 
+	GLLabel *l2 = new GLLabel("Threads per subprocess:");
+	l2->SetBounds(170, hD - 74, 120, 19);
+	panel3->Add(l2);
+
+	nbThreadsText = new GLTextField(0, "");
+	nbThreadsText->SetEditable(true);
+	nbThreadsText->SetBounds(290, hD - 76, 30, 19);
+	panel3->Add(nbThreadsText);
+
+	GLLabel *l3 = new GLLabel("Random seed (0: new each run):");
+	l3->SetBounds(330, hD - 74, 150, 19);
+	panel3->Add(l3);
+
+	randomSeedText = new GLTextField(0, "");
+	randomSeedText->SetEditable(true);
+	randomSeedText->SetBounds(wD - 95, hD - 76, 80, 19);
+	panel3->Add(randomSeedText);
+
 	GLLabel *l1 = new GLLabel("Number of subprocesses:");
 	l1->SetBounds(10, hD - 49, 120, 19);
 	panel3->Add(l1);
@@ -206,8 +249,26 @@ GlobalSettings::GlobalSettings(Worker *w) :GLWindow() {
 	restartButton->SetBounds(170, hD - 51, 150, 19);
 	panel3->Add(restartButton);
 
-	maxButton = new GLButton(0, "Change MAX desorbed molecules");
-	maxButton->SetBounds(wD - 195, hD - 51, 180, 19);
+	GLLabel *l4 = new GLLabel("Packet:");
+	l4->SetBounds(325, hD - 49, 35, 19);
+	panel3->Add(l4);
+
+	packetSizeText = new GLTextField(0, "");
+	packetSizeText->SetEditable(true);
+	packetSizeText->SetBounds(360, hD - 51, 20, 19);
+	panel3->Add(packetSizeText);
+
+	GLLabel *l5 = new GLLabel("BVH:");
+	l5->SetBounds(383, hD - 49, 25, 19);
+	panel3->Add(l5);
+
+	bvhWidthText = new GLTextField(0, "");
+	bvhWidthText->SetEditable(true);
+	bvhWidthText->SetBounds(408, hD - 51, 20, 19);
+	panel3->Add(bvhWidthText);
+
+	maxButton = new GLButton(0, "Change MAX desorbed");
+	maxButton->SetBounds(433, hD - 51, wD - 448, 19);
 	panel3->Add(maxButton);
 
 	
@@ -237,6 +298,13 @@ void GlobalSettings::Update() {
 
 	gasMassText->SetText(worker->wp.gasMass);
 
+	std::ostringstream speciesList;
+	for (size_t i = 0; i < mApp->engineParams.speciesMasses.size(); i++) {
+		if (i > 0) speciesList << ",";
+		speciesList << mApp->engineParams.speciesMasses[i];
+	}
+	speciesText->SetText(speciesList.str());
+
 	enableDecay->SetState(worker->wp.enableDecay);
 	halfLifeText->SetText(worker->wp.halfLife);
 	halfLifeText->SetEditable(worker->wp.enableDecay);
@@ -244,6 +312,8 @@ void GlobalSettings::Update() {
 	cutoffText->SetText(worker->ontheflyParams.lowFluxCutoff);
 	cutoffText->SetEditable(worker->ontheflyParams.lowFluxMode);
 	lowFluxToggle->SetState(worker->ontheflyParams.lowFluxMode);
+	splitFactorText->SetText((int)mApp->engineParams.splitFactor);
+	rouletteText->SetText(mApp->engineParams.rouletteThreshold);
 
 	autoSaveText->SetText(mApp->autoSaveFrequency);
 	chkSimuOnly->SetState(mApp->autoSaveSimuOnly);
@@ -260,6 +330,14 @@ void GlobalSettings::Update() {
 	size_t nb = worker->GetProcNumber();
 	sprintf(tmp, "%zd", nb);
 	nbProcText->SetText(tmp);
+	sprintf(tmp, "%zd", mApp->engineParams.nbThreads);
+	nbThreadsText->SetText(tmp);
+	sprintf(tmp, "%zd", mApp->engineParams.randomSeed);
+	randomSeedText->SetText(tmp);
+	sprintf(tmp, "%zd", mApp->engineParams.packetSize);
+	packetSizeText->SetText(tmp);
+	sprintf(tmp, "%zd", mApp->engineParams.bvhWidth);
+	bvhWidthText->SetText(tmp);
 }
 
 void GlobalSettings::SMPUpdate() {
@@ -343,10 +421,22 @@ void GlobalSettings::SMPUpdate() {
 
 void GlobalSettings::RestartProc() {
 
-	int nbProc;
+	int nbProc, nbThreads, randomSeed, packetSize, bvhWidth;
 	if (!nbProcText->GetNumberInt(&nbProc)) {
 		GLMessageBox::Display("Invalid process number", "Error", GLDLG_OK, GLDLG_ICONERROR);
 	}
+	else if (!nbThreadsText->GetNumberInt(&nbThreads) || nbThreads <= 0) {
+		GLMessageBox::Display("Invalid thread number", "Error", GLDLG_OK, GLDLG_ICONERROR);
+	}
+	else if (!randomSeedText->GetNumberInt(&randomSeed) || randomSeed < 0) {
+		GLMessageBox::Display("Invalid random seed", "Error", GLDLG_OK, GLDLG_ICONERROR);
+	}
+	else if (!packetSizeText->GetNumberInt(&packetSize) || packetSize < 1 || packetSize > 16) {
+		GLMessageBox::Display("Invalid packet size [1..16], particles traced together by each thread", "Error", GLDLG_OK, GLDLG_ICONERROR);
+	}
+	else if (!bvhWidthText->GetNumberInt(&bvhWidth) || (bvhWidth != 2 && bvhWidth != 4 && bvhWidth != 8)) {
+		GLMessageBox::Display("Invalid BVH width (2, 4 or 8), children per ray tracing tree node", "Error", GLDLG_OK, GLDLG_ICONERROR);
+	}
 	else {
 		//char tmp[128];
 		//sprintf(tmp,"Kill all running sub-process(es) and start %d new ones ?",nbProc);
@@ -358,6 +448,10 @@ void GlobalSettings::RestartProc() {
 			}
 			else {
 				try {
+					mApp->engineParams.nbThreads = (size_t)nbThreads;
+					mApp->engineParams.randomSeed = (size_t)randomSeed;
+					mApp->engineParams.packetSize = (size_t)packetSize;
+					mApp->engineParams.bvhWidth = (size_t)bvhWidth;
 					worker->SetProcNumber(nbProc);
 					worker->Reload();
 					mApp->SaveConfig();
@@ -446,6 +540,27 @@ void GlobalSettings::ProcessMessage(GLComponent *src, int message) {
 				}
 			}
 
+			//Comma-separated list of extra gas masses, each one at least as heavy as the simulated gas
+			std::vector<double> speciesMasses;
+			std::istringstream speciesList(speciesText->GetText());
+			std::string speciesItem;
+			while (std::getline(speciesList, speciesItem, ',')) {
+				if (speciesItem.find_first_not_of(" \t") == std::string::npos) continue;
+				double mass;
+				std::istringstream speciesValue(speciesItem);
+				if (!(speciesValue >> mass) || !(mass >= gm)) {
+					GLMessageBox::Display("Invalid extra species list: comma-separated masses (g/mol), none lighter than the gas mass", "Error", GLDLG_OK, GLDLG_ICONERROR);
+					return;
+				}
+				speciesMasses.push_back(mass);
+			}
+			if (speciesMasses != mApp->engineParams.speciesMasses) {
+				if (mApp->AskToReset()) {
+					worker->needsReload = true;
+					mApp->engineParams.speciesMasses = speciesMasses;
+				}
+			}
+
 			double hl;
 			if (enableDecay->GetState() && (!halfLifeText->GetNumber(&hl) || !(hl > 0.0))) {
 				GLMessageBox::Display("Invalid half life", "Error", GLDLG_OK, GLDLG_ICONERROR);
@@ -471,6 +586,25 @@ void GlobalSettings::ProcessMessage(GLComponent *src, int message) {
 				worker->ChangeSimuParams();
 			}
 
+			//Variance reduction, sent with the geometry
+			int splitFactor;
+			double rouletteThreshold;
+			if (!splitFactorText->GetNumberInt(&splitFactor) || splitFactor < 1) {
+				GLMessageBox::Display("Invalid split copies, must be at least 1 (1: no splitting)", "Error", GLDLG_OK, GLDLG_ICONERROR);
+				return;
+			}
+			if (!rouletteText->GetNumber(&rouletteThreshold) || !(rouletteThreshold >= 0.0 && rouletteThreshold < 1.0)) {
+				GLMessageBox::Display("Invalid roulette threshold, must be between 0 (off) and 1", "Error", GLDLG_OK, GLDLG_ICONERROR);
+				return;
+			}
+			if ((size_t)splitFactor != mApp->engineParams.splitFactor || !IsEqual(rouletteThreshold, mApp->engineParams.rouletteThreshold)) {
+				if (mApp->AskToReset()) {
+					worker->needsReload = true;
+					mApp->engineParams.splitFactor = (size_t)splitFactor;
+					mApp->engineParams.rouletteThreshold = rouletteThreshold;
+				}
+			}
+
 			double autosavefreq;
 			if (!autoSaveText->GetNumber(&autosavefreq) || !(autosavefreq > 0.0)) {
 				GLMessageBox::Display("Invalid autosave frequency", "Error", GLDLG_OK, GLDLG_ICONERROR);
@@ -51,6 +51,10 @@ private:
   GLButton    *restartButton;
   GLButton    *maxButton;
   GLTextField *nbProcText;
+  GLTextField *nbThreadsText;
+  GLTextField *randomSeedText;
+  GLTextField *packetSizeText;
+  GLTextField *bvhWidthText;
   GLTextField *autoSaveText;
  
 
@@ -76,6 +80,9 @@ private:
   GLToggle	*lowFluxToggle;
   GLButton    *lowFluxInfo;
   GLTextField *cutoffText;
+  GLTextField *speciesText;
+  GLTextField *splitFactorText;
+  GLTextField *rouletteText;
 };
 
 #endif /* _GLOBALSETTINGSH_ */
@@ -36,6 +36,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "GLApp/GLTitledPanel.h"
 #include "Buffer_shared.h"
 #include "Interface.h"
+#include "MolflowGeometry.h"
 #include <fstream>
 #ifdef MOLFLOW
 #include "MolFlow.h"
@@ -62,7 +63,7 @@ HistoryWin::HistoryWin(Worker *w) :GLWindow() {
 	worker = w;
 
 	// window size
-	int wD = 580;
+	int wD = 690;
 	int hD = 525;
 
 	// UI Setup
@@ -94,6 +95,16 @@ HistoryWin::HistoryWin(Worker *w) :GLWindow() {
 	panel3->Add(delBtn);
 	panel3->SetCompBounds(delBtn, 120, 20, 100, 18);
 
+	intBtn = new GLButton(0, "Integrate...");
+	intBtn->SetVisible(true);
+	panel3->Add(intBtn);
+	panel3->SetCompBounds(intBtn, 230, 20, 100, 18);
+
+	stepsBtn = new GLButton(0, "Engine steps");
+	stepsBtn->SetVisible(true);
+	panel3->Add(stepsBtn);
+	panel3->SetCompBounds(stepsBtn, 340, 20, 100, 18);
+
 	imBtn = new GLButton(0, "Import");
 	imBtn->SetVisible(true);
 	panel3->Add(imBtn);
@@ -106,6 +117,8 @@ HistoryWin::HistoryWin(Worker *w) :GLWindow() {
 
 	// variable initialization
 	l_hist = 0;
+	engineStepsRead = 0;
+	engineStepsStart = 0.0f;
 	pointintime_list = std::vector< std::pair<float, std::vector<size_t>> >();
 	selectedRows = std::vector<size_t>();
 	// set initial list
@@ -117,6 +130,8 @@ HistoryWin::HistoryWin(Worker *w) :GLWindow() {
 		historyList->AutoSizeColumn();
 		histBtn->SetVisible(false);
 		delBtn->SetVisible(false);
+		intBtn->SetVisible(false);
+		stepsBtn->SetVisible(false);
 		exBtn->SetVisible(false);
 		imBtn->SetVisible(false);
 	}
@@ -228,6 +243,14 @@ void HistoryWin::ProcessMessage(GLComponent *src, int message) {
 			deleteRows();
 		}
 
+		else if (src == intBtn) {
+			IntegrateCovering();
+		}
+
+		else if (src == stepsBtn) {
+			ReadEngineSteps();
+		}
+
 		else if (src == exBtn) {
 			exportUI();
 		}
@@ -388,4 +411,108 @@ void HistoryWin::UpdateCoveringfromList() {
 		f->facetHitCache.hit.covering = pointintime_list.back().second[i];
 	}
 	worker->simuTime = pointintime_list.back().first / (float)1000.0;
-}
\ No newline at end of file
+}
+void HistoryWin::IntegrateCovering() {
+	// Covering evolution of the transfer matrix facets without new MC runs: each facet desorbs its covering
+	// (first order, same rate as the facet panel) plus its constant outgassing, the matrix redistributes it
+	MolflowGeometry *mGeom = worker->GetMolflowGeometry();
+	BYTE *buffer = worker->GetHits();
+	if (buffer) {
+		mGeom->UpdateTransferMatrix(buffer);
+		worker->ReleaseHits();
+	}
+	const TransferMatrix& matrix = mGeom->transferMatrix;
+	if (matrix.IsEmpty()) {
+		GLMessageBox::Display("No transfer matrix: select facets in Facet menu / Transfer matrix facets..., then run", "Integrate covering", GLDLG_OK, GLDLG_ICONINFO);
+		return;
+	}
+
+	for (const size_t& id : matrix.facets) {
+		if (id >= nb_Facets) {
+			GLMessageBox::Display("Transfer matrix doesn't match the geometry", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+	}
+
+	char tmp[128];
+	double timeStep = 1.0;
+	int nbSteps = 100;
+	sprintf(tmp, "%g", timeStep);
+	char *val = GLInputBox::GetInput(tmp, "Time step (s)", "Integrate covering");
+	if (!val) return;
+	if (sscanf(val, "%lf", &timeStep) <= 0 || !(timeStep > 0.0)) {
+		GLMessageBox::Display("Invalid time step", "Error", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+	sprintf(tmp, "%d", nbSteps);
+	val = GLInputBox::GetInput(tmp, "Number of steps", "Integrate covering");
+	if (!val) return;
+	if (sscanf(val, "%d", &nbSteps) <= 0 || nbSteps < 1) {
+		GLMessageBox::Display("Invalid number of steps", "Error", GLDLG_OK, GLDLG_ICONERROR);
+		return;
+	}
+	if (worker->isRunning) worker->Stop_Public();
+
+	// Starting from the current covering
+	size_t nbTransfer = matrix.facets.size();
+	std::vector<size_t> covering(nb_Facets);
+	for (size_t i = 0; i < nb_Facets; i++)
+		covering[i] = geom->GetFacet(i)->facetHitCache.hit.covering;
+	std::vector<double> x(nbTransfer), rate(nbTransfer), source(nbTransfer, 0.0);
+	for (size_t i = 0; i < nbTransfer; i++) {
+		Facet *f = geom->GetFacet(matrix.facets[i]);
+		x[i] = (double)covering[matrix.facets[i]];
+		rate[i] = exp(-desorptionEnergy / (kb*f->sh.temperature)) / tau; //1/s
+		if (f->sh.desorbType != DES_NONE && f->sh.outgassing_paramId < 0)
+			source[i] = f->sh.outgassing / (kb*f->sh.temperature); //molecules/s
+	}
+	if (l_hist == 0) UpdateList(); //Starting point in the list
+	float time = pointintime_list.back().first;
+
+	for (int step = 0; step < nbSteps; step++) {
+		if (!matrix.Step(x, rate, source, timeStep)) {
+			sprintf(tmp, "No convergence at step %d, stopped", step + 1);
+			GLMessageBox::Display(tmp, "Integrate covering", GLDLG_OK, GLDLG_ICONWARNING);
+			break;
+		}
+		for (size_t i = 0; i < nbTransfer; i++)
+			covering[matrix.facets[i]] = (size_t)llround(Max(x[i], 0.0));
+		time += (float)(timeStep * 1000.0); //ms, as the list
+		pointintime_list.push_back(std::make_pair(time, covering));
+		l_hist += 1;
+	}
+	UpdateCoveringfromList();
+	UpdateUI();
+}
+
+void HistoryWin::ReadEngineSteps() {
+	// Rows of the covering evolution steps finished by the subprocess since the last read
+	const EngineParams& ep = mApp->engineParams;
+	if (ep.coveringFacets.empty()) {
+		GLMessageBox::Display("Covering evolution is off: select facets in Facet menu / Covering evolution..., then run", "Engine steps", GLDLG_OK, GLDLG_ICONINFO);
+		return;
+	}
+	MolflowGeometry *mGeom = worker->GetMolflowGeometry();
+	BYTE *buffer = worker->GetHits();
+	if (!buffer) return;
+	size_t nbCovering = ep.coveringFacets.size();
+	BYTE *timeline = buffer + mGeom->GetHitsOffset(HITS_COVERING, worker->moments.size());
+	size_t nbSteps = (size_t)*(llong*)timeline;
+	double *rows = (double*)(timeline + sizeof(llong));
+	if (nbSteps < engineStepsRead) engineStepsRead = 0; //New run
+	if (engineStepsRead == 0) {
+		if (l_hist == 0) UpdateList();
+		engineStepsStart = pointintime_list.back().first;
+	}
+	std::vector<size_t> covering = pointintime_list.back().second;
+	for (; engineStepsRead < nbSteps; engineStepsRead++) {
+		double *row = rows + engineStepsRead * (1 + nbCovering);
+		for (size_t i = 0; i < nbCovering; i++)
+			if (ep.coveringFacets[i] < covering.size()) covering[ep.coveringFacets[i]] = (size_t)llround(row[1 + i]);
+		pointintime_list.push_back(std::make_pair(engineStepsStart + (float)(row[0] * 1000.0), covering)); //ms
+		l_hist += 1;
+	}
+	worker->ReleaseHits();
+	UpdateCoveringfromList();
+	UpdateUI();
+}
@@ -58,12 +58,18 @@ private:
 	GLButton *delBtn;
 	GLButton *imBtn;
 	GLButton *exBtn;
+	GLButton *intBtn;
+	GLButton *stepsBtn;
+	size_t engineStepsRead; //Covering evolution steps of the current run already in the list
+	float engineStepsStart; //List time (ms) of the run's start
 
 	void exportUI();
 	void exportList(char *fileName);
 	void importList(char *fileName);
 	void importUI();
 	void UpdateCoveringfromList();
+	void IntegrateCovering();
+	void ReadEngineSteps();
 
 };
 
@@ -0,0 +1,990 @@
+/*
+Program:     ContaminationFlow
+Description: Monte Carlo simulator for satellite contanimation studies
+Authors:     Rudolf Schönmann / Hoai My Van
+Copyright:   TU Munich
+Forked from: Molflow (CERN) (https://cern.ch/molflow)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
+*/
+#include "Simulation.h"
+#include "IntersectAABB_shared.h"
+#include "GLApp/MathTools.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+#include <new>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SSE
+#include <immintrin.h>
+#if defined(__AVX__)
+#define BVH_AVX
+#endif
+#endif
+
+extern Simulation *sHandle; //delcared in molflowSub.cpp
+
+// BVH construction: binned surface area heuristic over the centers of the facet bounding boxes.
+// Costs are counted in facet tests, a node visit counting as one test
+static const size_t bvhBins = 16;
+static const size_t bvhMaxDepth = 48; //Deeper ranges become leaves, bounds the traversal stacks
+static const size_t bvhParallelFacets = 4096; //Ranges from this size build their right subtree in a new thread, down to spawnDepth
+static const double bvhNodeCost = 1.0;
+
+class BuildBox {
+public:
+	double min[3] = { 1E100, 1E100, 1E100 };
+	double max[3] = { -1E100, -1E100, -1E100 };
+	void Grow(const double* pMin, const double* pMax) {
+		for (int i = 0; i < 3; i++) {
+			if (pMin[i] < min[i]) min[i] = pMin[i];
+			if (pMax[i] > max[i]) max[i] = pMax[i];
+		}
+	}
+	void Grow(const BuildBox& b) { Grow(b.min, b.max); }
+	double HalfArea() const {
+		if (min[0] > max[0]) return 0.0; //Empty
+		double dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+		return dx * dy + dy * dz + dz * dx;
+	}
+};
+
+class BuildItem {
+public:
+	BuildBox bounds;
+	double center[3];
+};
+
+void SetNodeBounds(BVHNode& node, const BuildBox& b) {
+	// Float bounds never smaller than the double ones
+	for (int i = 0; i < 3; i++) {
+		float lo = (float)b.min[i];
+		float hi = (float)b.max[i];
+		if ((double)lo > b.min[i]) lo = std::nextafter(lo, -FLT_MAX);
+		if ((double)hi < b.max[i]) hi = std::nextafter(hi, FLT_MAX);
+		node.bbMin[i] = lo;
+		node.bbMax[i] = hi;
+	}
+}
+
+double NodeHalfArea(const BVHNode& node) {
+	double dx = node.bbMax[0] - node.bbMin[0], dy = node.bbMax[1] - node.bbMin[1], dz = node.bbMax[2] - node.bbMin[2];
+	return dx * dy + dy * dz + dz * dx;
+}
+
+size_t PartitionBVHRange(const std::vector<BuildItem>& items, uint32_t* order, size_t count, const BuildBox& bounds, const BuildBox& centers) {
+	// Reorders the range along the cheapest binned split, returns the facets put left, 0 if a leaf is cheaper
+	if (count < 2) return 0;
+	double parentArea = bounds.HalfArea();
+	double bestCost = (double)count; //Leaf: every facet tested
+	int bestAxis = -1;
+	size_t bestPlane = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		double extent = centers.max[axis] - centers.min[axis];
+		if (extent <= 0.0) continue;
+		double scale = (double)bvhBins / extent;
+		size_t binCount[bvhBins] = {};
+		BuildBox binBox[bvhBins];
+		for (size_t i = 0; i < count; i++) {
+			const BuildItem& item = items[order[i]];
+			size_t bin = Min(bvhBins - 1, (size_t)((item.center[axis] - centers.min[axis]) * scale));
+			binCount[bin]++;
+			binBox[bin].Grow(item.bounds);
+		}
+		// Right side of every plane, then sweep from the left
+		double rightArea[bvhBins];
+		size_t rightCount[bvhBins];
+		BuildBox box;
+		size_t nb = 0;
+		for (size_t plane = bvhBins - 1; plane > 0; plane--) {
+			box.Grow(binBox[plane]);
+			nb += binCount[plane];
+			rightArea[plane] = box.HalfArea();
+			rightCount[plane] = nb;
+		}
+		box = BuildBox();
+		nb = 0;
+		for (size_t plane = 1; plane < bvhBins; plane++) {
+			box.Grow(binBox[plane - 1]);
+			nb += binCount[plane - 1];
+			if (nb == 0 || rightCount[plane] == 0) continue;
+			double cost = bvhNodeCost + (parentArea > 0.0 ? (box.HalfArea() * (double)nb + rightArea[plane] * (double)rightCount[plane]) / parentArea : 0.0);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestPlane = plane;
+			}
+		}
+	}
+	if (bestAxis == -1) return 0;
+
+	double scale = (double)bvhBins / (centers.max[bestAxis] - centers.min[bestAxis]);
+	uint32_t* middle = std::partition(order, order + count, [&](const uint32_t& index) {
+		return Min(bvhBins - 1, (size_t)((items[index].center[bestAxis] - centers.min[bestAxis]) * scale)) < bestPlane;
+	});
+	return middle - order;
+}
+
+void BuildBVHRange(const std::vector<BuildItem>& items, std::vector<uint32_t>& order, size_t first, size_t count, size_t depth, const size_t& spawnDepth, std::vector<BVHNode>& nodes) {
+	// Appends the subtree of order[first..first+count[ to nodes, depth-first. Right child links are relative to the start of nodes
+	BuildBox bounds, centers;
+	for (size_t i = first; i < first + count; i++) {
+		const BuildItem& item = items[order[i]];
+		bounds.Grow(item.bounds);
+		centers.Grow(item.center, item.center);
+	}
+	size_t nodeIndex = nodes.size();
+	nodes.push_back(BVHNode());
+	SetNodeBounds(nodes[nodeIndex], bounds);
+
+	size_t nbLeft = depth < bvhMaxDepth ? PartitionBVHRange(items, order.data() + first, count, bounds, centers) : 0;
+	if (nbLeft == 0) { // Leaf
+		nodes[nodeIndex].offset = (uint32_t)first;
+		nodes[nodeIndex].count = (uint32_t)count;
+		return;
+	}
+	nodes[nodeIndex].count = 0;
+	if (count >= bvhParallelFacets && depth < spawnDepth) { //At most 2^spawnDepth threads building at once
+		// Right subtree built meanwhile in its own list, then moved behind the left one
+		std::vector<BVHNode> rightNodes;
+		bool rightFailed = false;
+		std::thread rightBuilder([&]() {
+			try {
+				BuildBVHRange(items, order, first + nbLeft, count - nbLeft, depth + 1, spawnDepth, rightNodes);
+			}
+			catch (...) {
+				rightFailed = true;
+			}
+		});
+		try {
+			BuildBVHRange(items, order, first, nbLeft, depth + 1, spawnDepth, nodes);
+		}
+		catch (...) {
+			rightBuilder.join();
+			throw;
+		}
+		rightBuilder.join();
+		if (rightFailed) throw std::bad_alloc();
+		uint32_t rightStart = (uint32_t)nodes.size();
+		for (BVHNode node : rightNodes) {
+			if (node.count == 0) node.offset += rightStart;
+			nodes.push_back(node);
+		}
+		nodes[nodeIndex].offset = rightStart;
+	}
+	else {
+		BuildBVHRange(items, order, first, nbLeft, depth + 1, spawnDepth, nodes);
+		nodes[nodeIndex].offset = (uint32_t)nodes.size();
+		BuildBVHRange(items, order, first + nbLeft, count - nbLeft, depth + 1, spawnDepth, nodes);
+	}
+}
+
+BVHStatistics GetBVHStatistics(const std::vector<BVHNode>& nodes) {
+	BVHStatistics stats;
+	stats.nbNodes = nodes.size();
+	if (nodes.empty()) return stats;
+	std::vector<size_t> depth(nodes.size(), 0); //Parents come before their children
+	double cost = 0.0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const BVHNode& node = nodes[i];
+		stats.maxDepth = Max(stats.maxDepth, depth[i]);
+		if (node.count) {
+			stats.nbLeaves++;
+			stats.maxLeafSize = Max(stats.maxLeafSize, (size_t)node.count);
+			cost += (double)node.count * NodeHalfArea(node);
+		}
+		else {
+			depth[i + 1] = depth[node.offset] = depth[i] + 1;
+			cost += bvhNodeCost * NodeHalfArea(node);
+		}
+	}
+	double rootArea = NodeHalfArea(nodes[0]);
+	stats.sahCost = rootArea > 0.0 ? cost / rootArea : (double)nodes[0].count;
+	return stats;
+}
+
+template <size_t W> uint32_t CollapseBVHNode(const std::vector<BVHNode>& nodes, const uint32_t& index, const float& pad, std::vector<WideBVHNode<W>>& wide) {
+	// Opens the largest inner child until W children are gathered, appends the wide node and its subtrees depth-first
+	std::vector<uint32_t> slots;
+	if (nodes[index].count) slots.push_back(index); //Leaf root
+	else slots = { index + 1, nodes[index].offset };
+	while (slots.size() < W) {
+		int largest = -1;
+		double largestArea = -1.0;
+		for (size_t i = 0; i < slots.size(); i++) {
+			if (nodes[slots[i]].count == 0 && NodeHalfArea(nodes[slots[i]]) > largestArea) {
+				largestArea = NodeHalfArea(nodes[slots[i]]);
+				largest = (int)i;
+			}
+		}
+		if (largest == -1) break;
+		uint32_t opened = slots[largest];
+		slots[largest] = opened + 1;
+		slots.insert(slots.begin() + largest + 1, nodes[opened].offset);
+	}
+
+	uint32_t wideIndex = (uint32_t)wide.size();
+	wide.push_back(WideBVHNode<W>());
+	WideBVHNode<W> node = {}; //Filled in a copy, wide grows while the children are added
+	node.nbChildren = (uint32_t)slots.size();
+	for (size_t i = 0; i < slots.size(); i++) {
+		const BVHNode& child = nodes[slots[i]];
+		node.minX[i] = child.bbMin[0] - pad; node.minY[i] = child.bbMin[1] - pad; node.minZ[i] = child.bbMin[2] - pad;
+		node.maxX[i] = child.bbMax[0] + pad; node.maxY[i] = child.bbMax[1] + pad; node.maxZ[i] = child.bbMax[2] + pad;
+		node.count[i] = child.count;
+		node.child[i] = child.count ? child.offset : CollapseBVHNode(nodes, slots[i], pad, wide);
+	}
+	wide[wideIndex] = node;
+	return wideIndex;
+}
+
+template <size_t W> void CollapseBVH(const std::vector<BVHNode>& nodes, std::vector<WideBVHNode<W>>& wide) {
+	// Boxes padded by 1E-5 of the largest coordinate: covers the rounding of the ray origin and of the slab arithmetic to floats
+	wide.clear();
+	if (nodes.empty()) return;
+	float scale = 0.0f;
+	for (int i = 0; i < 3; i++)
+		scale = Max(scale, Max(std::fabs(nodes[0].bbMin[i]), std::fabs(nodes[0].bbMax[i])));
+	wide.reserve(nodes.size() / (W - 1) + 1);
+	CollapseBVHNode(nodes, 0, 1E-5f * scale + 1E-6f, wide);
+}
+
+void BuildBVH(SuperStructure& s, const size_t& width, const size_t& nbThreads) {
+	// Replaces the structure's tree (and its wide version if width is 4 or 8) using up to nbThreads threads,
+	// throws on memory or thread creation failure
+	s.bvhNodes.clear();
+	s.bvhFacets.clear();
+	s.bvhRayData.clear();
+	s.bvhStats = BVHStatistics();
+	s.bvh4Nodes.clear();
+	s.bvh8Nodes.clear();
+	if (s.facets.empty()) return;
+
+	std::vector<BuildItem> items(s.facets.size());
+	std::vector<uint32_t> order(s.facets.size());
+	for (size_t i = 0; i < s.facets.size(); i++) {
+		const AxisAlignedBoundingBox& bb = s.facets[i].sh.bb;
+		const double bbMin[3] = { bb.min.x, bb.min.y, bb.min.z };
+		const double bbMax[3] = { bb.max.x, bb.max.y, bb.max.z };
+		items[i].bounds.Grow(bbMin, bbMax);
+		for (int j = 0; j < 3; j++)
+			items[i].center[j] = 0.5 * (bbMin[j] + bbMax[j]);
+		order[i] = (uint32_t)i;
+	}
+	size_t spawnDepth = 0; //log2 of nbThreads, rounded down
+	while (((size_t)2 << spawnDepth) <= nbThreads) spawnDepth++;
+	s.bvhNodes.reserve(2 * s.facets.size() - 1);
+	BuildBVHRange(items, order, 0, order.size(), 0, spawnDepth, s.bvhNodes);
+	s.bvhFacets.resize(order.size());
+	s.bvhRayData.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		SubprocessFacet& f = s.facets[order[i]];
+		s.bvhFacets[i] = &f;
+		FacetRayData& r = s.bvhRayData[i];
+		r.origin = f.sh.O;
+		r.normal = f.sh.Nuv;
+		Vector3d uNormal = CrossProduct(f.sh.V, f.sh.Nuv);
+		Vector3d vNormal = CrossProduct(f.sh.Nuv, f.sh.U);
+		r.uInverse = (1.0 / Dot(f.sh.U, uNormal)) * uNormal;
+		r.vInverse = (1.0 / Dot(f.sh.V, vNormal)) * vNormal;
+		r.is2sided = f.sh.is2sided;
+		r.opaque = f.sh.opacity_paramId == -1 && !(f.sh.opacity < 1.0);
+	}
+	s.bvhStats = GetBVHStatistics(s.bvhNodes);
+	if (width == 4) CollapseBVH(s.bvhNodes, s.bvh4Nodes);
+	else if (width == 8) CollapseBVH(s.bvhNodes, s.bvh8Nodes);
+}
+
+bool SubprocessFacet::IsInside(const double& u, const double& v) const {
+	// u and v already checked to be in [0,1]
+	if (polygonGrid.size) {
+		size_t i = Min(polygonGrid.size - 1, (size_t)(u * polygonGrid.size));
+		size_t j = Min(polygonGrid.size - 1, (size_t)(v * polygonGrid.size));
+		char cell = polygonGrid.cells[j * polygonGrid.size + i];
+		if (cell != 2) return cell == 1;
+	}
+	return IsInFacet(*this, u, v);
+}
+
+// Ray tracing for the MC worker threads. The BVH built in LoadSimulation() is only read,
+// collision coordinates go to the thread's CurrentParticleStatus instead of the (shared) facets.
+
+bool RayHitsBox(const BVHNode& node, const Vector3d& rayPos, const Vector3d& inverseRayDir, const bool* nullDir, double maxLength = 1E100, double* entry = NULL) {
+	double tMin = 0.0;
+	double tMax = maxLength;
+	const double pos[3] = { rayPos.x, rayPos.y, rayPos.z };
+	const double inv[3] = { inverseRayDir.x, inverseRayDir.y, inverseRayDir.z };
+	const double bbMin[3] = { node.bbMin[0], node.bbMin[1], node.bbMin[2] };
+	const double bbMax[3] = { node.bbMax[0], node.bbMax[1], node.bbMax[2] };
+	for (int i = 0; i < 3; i++) {
+		if (nullDir[i]) { //parallel to slab
+			if (pos[i] < bbMin[i] || pos[i] > bbMax[i]) return false;
+		}
+		else {
+			double t1 = (bbMin[i] - pos[i]) * inv[i];
+			double t2 = (bbMax[i] - pos[i]) * inv[i];
+			if (t1 > t2) std::swap(t1, t2);
+			if (t1 > tMin) tMin = t1;
+			if (t2 < tMax) tMax = t2;
+			if (tMin > tMax) return false;
+		}
+	}
+	if (entry) *entry = tMin;
+	return true;
+}
+
+void ThreadIntersectLeaf(const SuperStructure& s, const uint32_t& first, const uint32_t& count, const Vector3d& rayPos, const Vector3d& rayDirOpposite,
+	SubprocessFacet* const lastHitBefore, bool& found, SubprocessFacet*& collidedFacet, double& minLength, double& colU, double& colV) {
+
+	for (uint32_t i = first; i < first + count; i++) {
+		SubprocessFacet* f = s.bvhFacets[i];
+		// Do not check last collided facet
+		if (f == lastHitBefore) continue;
+		const FacetRayData& r = s.bvhRayData[i];
+		double det = Dot(r.normal, rayDirOpposite);
+		// Eliminate "back facet"
+		if ((r.is2sided || det > 0.0) && det != 0.0) {
+			// Ray/plane distance, then (u,v) of the hit point in the dual basis. Check 0<=u<=1, 0<=v<=1, dist>0
+			Vector3d intZ = rayPos - r.origin;
+			double d = Dot(r.normal, intZ) / det;
+			if (d <= 0.0) continue;
+			Vector3d hitZ = intZ - d * rayDirOpposite;
+			double u = Dot(r.uInverse, hitZ);
+			if (u < 0.0 || u > 1.0) continue;
+			double v = Dot(r.vInverse, hitZ);
+			if (v < 0.0 || v > 1.0 || !f->IsInside(u, v)) continue;
+
+			// Partially transparent facets: decide with the thread's own generator
+			double opacity = r.opaque ? 1.0 : (f->sh.opacity_paramId == -1) ? f->sh.opacity
+				: GetOpacityAt(f, tHandle->currentParticle.flightTime + d / 100.0 / tHandle->currentParticle.velocity);
+			if (opacity < 1.0 && tHandle->rnd() > opacity) {
+				tHandle->currentParticle.transparentHitBuffer.push_back({ f, d, u, v });
+			}
+			else if (d < minLength) {
+				minLength = d;
+				collidedFacet = f;
+				colU = u;
+				colV = v;
+				found = true;
+			}
+		}
+	}
+}
+
+bool ThreadTransmissionLeaf(const SuperStructure& s, const uint32_t& first, const uint32_t& count, const Vector3d& rayPos, const Vector3d& rayDirOpposite,
+	double maxLength, SubprocessFacet* const source, SubprocessFacet* const target, double& transmission) {
+	// Returns false as soon as the segment is blocked
+	for (uint32_t i = first; i < first + count; i++) {
+		SubprocessFacet* f = s.bvhFacets[i];
+		if (f == source || f == target) continue;
+		const FacetRayData& r = s.bvhRayData[i];
+		double det = Dot(r.normal, rayDirOpposite);
+		if ((r.is2sided || det > 0.0) && det != 0.0) {
+			Vector3d intZ = rayPos - r.origin;
+			double d = Dot(r.normal, intZ) / det;
+			if (d <= 0.0 || d >= maxLength) continue;
+			Vector3d hitZ = intZ - d * rayDirOpposite;
+			double u = Dot(r.uInverse, hitZ);
+			if (u < 0.0 || u > 1.0) continue;
+			double v = Dot(r.vInverse, hitZ);
+			if (v < 0.0 || v > 1.0 || !f->IsInside(u, v)) continue;
+
+			// Links, teleports and volatile facets end the segment: such paths are tallied by the analog hits
+			if (f->sh.superDest || f->sh.teleportDest || f->sh.isVolatile) return false;
+			double opacity = r.opaque ? 1.0 : (f->sh.opacity_paramId == -1) ? f->sh.opacity
+				: GetOpacityAt(f, tHandle->currentParticle.flightTime + d / 100.0 / tHandle->currentParticle.velocity);
+			transmission *= (1.0 - opacity);
+			if (transmission <= 0.0) return false;
+		}
+	}
+	return true;
+}
+
+// Wide BVH traversal: the child boxes of a node are tested together in float, SSE for 4 children, AVX for 8
+// (two SSE steps if the build has no AVX, plain loops without SSE)
+
+class WideRay {
+public:
+	float pos[3];
+	float inv[3];
+	bool nullDir[3]; //Also for components too small for a float inverse: parallel within the box padding
+	WideRay(const Vector3d& rayPos, const Vector3d& rayDir) {
+		const double p[3] = { rayPos.x, rayPos.y, rayPos.z };
+		const double d[3] = { rayDir.x, rayDir.y, rayDir.z };
+		for (int i = 0; i < 3; i++) {
+			pos[i] = (float)p[i];
+			nullDir[i] = std::fabs(d[i]) < 1E-30;
+			inv[i] = nullDir[i] ? 0.0f : (float)(1.0 / d[i]);
+		}
+	}
+};
+
+class WideStackEntry {
+public:
+	uint32_t index; //Node, or first facet of a leaf
+	uint32_t count; //Facets of a leaf, 0 for a node
+	float tNear; //Entry distance of its box
+};
+
+#ifdef BVH_SSE
+uint32_t SlabTest4(const float* const* bbMin, const float* const* bbMax, const WideRay& ray, const float& tMax, float* tNear) {
+	__m128 tN = _mm_setzero_ps();
+	__m128 tF = _mm_set1_ps(tMax);
+	__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	for (int i = 0; i < 3; i++) {
+		__m128 lo = _mm_loadu_ps(bbMin[i]);
+		__m128 hi = _mm_loadu_ps(bbMax[i]);
+		__m128 pos = _mm_set1_ps(ray.pos[i]);
+		if (ray.nullDir[i]) { //Parallel to slab: inside or never
+			inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(pos, lo), _mm_cmple_ps(pos, hi)));
+		}
+		else {
+			__m128 inv = _mm_set1_ps(ray.inv[i]);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(lo, pos), inv);
+			__m128 t2 = _mm_mul_ps(_mm_sub_ps(hi, pos), inv);
+			tN = _mm_max_ps(tN, _mm_min_ps(t1, t2));
+			tF = _mm_min_ps(tF, _mm_max_ps(t1, t2));
+		}
+	}
+	_mm_storeu_ps(tNear, tN);
+	return (uint32_t)_mm_movemask_ps(_mm_and_ps(inside, _mm_cmple_ps(tN, tF)));
+}
+#endif
+
+#ifdef BVH_AVX
+uint32_t SlabTest8(const float* const* bbMin, const float* const* bbMax, const WideRay& ray, const float& tMax, float* tNear) {
+	__m256 tN = _mm256_setzero_ps();
+	__m256 tF = _mm256_set1_ps(tMax);
+	__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	for (int i = 0; i < 3; i++) {
+		__m256 lo = _mm256_loadu_ps(bbMin[i]);
+		__m256 hi = _mm256_loadu_ps(bbMax[i]);
+		__m256 pos = _mm256_set1_ps(ray.pos[i]);
+		if (ray.nullDir[i]) {
+			inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(pos, lo, _CMP_GE_OQ), _mm256_cmp_ps(pos, hi, _CMP_LE_OQ)));
+		}
+		else {
+			__m256 inv = _mm256_set1_ps(ray.inv[i]);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(lo, pos), inv);
+			__m256 t2 = _mm256_mul_ps(_mm256_sub_ps(hi, pos), inv);
+			tN = _mm256_max_ps(tN, _mm256_min_ps(t1, t2));
+			tF = _mm256_min_ps(tF, _mm256_max_ps(t1, t2));
+		}
+	}
+	_mm256_storeu_ps(tNear, tN);
+	return (uint32_t)_mm256_movemask_ps(_mm256_and_ps(inside, _mm256_cmp_ps(tN, tF, _CMP_LE_OQ)));
+}
+#endif
+
+template <size_t W> uint32_t WideHitsBoxes(const WideBVHNode<W>& node, const WideRay& ray, const float& tMax, float* tNear) {
+	// Children whose box the ray enters before tMax, with their entry distances
+	const float* bbMin[3] = { node.minX, node.minY, node.minZ };
+	const float* bbMax[3] = { node.maxX, node.maxY, node.maxZ };
+	uint32_t hits = 0;
+#if defined(BVH_AVX)
+	if (W == 8) hits = SlabTest8(bbMin, bbMax, ray, tMax, tNear);
+	else
+#endif
+#if defined(BVH_SSE)
+	for (size_t first = 0; first < W; first += 4) {
+		const float* halfMin[3] = { bbMin[0] + first, bbMin[1] + first, bbMin[2] + first };
+		const float* halfMax[3] = { bbMax[0] + first, bbMax[1] + first, bbMax[2] + first };
+		hits |= SlabTest4(halfMin, halfMax, ray, tMax, tNear + first) << first;
+	}
+#else
+	for (size_t c = 0; c < W; c++) {
+		float tN = 0.0f;
+		float tF = tMax;
+		bool inside = true;
+		for (int i = 0; i < 3; i++) {
+			if (ray.nullDir[i]) {
+				inside = inside && ray.pos[i] >= bbMin[i][c] && ray.pos[i] <= bbMax[i][c];
+			}
+			else {
+				float t1 = (bbMin[i][c] - ray.pos[i]) * ray.inv[i];
+				float t2 = (bbMax[i][c] - ray.pos[i]) * ray.inv[i];
+				tN = Max(tN, Min(t1, t2));
+				tF = Min(tF, Max(t1, t2));
+			}
+		}
+		tNear[c] = tN;
+		if (inside && tN <= tF) hits |= 1u << c;
+	}
+#endif
+	return hits & ((1u << node.nbChildren) - 1);
+}
+
+template <size_t W> void ThreadIntersectWide(const SuperStructure& s, const std::vector<WideBVHNode<W>>& nodes, const Vector3d& rayPos, const Vector3d& rayDir,
+	const Vector3d& rayDirOpposite, SubprocessFacet* const lastHitBefore, bool& found, SubprocessFacet*& collidedFacet, double& minLength, double& colU, double& colV) {
+	// Closest child first, boxes entered beyond the closest hit found so far are skipped
+	WideRay ray(rayPos, rayDir);
+	WideStackEntry stack[W * (bvhMaxDepth + 1)];
+	size_t stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0.0f };
+	while (stackSize) {
+		WideStackEntry entry = stack[--stackSize];
+		if (entry.tNear > minLength) continue;
+		if (entry.count) {
+			ThreadIntersectLeaf(s, entry.index, entry.count, rayPos, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength, colU, colV);
+			continue;
+		}
+		const WideBVHNode<W>& node = nodes[entry.index];
+		float tNear[W];
+		uint32_t hits = WideHitsBoxes(node, ray, (float)Min(minLength, (double)FLT_MAX), tNear);
+		size_t first = stackSize;
+		for (size_t c = 0; c < node.nbChildren; c++) {
+			if (!(hits & (1u << c))) continue;
+			WideStackEntry child = { node.child[c], node.count[c], tNear[c] };
+			size_t j = stackSize++;
+			for (; j > first && stack[j - 1].tNear < child.tNear; j--) //Kept in decreasing distance, the closest on top
+				stack[j] = stack[j - 1];
+			stack[j] = child;
+		}
+	}
+}
+
+template <size_t W> bool ThreadTransmissionWide(const SuperStructure& s, const std::vector<WideBVHNode<W>>& nodes, const Vector3d& rayPos, const Vector3d& rayDir,
+	const Vector3d& rayDirOpposite, double maxLength, SubprocessFacet* const source, SubprocessFacet* const target, double& transmission) {
+	// Returns false as soon as the segment is blocked, any order
+	WideRay ray(rayPos, rayDir);
+	float tMax = (float)Min(maxLength, (double)FLT_MAX);
+	uint32_t stack[W * (bvhMaxDepth + 1)];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize) {
+		const WideBVHNode<W>& node = nodes[stack[--stackSize]];
+		float tNear[W];
+		uint32_t hits = WideHitsBoxes(node, ray, tMax, tNear);
+		for (size_t c = 0; c < node.nbChildren; c++) {
+			if (!(hits & (1u << c))) continue;
+			if (node.count[c]) {
+				if (!ThreadTransmissionLeaf(s, node.child[c], node.count[c], rayPos, rayDirOpposite, maxLength, source, target, transmission)) return false;
+			}
+			else stack[stackSize++] = node.child[c];
+		}
+	}
+	return true;
+}
+
+const char* WideBVHInstructions() {
+	// For the load log
+	if (sHandle->ep.bvhWidth == 8) {
+#if defined(BVH_AVX)
+		return "8-wide BVH, AVX";
+#elif defined(BVH_SSE)
+		return "8-wide BVH, 2x SSE";
+#endif
+	}
+	else if (sHandle->ep.bvhWidth == 4) {
+#if defined(BVH_SSE)
+		return "4-wide BVH, SSE";
+#endif
+	}
+	else return "binary BVH";
+	return "wide BVH, scalar";
+}
+
+const SuperStructure* UniversalStructure() {
+	// Tree of the facets in all structures, only if there are several structures (see LoadSimulation)
+	return sHandle->structures.size() > sHandle->sh.nbSuper ? &sHandle->structures.back() : NULL;
+}
+
+void ThreadIntersectStructure(const SuperStructure& s, const Vector3d& rayPos, const Vector3d& rayDir, const Vector3d& rayDirOpposite, const Vector3d& inverseRayDir,
+	const bool* nullDir, SubprocessFacet* const lastHitBefore, bool& found, SubprocessFacet*& collidedFacet, double& minLength, double& colU, double& colV) {
+	// Bottom level: one structure's tree, wide or binary
+	if (!s.bvh4Nodes.empty()) {
+		ThreadIntersectWide(s, s.bvh4Nodes, rayPos, rayDir, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength, colU, colV);
+	}
+	else if (!s.bvh8Nodes.empty()) {
+		ThreadIntersectWide(s, s.bvh8Nodes, rayPos, rayDir, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength, colU, colV);
+	}
+	else if (!s.bvhNodes.empty()) {
+		// Binary tree: depth-first, left child first
+		uint32_t stack[bvhMaxDepth + 1];
+		size_t stackSize = 0;
+		stack[stackSize++] = 0; //Root box tested by the caller
+		while (stackSize) {
+			uint32_t index = stack[--stackSize];
+			const BVHNode& node = s.bvhNodes[index];
+			if (node.count) {
+				ThreadIntersectLeaf(s, node.offset, node.count, rayPos, rayDirOpposite, lastHitBefore, found, collidedFacet, minLength, colU, colV);
+			}
+			else {
+				if (RayHitsBox(s.bvhNodes[node.offset], rayPos, inverseRayDir, nullDir)) stack[stackSize++] = node.offset;
+				if (RayHitsBox(s.bvhNodes[index + 1], rayPos, inverseRayDir, nullDir)) stack[stackSize++] = index + 1;
+			}
+		}
+	}
+}
+
+std::tuple<bool, SubprocessFacet*, double> ThreadIntersect(const Vector3d& rayPos, const Vector3d& rayDir) {
+	// Returns the closest hard hit in the current structure, records transparent passes on the way
+	CurrentParticleStatus& particle = tHandle->currentParticle;
+
+	bool found = false;
+	SubprocessFacet* collidedFacet = NULL;
+	double minLength = 1e100;
+	double colU = 0.0, colV = 0.0;
+
+	const bool nullDir[3] = { rayDir.x == 0.0, rayDir.y == 0.0, rayDir.z == 0.0 };
+	Vector3d inverseRayDir(nullDir[0] ? 0.0 : 1.0 / rayDir.x, nullDir[1] ? 0.0 : 1.0 / rayDir.y, nullDir[2] ? 0.0 : 1.0 / rayDir.z);
+	Vector3d rayDirOpposite(-1.0 * rayDir);
+
+	// Top level: the structure's tree and the one of the facets in all structures, the nearer root box first.
+	// The other is skipped if entered beyond the closest hit
+	const SuperStructure* trees[2] = { &sHandle->structures[particle.structureId], UniversalStructure() };
+	double entry[2] = { 1e100, 1e100 };
+	for (size_t i = 0; i < 2; i++) {
+		if (trees[i] && !trees[i]->bvhNodes.empty() && !RayHitsBox(trees[i]->bvhNodes[0], rayPos, inverseRayDir, nullDir, 1E100, &entry[i]))
+			trees[i] = NULL;
+	}
+	if (trees[1] && entry[1] < entry[0]) {
+		std::swap(trees[0], trees[1]);
+		std::swap(entry[0], entry[1]);
+	}
+
+	particle.transparentHitBuffer.clear();
+	for (size_t i = 0; i < 2; i++) {
+		if (!trees[i] || trees[i]->bvhNodes.empty() || entry[i] > minLength * (1.0 + 1E-9)) continue;
+		ThreadIntersectStructure(*trees[i], rayPos, rayDir, rayDirOpposite, inverseRayDir, nullDir, particle.lastHitFacet, found, collidedFacet, minLength, colU, colV);
+	}
+
+	// Register transparent passes that happened before the hard hit
+	for (const TransparentHit& hit : particle.transparentHitBuffer) {
+		if (hit.colDist < minLength) {
+			particle.colU = hit.colU;
+			particle.colV = hit.colV;
+			RecordTransparentPass(hit.facet, hit.colDist);
+		}
+	}
+
+	if (found) {
+		particle.colU = colU;
+		particle.colV = colV;
+	}
+	return { found, collidedFacet, minLength };
+}
+
+bool ThreadTransmissionStructure(const SuperStructure& s, const Vector3d& rayPos, const Vector3d& rayDir, const Vector3d& rayDirOpposite, const Vector3d& inverseRayDir,
+	const bool* nullDir, double maxLength, SubprocessFacet* const source, SubprocessFacet* const target, double& transmission) {
+	// Returns false as soon as the segment is blocked
+	if (s.bvhNodes.empty()) return true;
+	if (!s.bvh4Nodes.empty())
+		return ThreadTransmissionWide(s, s.bvh4Nodes, rayPos, rayDir, rayDirOpposite, maxLength, source, target, transmission);
+	if (!s.bvh8Nodes.empty())
+		return ThreadTransmissionWide(s, s.bvh8Nodes, rayPos, rayDir, rayDirOpposite, maxLength, source, target, transmission);
+	uint32_t stack[bvhMaxDepth + 1];
+	size_t stackSize = 0;
+	if (RayHitsBox(s.bvhNodes[0], rayPos, inverseRayDir, nullDir, maxLength)) stack[stackSize++] = 0;
+	while (stackSize) {
+		uint32_t index = stack[--stackSize];
+		const BVHNode& node = s.bvhNodes[index];
+		if (node.count) {
+			if (!ThreadTransmissionLeaf(s, node.offset, node.count, rayPos, rayDirOpposite, maxLength, source, target, transmission)) return false;
+		}
+		else {
+			if (RayHitsBox(s.bvhNodes[node.offset], rayPos, inverseRayDir, nullDir, maxLength)) stack[stackSize++] = node.offset;
+			if (RayHitsBox(s.bvhNodes[index + 1], rayPos, inverseRayDir, nullDir, maxLength)) stack[stackSize++] = index + 1;
+		}
+	}
+	return true;
+}
+
+double ThreadTransmission(const Vector3d& rayPos, const Vector3d& rayDir, double maxLength, SubprocessFacet* const source, SubprocessFacet* const target) {
+	// Shadow ray for the forced detection estimator: fraction of molecules going from rayPos to the target point at maxLength
+	// without being stopped (product of 1-opacity of the facets crossed). No random numbers and nothing recorded
+	const bool nullDir[3] = { rayDir.x == 0.0, rayDir.y == 0.0, rayDir.z == 0.0 };
+	Vector3d inverseRayDir(nullDir[0] ? 0.0 : 1.0 / rayDir.x, nullDir[1] ? 0.0 : 1.0 / rayDir.y, nullDir[2] ? 0.0 : 1.0 / rayDir.z);
+	Vector3d rayDirOpposite(-1.0 * rayDir);
+
+	double transmission = 1.0;
+	const SuperStructure* universal = UniversalStructure();
+	if (!ThreadTransmissionStructure(sHandle->structures[tHandle->currentParticle.structureId], rayPos, rayDir, rayDirOpposite, inverseRayDir, nullDir,
+		maxLength, source, target, transmission)) return 0.0;
+	if (universal && !ThreadTransmissionStructure(*universal, rayPos, rayDir, rayDirOpposite, inverseRayDir, nullDir,
+		maxLength, source, target, transmission)) return 0.0;
+	return transmission;
+}
+
+void RayPacket::Add(const size_t& laneIndex, const CurrentParticleStatus& particle)
+{
+	size_t r = nbRays++;
+	lane[r] = laneIndex;
+	structureId[r] = particle.structureId;
+	lastHitFacet[r] = particle.lastHitFacet;
+	posX[r] = particle.position.x; posY[r] = particle.position.y; posZ[r] = particle.position.z;
+	oppX[r] = -1.0 * particle.direction.x; oppY[r] = -1.0 * particle.direction.y; oppZ[r] = -1.0 * particle.direction.z;
+	nullX[r] = particle.direction.x == 0.0; nullY[r] = particle.direction.y == 0.0; nullZ[r] = particle.direction.z == 0.0;
+	invX[r] = nullX[r] ? 0.0 : 1.0 / particle.direction.x;
+	invY[r] = nullY[r] ? 0.0 : 1.0 / particle.direction.y;
+	invZ[r] = nullZ[r] ? 0.0 : 1.0 / particle.direction.z;
+	minLength[r] = 1e100;
+	collidedFacet[r] = NULL;
+	candidates[r].clear();
+}
+
+#ifdef BVH_SSE
+uint32_t PacketBox2(const BVHNode& node, const double* const* pos, const double* const* inv, const bool* const* nullDir, const size_t& r) {
+	// RayHitsBox() for rays r and r+1, selects instead of branches
+	__m128d tN = _mm_setzero_pd();
+	__m128d tF = _mm_set1_pd(1E100);
+	__m128d outside = _mm_setzero_pd(); //Parallel to a slab and outside of it
+	for (int i = 0; i < 3; i++) {
+		__m128d lo = _mm_set1_pd(node.bbMin[i]);
+		__m128d hi = _mm_set1_pd(node.bbMax[i]);
+		__m128d p = _mm_loadu_pd(pos[i] + r);
+		__m128d iv = _mm_loadu_pd(inv[i] + r);
+		__m128d isNull = _mm_castsi128_pd(_mm_set_epi64x(-(long long)nullDir[i][r + 1], -(long long)nullDir[i][r]));
+		__m128d t1 = _mm_mul_pd(_mm_sub_pd(lo, p), iv);
+		__m128d t2 = _mm_mul_pd(_mm_sub_pd(hi, p), iv); //Both 0 on null components, don't shorten tF there
+		__m128d tFar = _mm_or_pd(_mm_and_pd(isNull, tF), _mm_andnot_pd(isNull, _mm_max_pd(t1, t2)));
+		tN = _mm_max_pd(tN, _mm_min_pd(t1, t2));
+		tF = _mm_min_pd(tF, tFar);
+		outside = _mm_or_pd(outside, _mm_andnot_pd(_mm_and_pd(_mm_cmpge_pd(p, lo), _mm_cmple_pd(p, hi)), isNull));
+	}
+	return (uint32_t)_mm_movemask_pd(_mm_andnot_pd(outside, _mm_cmple_pd(tN, tF)));
+}
+
+uint32_t PacketFacet2(const FacetRayData& data, const RayPacket& packet, const size_t& r, double* d, double* u, double* v) {
+	// ThreadIntersectLeaf()'s arithmetic and bound tests for rays r and r+1, the polygon test is left to the caller
+	__m128d oppX = _mm_loadu_pd(packet.oppX + r), oppY = _mm_loadu_pd(packet.oppY + r), oppZ = _mm_loadu_pd(packet.oppZ + r);
+	__m128d nX = _mm_set1_pd(data.normal.x), nY = _mm_set1_pd(data.normal.y), nZ = _mm_set1_pd(data.normal.z);
+	__m128d det = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nX, oppX), _mm_mul_pd(nY, oppY)), _mm_mul_pd(nZ, oppZ));
+	__m128d iDet = _mm_div_pd(_mm_set1_pd(1.0), det); //Rays with det=0 are dropped below
+	__m128d intZx = _mm_sub_pd(_mm_loadu_pd(packet.posX + r), _mm_set1_pd(data.origin.x));
+	__m128d intZy = _mm_sub_pd(_mm_loadu_pd(packet.posY + r), _mm_set1_pd(data.origin.y));
+	__m128d intZz = _mm_sub_pd(_mm_loadu_pd(packet.posZ + r), _mm_set1_pd(data.origin.z));
+	__m128d dist = _mm_mul_pd(iDet, _mm_add_pd(_mm_add_pd(_mm_mul_pd(nX, intZx), _mm_mul_pd(nY, intZy)), _mm_mul_pd(nZ, intZz)));
+	__m128d hitZx = _mm_sub_pd(intZx, _mm_mul_pd(dist, oppX));
+	__m128d hitZy = _mm_sub_pd(intZy, _mm_mul_pd(dist, oppY));
+	__m128d hitZz = _mm_sub_pd(intZz, _mm_mul_pd(dist, oppZ));
+	__m128d uu = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(data.uInverse.x), hitZx), _mm_mul_pd(_mm_set1_pd(data.uInverse.y), hitZy)), _mm_mul_pd(_mm_set1_pd(data.uInverse.z), hitZz));
+	__m128d vv = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(data.vInverse.x), hitZx), _mm_mul_pd(_mm_set1_pd(data.vInverse.y), hitZy)), _mm_mul_pd(_mm_set1_pd(data.vInverse.z), hitZz));
+	_mm_storeu_pd(d + r, dist);
+	_mm_storeu_pd(u + r, uu);
+	_mm_storeu_pd(v + r, vv);
+	__m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+	__m128d valid = data.is2sided ? _mm_cmpneq_pd(det, zero) : _mm_cmpgt_pd(det, zero);
+	valid = _mm_and_pd(valid, _mm_and_pd(_mm_cmpge_pd(uu, zero), _mm_cmple_pd(uu, one)));
+	valid = _mm_and_pd(valid, _mm_and_pd(_mm_cmpge_pd(vv, zero), _mm_cmple_pd(vv, one)));
+	valid = _mm_and_pd(valid, _mm_cmpgt_pd(dist, zero));
+	return (uint32_t)_mm_movemask_pd(valid);
+}
+#endif
+
+#ifdef BVH_AVX
+uint32_t PacketBox4(const BVHNode& node, const double* const* pos, const double* const* inv, const bool* const* nullDir, const size_t& r) {
+	__m256d tN = _mm256_setzero_pd();
+	__m256d tF = _mm256_set1_pd(1E100);
+	__m256d outside = _mm256_setzero_pd();
+	for (int i = 0; i < 3; i++) {
+		__m256d lo = _mm256_set1_pd(node.bbMin[i]);
+		__m256d hi = _mm256_set1_pd(node.bbMax[i]);
+		__m256d p = _mm256_loadu_pd(pos[i] + r);
+		__m256d iv = _mm256_loadu_pd(inv[i] + r);
+		const bool* n = nullDir[i] + r;
+		__m256d isNull = _mm256_castsi256_pd(_mm256_set_epi64x(-(long long)n[3], -(long long)n[2], -(long long)n[1], -(long long)n[0]));
+		__m256d t1 = _mm256_mul_pd(_mm256_sub_pd(lo, p), iv);
+		__m256d t2 = _mm256_mul_pd(_mm256_sub_pd(hi, p), iv);
+		tN = _mm256_max_pd(tN, _mm256_min_pd(t1, t2));
+		tF = _mm256_min_pd(tF, _mm256_blendv_pd(_mm256_max_pd(t1, t2), tF, isNull));
+		__m256d inside = _mm256_and_pd(_mm256_cmp_pd(p, lo, _CMP_GE_OQ), _mm256_cmp_pd(p, hi, _CMP_LE_OQ));
+		outside = _mm256_or_pd(outside, _mm256_andnot_pd(inside, isNull));
+	}
+	return (uint32_t)_mm256_movemask_pd(_mm256_andnot_pd(outside, _mm256_cmp_pd(tN, tF, _CMP_LE_OQ)));
+}
+
+uint32_t PacketFacet4(const FacetRayData& data, const RayPacket& packet, const size_t& r, double* d, double* u, double* v) {
+	__m256d oppX = _mm256_loadu_pd(packet.oppX + r), oppY = _mm256_loadu_pd(packet.oppY + r), oppZ = _mm256_loadu_pd(packet.oppZ + r);
+	__m256d nX = _mm256_set1_pd(data.normal.x), nY = _mm256_set1_pd(data.normal.y), nZ = _mm256_set1_pd(data.normal.z);
+	__m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nX, oppX), _mm256_mul_pd(nY, oppY)), _mm256_mul_pd(nZ, oppZ));
+	__m256d iDet = _mm256_div_pd(_mm256_set1_pd(1.0), det);
+	__m256d intZx = _mm256_sub_pd(_mm256_loadu_pd(packet.posX + r), _mm256_set1_pd(data.origin.x));
+	__m256d intZy = _mm256_sub_pd(_mm256_loadu_pd(packet.posY + r), _mm256_set1_pd(data.origin.y));
+	__m256d intZz = _mm256_sub_pd(_mm256_loadu_pd(packet.posZ + r), _mm256_set1_pd(data.origin.z));
+	__m256d dist = _mm256_mul_pd(iDet, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nX, intZx), _mm256_mul_pd(nY, intZy)), _mm256_mul_pd(nZ, intZz)));
+	__m256d hitZx = _mm256_sub_pd(intZx, _mm256_mul_pd(dist, oppX));
+	__m256d hitZy = _mm256_sub_pd(intZy, _mm256_mul_pd(dist, oppY));
+	__m256d hitZz = _mm256_sub_pd(intZz, _mm256_mul_pd(dist, oppZ));
+	__m256d uu = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(data.uInverse.x), hitZx), _mm256_mul_pd(_mm256_set1_pd(data.uInverse.y), hitZy)), _mm256_mul_pd(_mm256_set1_pd(data.uInverse.z), hitZz));
+	__m256d vv = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(data.vInverse.x), hitZx), _mm256_mul_pd(_mm256_set1_pd(data.vInverse.y), hitZy)), _mm256_mul_pd(_mm256_set1_pd(data.vInverse.z), hitZz));
+	_mm256_storeu_pd(d + r, dist);
+	_mm256_storeu_pd(u + r, uu);
+	_mm256_storeu_pd(v + r, vv);
+	__m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+	__m256d valid = data.is2sided ? _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ) : _mm256_cmp_pd(det, zero, _CMP_GT_OQ);
+	valid = _mm256_and_pd(valid, _mm256_and_pd(_mm256_cmp_pd(uu, zero, _CMP_GE_OQ), _mm256_cmp_pd(uu, one, _CMP_LE_OQ)));
+	valid = _mm256_and_pd(valid, _mm256_and_pd(_mm256_cmp_pd(vv, zero, _CMP_GE_OQ), _mm256_cmp_pd(vv, one, _CMP_LE_OQ)));
+	valid = _mm256_and_pd(valid, _mm256_cmp_pd(dist, zero, _CMP_GT_OQ));
+	return (uint32_t)_mm256_movemask_pd(valid);
+}
+#endif
+
+uint32_t PacketHitsBox(const BVHNode& node, const RayPacket& packet, const uint32_t& mask) {
+	// Rays of the mask crossing the box. The lanes past nbRays hold stale rays, masked out (maxPacketSize is a multiple of 4)
+	const double* pos[3] = { packet.posX, packet.posY, packet.posZ };
+	const double* inv[3] = { packet.invX, packet.invY, packet.invZ };
+	const bool* nullDir[3] = { packet.nullX, packet.nullY, packet.nullZ };
+	uint32_t hits = 0;
+#if defined(BVH_AVX)
+	for (size_t r = 0; r < packet.nbRays; r += 4)
+		hits |= PacketBox4(node, pos, inv, nullDir, r) << r;
+#elif defined(BVH_SSE)
+	for (size_t r = 0; r < packet.nbRays; r += 2)
+		hits |= PacketBox2(node, pos, inv, nullDir, r) << r;
+#else
+	for (size_t r = 0; r < packet.nbRays; r++) {
+		double tMin = 0.0;
+		double tMax = 1E100;
+		bool inside = true;
+		for (int i = 0; i < 3; i++) {
+			if (nullDir[i][r]) { //Parallel to slab: inside or never
+				inside = inside && pos[i][r] >= node.bbMin[i] && pos[i][r] <= node.bbMax[i];
+			}
+			else {
+				double t1 = (node.bbMin[i] - pos[i][r]) * inv[i][r];
+				double t2 = (node.bbMax[i] - pos[i][r]) * inv[i][r];
+				tMin = Max(tMin, Min(t1, t2));
+				tMax = Min(tMax, Max(t1, t2));
+			}
+		}
+		if (inside && tMin <= tMax) hits |= 1u << r;
+	}
+#endif
+	return hits & mask;
+}
+
+void PacketIntersectFacet(const FacetRayData& data, SubprocessFacet* f, RayPacket& packet, const uint32_t& mask) {
+	// Same arithmetic as ThreadIntersectLeaf(), with the bound tests, for all rays at once. Then the polygon test per remaining ray
+	double u[maxPacketSize], v[maxPacketSize], d[maxPacketSize];
+	uint32_t hits = 0;
+#if defined(BVH_AVX)
+	for (size_t r = 0; r < packet.nbRays; r += 4)
+		hits |= PacketFacet4(data, packet, r, d, u, v) << r;
+#elif defined(BVH_SSE)
+	for (size_t r = 0; r < packet.nbRays; r += 2)
+		hits |= PacketFacet2(data, packet, r, d, u, v) << r;
+#else
+	for (size_t r = 0; r < packet.nbRays; r++) {
+		double det = data.normal.x * packet.oppX[r] + data.normal.y * packet.oppY[r] + data.normal.z * packet.oppZ[r];
+		if (!((data.is2sided || det > 0.0) && det != 0.0)) continue;
+		double iDet = 1.0 / det;
+		double intZx = packet.posX[r] - data.origin.x;
+		double intZy = packet.posY[r] - data.origin.y;
+		double intZz = packet.posZ[r] - data.origin.z;
+		d[r] = iDet * (data.normal.x * intZx + data.normal.y * intZy + data.normal.z * intZz);
+		double hitZx = intZx - d[r] * packet.oppX[r];
+		double hitZy = intZy - d[r] * packet.oppY[r];
+		double hitZz = intZz - d[r] * packet.oppZ[r];
+		u[r] = data.uInverse.x * hitZx + data.uInverse.y * hitZy + data.uInverse.z * hitZz;
+		v[r] = data.vInverse.x * hitZx + data.vInverse.y * hitZy + data.vInverse.z * hitZz;
+		if (u[r] >= 0.0 && u[r] <= 1.0 && v[r] >= 0.0 && v[r] <= 1.0 && d[r] > 0.0) hits |= 1u << r;
+	}
+#endif
+	hits &= mask;
+	for (size_t r = 0; hits; r++, hits >>= 1) {
+		if (!(hits & 1u) || f == packet.lastHitFacet[r] || !f->IsInside(u[r], v[r])) continue;
+		if (!data.opaque) {
+			packet.candidates[r].push_back({ f, d[r], u[r], v[r] });
+		}
+		else if (d[r] < packet.minLength[r]) {
+			packet.minLength[r] = d[r];
+			packet.collidedFacet[r] = f;
+			packet.colU[r] = u[r];
+			packet.colV[r] = v[r];
+		}
+	}
+}
+
+void PacketIntersectTree(const SuperStructure& s, RayPacket& packet, uint32_t mask) {
+	// The packet enters a node if any of its rays does, the others are masked out
+	std::pair<uint32_t, uint32_t> stack[bvhMaxDepth + 1]; //Node, rays entering it
+	size_t stackSize = 0;
+	mask = PacketHitsBox(s.bvhNodes[0], packet, mask);
+	if (mask) stack[stackSize++] = { 0, mask };
+	while (stackSize) {
+		uint32_t index = stack[stackSize - 1].first;
+		mask = stack[--stackSize].second;
+		const BVHNode& node = s.bvhNodes[index];
+		if (node.count) {
+			for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+				PacketIntersectFacet(s.bvhRayData[i], s.bvhFacets[i], packet, mask);
+		}
+		else {
+			uint32_t rightMask = PacketHitsBox(s.bvhNodes[node.offset], packet, mask);
+			if (rightMask) stack[stackSize++] = { node.offset, rightMask };
+			uint32_t leftMask = PacketHitsBox(s.bvhNodes[index + 1], packet, mask);
+			if (leftMask) stack[stackSize++] = { index + 1, leftMask };
+		}
+	}
+}
+
+void PacketIntersect(RayPacket& packet) {
+	// Closest opaque hit and partially transparent candidates of every ray, nothing recorded yet.
+	// Rays in different structures go through their own tree, then all of them through the one of the facets in all structures
+	uint32_t all = (1u << packet.nbRays) - 1;
+	uint32_t pending = all;
+	while (pending) {
+		size_t first = 0;
+		while (!(pending & (1u << first))) first++;
+		uint32_t mask = 0;
+		for (size_t r = first; r < packet.nbRays; r++)
+			if ((pending & (1u << r)) && packet.structureId[r] == packet.structureId[first]) mask |= 1u << r;
+		pending &= ~mask;
+		const SuperStructure& s = sHandle->structures[packet.structureId[first]];
+		if (!s.bvhNodes.empty()) PacketIntersectTree(s, packet, mask);
+	}
+	const SuperStructure* universal = UniversalStructure();
+	if (universal && !universal->bvhNodes.empty()) PacketIntersectTree(*universal, packet, all);
+}
+
+std::tuple<bool, SubprocessFacet*, double> ResolvePacketRay(RayPacket& packet, const size_t& ray) {
+	// Finishes ThreadIntersect()'s work for one ray, with its lane swapped into tHandle: opacity draws of the
+	// crossed facets in traversal order, then the transparent passes before the hard hit
+	CurrentParticleStatus& particle = tHandle->currentParticle;
+	SubprocessFacet* collidedFacet = packet.collidedFacet[ray];
+	double minLength = packet.minLength[ray];
+	double colU = packet.colU[ray], colV = packet.colV[ray];
+
+	particle.transparentHitBuffer.clear();
+	for (const TransparentHit& hit : packet.candidates[ray]) {
+		SubprocessFacet* f = hit.facet;
+		double opacity = (f->sh.opacity_paramId == -1) ? f->sh.opacity
+			: GetOpacityAt(f, particle.flightTime + hit.colDist / 100.0 / particle.velocity);
+		if (opacity < 1.0 && tHandle->rnd() > opacity) {
+			particle.transparentHitBuffer.push_back(hit);
+		}
+		else if (hit.colDist < minLength) {
+			minLength = hit.colDist;
+			collidedFacet = f;
+			colU = hit.colU;
+			colV = hit.colV;
+		}
+	}
+
+	for (const TransparentHit& hit : particle.transparentHitBuffer) {
+		if (hit.colDist < minLength) {
+			particle.colU = hit.colU;
+			particle.colV = hit.colV;
+			RecordTransparentPass(hit.facet, hit.colDist);
+		}
+	}
+
+	bool found = collidedFacet != NULL;
+	if (found) {
+		particle.colU = colU;
+		particle.colV = colV;
+	}
+	return { found, collidedFacet, minLength };
+}
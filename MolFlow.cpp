@@ -41,6 +41,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <io.h>
 #include <thread>
 #include <numeric> //std::iota
+#include <map>
 
 #include "Interface.h"
 //#include "AppUpdater.h"
@@ -162,6 +163,13 @@ MolFlow *mApp;
 #define MENU_FACET_MESH        360
 #define MENU_SELECT_HASDESFILE 361
 #define MENU_FACET_OUTGASSINGMAP 362
+#define MENU_FACET_STICKINGSWEEP 363
+#define MENU_FACET_SPLITTING 364
+#define MENU_FACET_ESTIMATOR 365
+#define MENU_FACET_ADJOINT 366
+#define MENU_FACET_WATCHCONVERGENCE 367
+#define MENU_FACET_TRANSFER 368
+#define MENU_FACET_COVERINGEVOLUTION 369
 
 #define MENU_TIME_SETTINGS          900
 #define MENU_TIMEWISE_PLOTTER       901
@@ -361,6 +369,13 @@ int MolFlow::OneTimeSceneInit()
 	menu->GetSubMenu("Tools")->Add(NULL);
 	menu->GetSubMenu("Tools")->Add("Moving parts...", MENU_TOOLS_MOVINGPARTS);
 	menu->GetSubMenu("Facet")->Add("Convert to outgassing map...", MENU_FACET_OUTGASSINGMAP);
+	menu->GetSubMenu("Facet")->Add("Sticking sweep...", MENU_FACET_STICKINGSWEEP);
+	menu->GetSubMenu("Facet")->Add("Set as splitting region", MENU_FACET_SPLITTING);
+	menu->GetSubMenu("Facet")->Add("Set as forced detection targets", MENU_FACET_ESTIMATOR);
+	menu->GetSubMenu("Facet")->Add("Set as adjoint target", MENU_FACET_ADJOINT);
+	menu->GetSubMenu("Facet")->Add("Watch convergence...", MENU_FACET_WATCHCONVERGENCE);
+	menu->GetSubMenu("Facet")->Add("Transfer matrix facets...", MENU_FACET_TRANSFER);
+	menu->GetSubMenu("Facet")->Add("Covering evolution...", MENU_FACET_COVERINGEVOLUTION);
 
 	menu->Add("Time");
 	menu->GetSubMenu("Time")->Add("Time settings...", MENU_TIME_SETTINGS, SDLK_i, ALT_MODIFIER);
@@ -1852,6 +1867,7 @@ void MolFlow::LoadFile(char *fName) {
 		ClearParameters();
 		ClearAllSelections();
 		ClearAllViews();
+		ClearEngineFacets();
 		ResetSimulation(false);
 		worker.LoadGeometry(fullName);
 		
@@ -2455,6 +2471,87 @@ void MolFlow::ProcessMessage(GLComponent *src, int message)
 			if (!outgassingMap) outgassingMap = new OutgassingMap();
 			outgassingMap->Display(&worker);
 			break;
+		case MENU_FACET_STICKINGSWEEP:
+			EditStickingSweep();
+			break;
+		case MENU_FACET_WATCHCONVERGENCE:
+			EditConvergenceWatch();
+			break;
+		case MENU_FACET_TRANSFER:
+			EditTransferFacets();
+			break;
+		case MENU_FACET_COVERINGEVOLUTION:
+			EditCoveringEvolution();
+			break;
+		case MENU_FACET_ADJOINT:
+		{
+			//Adjoint run: particles start from the single selected facet, results are the transfer factors of all facets to it
+			RemapEngineFacets(); //Existing lists in the indexing of the selection
+			auto selectedFacets = geom->GetSelectedFacets();
+			if (selectedFacets.size() > 1) {
+				GLMessageBox::Display("Select one target facet (none: back to a forward run)", "Adjoint mode", GLDLG_OK, GLDLG_ICONINFO);
+				break;
+			}
+			std::ostringstream question;
+			if (selectedFacets.empty()) question << "No facet selected: switch back to a regular forward run?";
+			else question << "Start particles from facet " << selectedFacets[0] + 1 << " and compute the transfer factors of all facets to it?";
+			if (GLMessageBox::Display(question.str().c_str(), "Adjoint mode", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) == GLDLG_OK) {
+				if (AskToReset()) {
+					engineParams.adjointTarget = selectedFacets.empty() ? -1 : (int)selectedFacets[0];
+					try {
+						worker.Reload();
+					}
+					catch (Error &e) {
+						GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+					}
+				}
+			}
+			break;
+		}
+		case MENU_FACET_ESTIMATOR:
+		{
+			//Small target facets getting a next-event estimate of their incoming flux
+			RemapEngineFacets(); //Existing lists in the indexing of the selection
+			auto selectedFacets = geom->GetSelectedFacets();
+			std::ostringstream question;
+			if (selectedFacets.empty()) question << "No facets selected: remove the forced detection targets?";
+			else question << "Estimate the incoming flux on the " << selectedFacets.size() << " selected facet(s) by forced detection?";
+			if (GLMessageBox::Display(question.str().c_str(), "Forced detection", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) == GLDLG_OK) {
+				if (AskToReset()) {
+					engineParams.estimatorFacets = selectedFacets;
+					try {
+						worker.Reload();
+					}
+					catch (Error &e) {
+						GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+					}
+				}
+			}
+			break;
+		}
+		case MENU_FACET_SPLITTING:
+		{
+			//Particles bouncing off or crossing these facets are split (copies set in Global Settings)
+			RemapEngineFacets(); //Existing lists in the indexing of the selection
+			auto selectedFacets = geom->GetSelectedFacets();
+			std::ostringstream question;
+			if (selectedFacets.empty()) question << "No facets selected: remove the splitting region?";
+			else question << "Split particles on the " << selectedFacets.size() << " selected facet(s)?";
+			if (GLMessageBox::Display(question.str().c_str(), "Splitting region", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) == GLDLG_OK) {
+				if (AskToReset()) {
+					engineParams.splitFacets = selectedFacets;
+					if (!selectedFacets.empty() && engineParams.splitFactor < 2)
+						GLMessageBox::Display("Set the number of split copies in Global Settings to enable splitting.", "Splitting region", GLDLG_OK, GLDLG_ICONINFO);
+					try {
+						worker.Reload();
+					}
+					catch (Error &e) {
+						GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+					}
+				}
+			}
+			break;
+		}
 		case MENU_FACET_REMOVESEL:
 		{
 			auto selectedFacets = geom->GetSelectedFacets();
@@ -2462,7 +2559,18 @@ void MolFlow::ProcessMessage(GLComponent *src, int message)
 			if (GLMessageBox::Display("Remove selected facets?", "Question", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) == GLDLG_OK) {
 				if (AskToReset()) {
 					if (worker.isRunning) worker.Stop_Public();
+					RemapEngineFacets(); //Engine facet lists in the current indexing, then renumbered like the selections
+					std::vector<int> newRefs(geom->GetNbFacet());
+					int nbKept = 0;
+					for (size_t i = 0, sel = 0; i < newRefs.size(); i++) { //selectedFacets is in increasing order
+						if (sel < selectedFacets.size() && selectedFacets[sel] == i) {
+							newRefs[i] = -1;
+							sel++;
+						}
+						else newRefs[i] = nbKept++;
+					}
 					geom->RemoveFacets(selectedFacets);
+					RenumberEngineFacets(newRefs);
 					worker.CalcTotalOutgassing();
 					//geom->CheckIsolatedVertex();
 					UpdateModelParams();
@@ -2852,6 +2960,330 @@ void MolFlow::ProcessMessage(GLComponent *src, int message)
 	}
 }
 
+void MolFlow::EditStickingSweep() {
+	//Sticking values of the sweep scenarios on the selected facets, all traced in a single run
+	MolflowGeometry *geom = worker.GetMolflowGeometry();
+	RemapEngineFacets(); //Existing lists in the indexing of the selection
+	auto selectedFacets = geom->GetSelectedFacets();
+	if (selectedFacets.size() == 0) {
+		GLMessageBox::Display("No facets selected", "Sticking sweep", GLDLG_OK, GLDLG_ICONINFO);
+		return;
+	}
+
+	std::ostringstream current;
+	for (size_t i = 0; i < engineParams.sweepFacets.size(); i++) {
+		if (engineParams.sweepFacets[i] == selectedFacets[0]) {
+			for (size_t k = 0; k < engineParams.sweepStickings[i].size(); k++) {
+				if (k > 0) current << ",";
+				current << engineParams.sweepStickings[i][k];
+			}
+		}
+	}
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "%s", current.str().c_str());
+	char *val = GLInputBox::GetInput(tmp, "Sticking of each scenario, comma-separated (empty: no sweep)", "Sticking sweep");
+	if (!val) return;
+
+	std::vector<double> stickings;
+	std::istringstream list(val);
+	std::string item;
+	while (std::getline(list, item, ',')) {
+		if (item.find_first_not_of(" \t") == std::string::npos) continue;
+		double s;
+		std::istringstream value(item);
+		if (!(value >> s) || !(s >= 0.0 && s <= 1.0)) {
+			GLMessageBox::Display("Invalid sticking, must be between 0 and 1", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+		stickings.push_back(s);
+	}
+
+	//Keep the facets that aren't selected (and still exist)
+	std::vector<size_t> sweepFacets;
+	std::vector<std::vector<double>> sweepStickings;
+	for (size_t i = 0; i < engineParams.sweepFacets.size(); i++) {
+		if (engineParams.sweepFacets[i] < geom->GetNbFacet() && !geom->GetFacet(engineParams.sweepFacets[i])->selected) {
+			sweepFacets.push_back(engineParams.sweepFacets[i]);
+			sweepStickings.push_back(engineParams.sweepStickings[i]);
+		}
+	}
+	if (!stickings.empty()) {
+		if (!sweepStickings.empty() && sweepStickings[0].size() != stickings.size()) {
+			std::ostringstream tmp;
+			tmp << "Other facets already have a sweep of " << sweepStickings[0].size() << " scenarios, all swept facets need the same number";
+			GLMessageBox::Display(tmp.str().c_str(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+		for (const size_t& id : selectedFacets) {
+			sweepFacets.push_back(id);
+			sweepStickings.push_back(stickings);
+		}
+	}
+
+	if (AskToReset()) {
+		engineParams.sweepFacets = sweepFacets;
+		engineParams.sweepStickings = sweepStickings;
+		try {
+			worker.Reload();
+		}
+		catch (Error &e) {
+			GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+		}
+	}
+}
+
+void MolFlow::EditConvergenceWatch() {
+	//Batch-means errors on the selected facets, optionally stopping the run once they are all below a target
+	MolflowGeometry *geom = worker.GetMolflowGeometry();
+	RemapEngineFacets(); //Existing lists in the indexing of the selection
+	auto selectedFacets = geom->GetSelectedFacets();
+	double targetError = engineParams.targetRelativeError;
+	int batchSize = (int)engineParams.batchSize;
+	if (!selectedFacets.empty()) {
+		char tmp[128];
+		sprintf(tmp, "%g", targetError * 100.0);
+		char *val = GLInputBox::GetInput(tmp, "Stop when all below relative error (%, 0: never stop)", "Watch convergence");
+		if (!val) return;
+		if (sscanf(val, "%lf", &targetError) <= 0 || !(targetError >= 0.0 && targetError < 100.0)) {
+			GLMessageBox::Display("Invalid relative error", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+		targetError /= 100.0;
+		sprintf(tmp, "%d", batchSize);
+		val = GLInputBox::GetInput(tmp, "Desorbed particles per batch (in each thread)", "Watch convergence");
+		if (!val) return;
+		if (sscanf(val, "%d", &batchSize) <= 0 || batchSize < 1) {
+			GLMessageBox::Display("Invalid batch size", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+	}
+	else if (GLMessageBox::Display("No facets selected: stop watching convergence?", "Watch convergence", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) != GLDLG_OK) return;
+
+	if (AskToReset()) {
+		engineParams.watchFacets = selectedFacets;
+		engineParams.targetRelativeError = targetError;
+		engineParams.batchSize = (size_t)batchSize;
+		try {
+			worker.Reload();
+		}
+		catch (Error &e) {
+			GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+		}
+	}
+}
+
+void MolFlow::EditTransferFacets() {
+	//Transfer matrix run: the selected facets desorb in turn, absorptions on them give the facet-to-facet probabilities
+	MolflowGeometry *geom = worker.GetMolflowGeometry();
+	RemapEngineFacets(); //Existing lists in the indexing of the selection
+	auto selectedFacets = geom->GetSelectedFacets();
+	std::ostringstream question;
+	if (selectedFacets.empty()) question << "No facets selected: switch back to a regular run?";
+	else question << "Desorb from the " << selectedFacets.size() << " selected facets in turn and estimate the "
+		<< selectedFacets.size() << "x" << selectedFacets.size() << " transfer matrix between them?\n(Covering evolution: History window, Integrate)";
+	if (GLMessageBox::Display(question.str().c_str(), "Transfer matrix", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) != GLDLG_OK) return;
+
+	if (AskToReset()) {
+		engineParams.transferFacets = selectedFacets;
+		try {
+			worker.Reload();
+		}
+		catch (Error &e) {
+			GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+		}
+	}
+}
+
+void MolFlow::EditCoveringEvolution() {
+	//Time steps run by the subprocess: the selected facets desorb their covering and get a covering-dependent sticking
+	MolflowGeometry *geom = worker.GetMolflowGeometry();
+	RemapEngineFacets(); //Existing lists in the indexing of the selection
+	auto selectedFacets = geom->GetSelectedFacets();
+	double timeStep = engineParams.coveringTimeStep;
+	int nbSteps = (int)engineParams.coveringSteps;
+	int stepDesorptions = (int)engineParams.stepDesorptions;
+	if (!selectedFacets.empty()) {
+		char tmp[128];
+		sprintf(tmp, "%g", timeStep);
+		char *val = GLInputBox::GetInput(tmp, "Time step (s)", "Covering evolution");
+		if (!val) return;
+		if (sscanf(val, "%lf", &timeStep) <= 0 || !(timeStep > 0.0)) {
+			GLMessageBox::Display("Invalid time step", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+		sprintf(tmp, "%d", nbSteps);
+		val = GLInputBox::GetInput(tmp, "Number of steps", "Covering evolution");
+		if (!val) return;
+		if (sscanf(val, "%d", &nbSteps) <= 0 || nbSteps < 1) {
+			GLMessageBox::Display("Invalid number of steps", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+		sprintf(tmp, "%d", stepDesorptions);
+		val = GLInputBox::GetInput(tmp, "Test particles per step", "Covering evolution");
+		if (!val) return;
+		if (sscanf(val, "%d", &stepDesorptions) <= 0 || stepDesorptions < 1) {
+			GLMessageBox::Display("Invalid number of test particles", "Error", GLDLG_OK, GLDLG_ICONERROR);
+			return;
+		}
+	}
+	else if (GLMessageBox::Display("No facets selected: switch off the covering evolution?", "Covering evolution", GLDLG_OK | GLDLG_CANCEL, GLDLG_ICONINFO) != GLDLG_OK) return;
+
+	if (AskToReset()) {
+		engineParams.coveringFacets = selectedFacets;
+		engineParams.coveringTimeStep = timeStep;
+		engineParams.coveringSteps = (size_t)nbSteps;
+		engineParams.stepDesorptions = (size_t)stepDesorptions;
+		try {
+			worker.Reload();
+		}
+		catch (Error &e) {
+			GLMessageBox::Display((char *)e.GetMsg(), "Error", GLDLG_OK, GLDLG_ICONERROR);
+		}
+	}
+}
+
+void MolFlow::SnapshotEngineFacets() {
+	Geometry *geom = worker.GetGeometry();
+	engineFacetIndices.resize(geom->GetNbFacet());
+	for (size_t i = 0; i < engineFacetIndices.size(); i++) {
+		Facet *f = geom->GetFacet(i);
+		engineFacetIndices[i].resize(f->sh.nbIndex);
+		for (size_t j = 0; j < f->sh.nbIndex; j++)
+			engineFacetIndices[i][j] = f->indices[j];
+	}
+	engineVertexPositions.resize(3 * geom->GetNbVertex());
+	for (size_t i = 0; i < geom->GetNbVertex(); i++) {
+		engineVertexPositions[3 * i] = geom->GetVertex(i)->x;
+		engineVertexPositions[3 * i + 1] = geom->GetVertex(i)->y;
+		engineVertexPositions[3 * i + 2] = geom->GetVertex(i)->z;
+	}
+}
+
+void MolFlow::RemapEngineFacets() {
+	//The engine facet lists hold global indices. A listed facet is found again by its vertex indices (kept by moves)
+	//or by its vertex positions (kept by vertex renumbering), never by its address, which a new facet may reuse
+	Geometry *geom = worker.GetGeometry();
+	std::vector<size_t> listed(engineParams.sweepFacets);
+	for (const std::vector<size_t>* list : { &engineParams.splitFacets, &engineParams.estimatorFacets, &engineParams.watchFacets,
+		&engineParams.transferFacets, &engineParams.coveringFacets })
+		listed.insert(listed.end(), list->begin(), list->end());
+	if (engineParams.adjointTarget >= 0) listed.push_back((size_t)engineParams.adjointTarget);
+
+	auto positionsOf = [&](const std::vector<size_t>& indices, bool current) {
+		std::vector<double> positions;
+		for (const size_t& v : indices) {
+			if (current) {
+				positions.push_back(geom->GetVertex(v)->x);
+				positions.push_back(geom->GetVertex(v)->y);
+				positions.push_back(geom->GetVertex(v)->z);
+			}
+			else if (3 * v + 2 < engineVertexPositions.size()) positions.insert(positions.end(), &engineVertexPositions[3 * v], &engineVertexPositions[3 * v] + 3);
+		}
+		return positions;
+	};
+	std::vector<int> newRefs(engineFacetIndices.size(), -1);
+	std::vector<bool> taken(geom->GetNbFacet(), false);
+	std::map<std::vector<size_t>, std::vector<size_t>> byIndices; //Old facets not found at their own index
+	std::map<std::vector<double>, std::vector<size_t>> byPositions;
+	for (const size_t& id : listed) {
+		if (id >= engineFacetIndices.size() || newRefs[id] != -1) continue;
+		if (id < geom->GetNbFacet() && !taken[id]) { //Most often unchanged
+			Facet *f = geom->GetFacet(id);
+			bool same = f->sh.nbIndex == engineFacetIndices[id].size();
+			for (size_t j = 0; same && j < f->sh.nbIndex; j++)
+				same = f->indices[j] == engineFacetIndices[id][j];
+			if (same) {
+				newRefs[id] = (int)id;
+				taken[id] = true;
+				continue;
+			}
+		}
+		newRefs[id] = -2; //Looked up below
+		byIndices[engineFacetIndices[id]].push_back(id);
+		byPositions[positionsOf(engineFacetIndices[id], false)].push_back(id);
+	}
+	for (int pass = 0; pass < 2 && !byIndices.empty(); pass++) { //Same vertex indices first, then same positions
+		for (size_t i = 0; i < geom->GetNbFacet(); i++) {
+			if (taken[i]) continue;
+			Facet *f = geom->GetFacet(i);
+			std::vector<size_t> indices(f->sh.nbIndex);
+			for (size_t j = 0; j < f->sh.nbIndex; j++)
+				indices[j] = f->indices[j];
+			std::vector<size_t>* candidates;
+			if (pass == 0) {
+				auto it = byIndices.find(indices);
+				if (it == byIndices.end()) continue;
+				candidates = &it->second;
+			}
+			else {
+				auto it = byPositions.find(positionsOf(indices, true));
+				if (it == byPositions.end()) continue;
+				candidates = &it->second;
+			}
+			for (const size_t& id : *candidates) {
+				if (newRefs[id] != -2) continue;
+				newRefs[id] = (int)i;
+				taken[i] = true;
+				break;
+			}
+		}
+	}
+	for (int& ref : newRefs)
+		if (ref == -2) ref = -1; //Removed
+	RenumberEngineFacets(newRefs);
+}
+
+void MolFlow::RenumberEngineFacets(const std::vector<int>& newRefs) {
+	//Like the selections, and the lists then match the current geometry
+	auto remap = [&](size_t& id) { //false if the facet was removed
+		if (id >= newRefs.size() || newRefs[id] < 0) return false;
+		id = (size_t)newRefs[id];
+		return true;
+	};
+	auto remapList = [&](std::vector<size_t>& list) {
+		std::vector<size_t> kept;
+		for (size_t id : list)
+			if (remap(id)) kept.push_back(id);
+		list.swap(kept);
+	};
+
+	std::vector<size_t> sweepFacets;
+	std::vector<std::vector<double>> sweepStickings;
+	for (size_t i = 0; i < engineParams.sweepFacets.size(); i++) {
+		size_t id = engineParams.sweepFacets[i];
+		if (remap(id)) {
+			sweepFacets.push_back(id);
+			sweepStickings.push_back(engineParams.sweepStickings[i]);
+		}
+	}
+	engineParams.sweepFacets.swap(sweepFacets);
+	engineParams.sweepStickings.swap(sweepStickings);
+	remapList(engineParams.splitFacets);
+	remapList(engineParams.estimatorFacets);
+	remapList(engineParams.watchFacets);
+	remapList(engineParams.transferFacets);
+	remapList(engineParams.coveringFacets);
+	if (engineParams.adjointTarget >= 0) {
+		size_t id = (size_t)engineParams.adjointTarget;
+		engineParams.adjointTarget = remap(id) ? (int)id : -1;
+	}
+
+	SnapshotEngineFacets();
+}
+
+void MolFlow::ClearEngineFacets() {
+	engineParams.sweepFacets.clear();
+	engineParams.sweepStickings.clear();
+	engineParams.splitFacets.clear();
+	engineParams.estimatorFacets.clear();
+	engineParams.watchFacets.clear();
+	engineParams.transferFacets.clear();
+	engineParams.coveringFacets.clear();
+	engineParams.adjointTarget = -1;
+	engineFacetIndices.clear();
+	engineVertexPositions.clear();
+}
+
 void MolFlow::BuildPipe(double ratio, int steps) {
 
 	char tmp[256];
@@ -2874,6 +3306,7 @@ void MolFlow::BuildPipe(double ratio, int steps) {
 	std::ostringstream temp;
 	temp << "PIPE" << L / R;
 	geom->UpdateName(temp.str().c_str());
+	ClearEngineFacets();
 	ResetSimulation(false);
 
 	try {
@@ -2946,6 +3379,7 @@ void MolFlow::BuildPipe(double ratio, int steps) {
 void MolFlow::EmptyGeometry() {
 
 	Geometry *geom = worker.GetGeometry();
+	ClearEngineFacets();
 	ResetSimulation(false);
 
 	try {
@@ -3183,6 +3617,23 @@ void MolFlow::LoadConfig() {
 		worker.ontheflyParams.lowFluxCutoff = f->ReadDouble();
 		f->ReadKeyword("leftHandedView"); f->ReadKeyword(":");
 		leftHandedView = f->ReadInt();
+		f->ReadKeyword("nbThreads"); f->ReadKeyword(":");
+		engineParams.nbThreads = (size_t)f->ReadInt();
+		f->ReadKeyword("randomSeed"); f->ReadKeyword(":");
+		engineParams.randomSeed = (size_t)f->ReadInt();
+		f->ReadKeyword("speciesMasses"); f->ReadKeyword(":");
+		size_t nbSpecies = (size_t)f->ReadInt();
+		engineParams.speciesMasses.clear();
+		for (size_t i = 0; i < nbSpecies; i++)
+			engineParams.speciesMasses.push_back(f->ReadDouble());
+		f->ReadKeyword("splitFactor"); f->ReadKeyword(":");
+		engineParams.splitFactor = (size_t)f->ReadInt();
+		f->ReadKeyword("rouletteThreshold"); f->ReadKeyword(":");
+		engineParams.rouletteThreshold = f->ReadDouble();
+		f->ReadKeyword("packetSize"); f->ReadKeyword(":");
+		engineParams.packetSize = (size_t)f->ReadInt();
+		f->ReadKeyword("bvhWidth"); f->ReadKeyword(":");
+		engineParams.bvhWidth = (size_t)f->ReadInt();
 	}
 	catch (...) {
 		/*std::ostringstream tmp;
@@ -3313,6 +3764,15 @@ void MolFlow::SaveConfig() {
 		f->Write("lowFluxMode:"); f->Write(worker.ontheflyParams.lowFluxMode, "\n");
 		f->Write("lowFluxCutoff:"); f->Write(worker.ontheflyParams.lowFluxCutoff, "\n");
 		f->Write("leftHandedView:"); f->Write(leftHandedView, "\n");
+		f->Write("nbThreads:"); f->Write((int)engineParams.nbThreads, "\n");
+		f->Write("randomSeed:"); f->Write((int)engineParams.randomSeed, "\n");
+		f->Write("speciesMasses:"); f->Write((int)engineParams.speciesMasses.size(), "\n");
+		for (const double& mass : engineParams.speciesMasses)
+			f->Write(mass, "\n");
+		f->Write("splitFactor:"); f->Write((int)engineParams.splitFactor, "\n");
+		f->Write("rouletteThreshold:"); f->Write(engineParams.rouletteThreshold, "\n");
+		f->Write("packetSize:"); f->Write((int)engineParams.packetSize, "\n");
+		f->Write("bvhWidth:"); f->Write((int)engineParams.bvhWidth, "\n");
 	}
 	catch (Error &err) {
 		GLMessageBox::Display(err.GetMsg(), "Error saving config file", GLDLG_OK, GLDLG_ICONWARNING);
@@ -3437,7 +3897,7 @@ double MolFlow::calcdNsurf() {// Calculates the (carbon equivalent realtive) mas
 
 double MolFlow::calcDesorption() {
 	double d = 1;
-	double E_de = 1.5E-21;
+	double E_de = desorptionEnergy;
 	double coverage;
 	double temperature;
 
@@ -3775,8 +4235,10 @@ void MolFlow::UpdateFacetHits(bool allRows) {
 				sprintf(tmp, "%d", facetId + 1);
 				facetList->SetValueAt(0, i, tmp);
 				switch (modeCombo->GetSelectedIndex()) {
-				case MC_MODE:
-					facetList->SetColumnLabel(1, "Hits");
+				case MC_MODE: //Adjoint mode: the counters are those of the adjoint particles, see Facet details for the results
+					facetList->SetColumnLabel(1, (engineParams.adjointTarget >= 0) ? "Adj.hits" : "Hits");
+					facetList->SetColumnLabel(2, (engineParams.adjointTarget >= 0) ? "Adj.des" : "Des");
+					facetList->SetColumnLabel(3, (engineParams.adjointTarget >= 0) ? "Adj.abs" : "Abs");
 					sprintf(tmp, "%I64d", f->facetHitCache.hit.nbMCHit);
 					facetList->SetValueAt(1, i, tmp);
 					sprintf(tmp, "%I64d", f->facetHitCache.hit.nbDesorbed);
@@ -3786,6 +4248,8 @@ void MolFlow::UpdateFacetHits(bool allRows) {
 					break;
 				case AC_MODE:
 					facetList->SetColumnLabel(1, "Density");
+					facetList->SetColumnLabel(2, "Des");
+					facetList->SetColumnLabel(3, "Abs");
 					sprintf(tmp, "%g", f->facetHitCache.density.value);
 					facetList->SetValueAt(1, i, tmp);
 
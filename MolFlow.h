@@ -22,6 +22,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include <crtdbg.h> //To debug heap corruptions in memory
 
 #include "Interface.h"
+#include "MolflowTypes.h"
 class Worker;
 class ImportDesorption;
 class TimeSettings;
@@ -45,6 +46,7 @@ class Error;
 const double carbondiameter = 2 * 76E-12;
 const double kb = 1.38E-23;
 const double tau = 1E-13;
+const double desorptionEnergy = 1.5E-21; //E_de (J) of the first order desorption from the covering
 
 class MolFlow : public Interface
 {
@@ -166,10 +168,22 @@ public:
 	ParameterEditor  *parameterEditor;
 	char *nbF;
 
+	EngineParams engineParams; //Subprocess engine settings, sent with the geometry on reload
+	std::vector<std::vector<size_t>> engineFacetIndices; //Vertex indices of each facet when the engine facet lists were last in sync with the geometry
+	std::vector<double> engineVertexPositions; //Vertex positions (x,y,z) at that time
+	void RemapEngineFacets(); //Follow facet removals and reorders in the engine facet lists, drops removed facets
+	void RenumberEngineFacets(const std::vector<int>& newRefs); //Old global index to new one, -1: removed
+	void SnapshotEngineFacets(); //The engine facet lists match the current geometry
+	void ClearEngineFacets(); //New or loaded geometry: none of the facet lists apply anymore
+
     // Testing
     //int     nbSt;
     //void LogProfile();
     void BuildPipe(double ratio,int steps=0);
+    void EditStickingSweep();
+    void EditConvergenceWatch();
+    void EditTransferFacets();
+    void EditCoveringEvolution();
 	void EmptyGeometry();
 	void CrashHandler(Error *e);
 	void ExportHitBufferToFile(); //new function to export hit buffer for simulation on Linux HPC, added by Rudi.
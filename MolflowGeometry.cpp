@@ -367,17 +367,76 @@ void MolflowGeometry::ImportFromLoader(cereal::BinaryInputArchive& inputarchive)
 }
 
 size_t MolflowGeometry::GetHitsSize(std::vector<double> *moments) {
+	return GetHitsOffset(HITS_END, moments->size());
+}
+
+size_t MolflowGeometry::GetHitsOffset(size_t block, size_t nbMoments) {
 
 	// Compute number of bytes allocated
+	const EngineParams& ep = mApp->engineParams;
 	size_t memoryUsage = 0;
-	memoryUsage += sizeof(GlobalHitBuffer)+(1+moments->size())*mApp->worker.wp.globalHistogramParams.GetDataSize();
+	memoryUsage += sizeof(GlobalHitBuffer)+(1+nbMoments)*mApp->worker.wp.globalHistogramParams.GetDataSize();
 	for (int i = 0; i < sh.nbFacet; i++) {
-		memoryUsage += facets[i]->GetHitsSize(moments->size());
-	}
+		memoryUsage += facets[i]->GetHitsSize(nbMoments);
+	}
+	if (block == HITS_SPECIES) return memoryUsage;
+	memoryUsage += ep.speciesMasses.size() * sh.nbFacet * (1 + nbMoments) * sizeof(FacetHitBuffer);
+	if (block == HITS_SPECIES_TEXTURES) return memoryUsage;
+	memoryUsage += ep.speciesMasses.size() * GetSpeciesTextureCells(nbMoments) * sizeof(TextureCell);
+	if (block == HITS_SWEEP) return memoryUsage;
+	size_t nbScenarios = ep.sweepStickings.empty() ? 0 : ep.sweepStickings[0].size();
+	memoryUsage += nbScenarios * sh.nbFacet * (1 + nbMoments) * sizeof(FacetHitBuffer);
+	if (block == HITS_ESTIMATOR) return memoryUsage;
+	memoryUsage += ep.estimatorFacets.size() * (1 + nbMoments) * sizeof(FacetHitBuffer);
+	if (block == HITS_ADJOINT) return memoryUsage;
+	if (ep.adjointTarget >= 0) memoryUsage += sh.nbFacet * sizeof(AdjointResult);
+	if (block == HITS_CONVERGENCE) return memoryUsage;
+	memoryUsage += ep.watchFacets.size() * sizeof(FacetConvergence);
+	if (block == HITS_QUOTA) return memoryUsage;
+	memoryUsage += sizeof(llong);
+	if (block == HITS_TRANSFER) return memoryUsage;
+	size_t nbTransfer = ep.transferFacets.size();
+	memoryUsage += nbTransfer * sizeof(double) + nbTransfer * nbTransfer * sizeof(TransferEntry);
+	if (block == HITS_COVERING) return memoryUsage;
+	memoryUsage += GetCoveringTimelineSize();
 
 	return memoryUsage;
 }
 
+size_t MolflowGeometry::GetSpeciesTextureCells(size_t nbMoments) {
+	size_t nbCells = 0;
+	for (size_t i = 0; i < sh.nbFacet; i++) {
+		if (facets[i]->sh.isTextured) nbCells += (1 + nbMoments) * facets[i]->sh.texWidth * facets[i]->sh.texHeight;
+	}
+	return nbCells;
+}
+
+size_t MolflowGeometry::GetSpeciesTextureOffset(size_t species, size_t facetId, size_t nbMoments) {
+	// Same order as the subprocesses' speciesTextureStart
+	size_t start = 0;
+	for (size_t i = 0; i < facetId; i++) {
+		if (facets[i]->sh.isTextured) start += (1 + nbMoments) * facets[i]->sh.texWidth * facets[i]->sh.texHeight;
+	}
+	return GetHitsOffset(HITS_SPECIES_TEXTURES, nbMoments) + (species * GetSpeciesTextureCells(nbMoments) + start) * sizeof(TextureCell);
+}
+
+size_t MolflowGeometry::GetCoveringTimelineSize() {
+	const EngineParams& ep = mApp->engineParams;
+	if (ep.coveringFacets.empty()) return 0;
+	return sizeof(llong) + ep.coveringSteps * (1 + ep.coveringFacets.size()) * sizeof(double);
+}
+
+void MolflowGeometry::UpdateTransferMatrix(BYTE *buffer) {
+	const std::vector<size_t>& transferFacets = mApp->engineParams.transferFacets;
+	if (transferFacets.empty()) return;
+	size_t nbTransfer = transferFacets.size();
+	double* launched = (double*)(buffer + GetHitsOffset(HITS_TRANSFER, mApp->worker.moments.size()));
+	double totalLaunched = 0.0;
+	for (size_t i = 0; i < nbTransfer; i++) totalLaunched += launched[i];
+	if (totalLaunched == 0.0) return;
+	transferMatrix.Build(transferFacets, launched, (TransferEntry*)(launched + nbTransfer));
+}
+
 size_t MolflowGeometry::GetMaxElemNumber() {
 
 	size_t nbElem = 0;
@@ -2585,6 +2644,55 @@ void MolflowGeometry::SaveXML_geometry(pugi::xml_node saveDoc, Worker *work, GLP
 			newMoment.append_attribute("value") = work->parameters[i].GetY(m);
 		}
 	}
+
+	if (!saveSelected) { //Global facet indices, don't apply to a part of the geometry
+		const EngineParams& ep = mApp->engineParams;
+		xml_node engineNode = simuParamNode.append_child("EngineFacets");
+		engineNode.append_attribute("adjointTarget") = ep.adjointTarget;
+		xml_node sweepNode = engineNode.append_child("Sweep");
+		for (size_t i = 0; i < ep.sweepFacets.size(); i++) {
+			xml_node facetNode = sweepNode.append_child("Facet");
+			facetNode.append_attribute("id") = ep.sweepFacets[i];
+			for (const double& sticking : ep.sweepStickings[i])
+				facetNode.append_child("Scenario").append_attribute("sticking") = sticking;
+		}
+		auto saveList = [&](const char *name, const std::vector<size_t>& list) {
+			xml_node listNode = engineNode.append_child(name);
+			for (const size_t& id : list)
+				listNode.append_child("Facet").append_attribute("id") = id;
+		};
+		saveList("Splitting", ep.splitFacets);
+		saveList("Estimator", ep.estimatorFacets);
+		saveList("Watch", ep.watchFacets);
+		saveList("Transfer", ep.transferFacets);
+		saveList("Covering", ep.coveringFacets);
+	}
+}
+
+void MolflowGeometry::LoadXML_engineFacets(pugi::xml_node engineNode, size_t idOffset) {
+	if (!engineNode) return; //Older file
+	EngineParams& ep = mApp->engineParams;
+	size_t nbScenarios = ep.sweepStickings.empty() ? 0 : ep.sweepStickings[0].size();
+	for (xml_node facetNode : engineNode.child("Sweep").children("Facet")) {
+		std::vector<double> stickings;
+		for (xml_node scenarioNode : facetNode.children("Scenario"))
+			stickings.push_back(scenarioNode.attribute("sticking").as_double());
+		if (stickings.empty() || (nbScenarios > 0 && stickings.size() != nbScenarios)) continue; //All swept facets need the same number of scenarios
+		nbScenarios = stickings.size();
+		ep.sweepFacets.push_back((size_t)facetNode.attribute("id").as_llong() + idOffset);
+		ep.sweepStickings.push_back(stickings);
+	}
+	auto loadList = [&](const char *name, std::vector<size_t>& list) {
+		for (xml_node facetNode : engineNode.child(name).children("Facet"))
+			list.push_back((size_t)facetNode.attribute("id").as_llong() + idOffset);
+	};
+	loadList("Splitting", ep.splitFacets);
+	loadList("Estimator", ep.estimatorFacets);
+	loadList("Watch", ep.watchFacets);
+	loadList("Transfer", ep.transferFacets);
+	loadList("Covering", ep.coveringFacets);
+	int adjointTarget = engineNode.attribute("adjointTarget").as_int(-1);
+	if (adjointTarget >= 0 && ep.adjointTarget < 0) ep.adjointTarget = adjointTarget + (int)idOffset; //Single target: keep the current one on insert
 }
 
 bool MolflowGeometry::SaveXML_simustate(xml_node saveDoc, Worker *work, BYTE *buffer, GLProgress *prg, bool saveSelected){
@@ -2749,6 +2857,24 @@ bool MolflowGeometry::SaveXML_simustate(xml_node saveDoc, Worker *work, BYTE *bu
 	minMaxNode.child("Moments_only").append_child("Imp.rate").append_attribute("min") = gHits->texture_limits[2].min.moments_only;
 	minMaxNode.child("Moments_only").child("Imp.rate").append_attribute("max") = gHits->texture_limits[2].max.moments_only;
 
+	//Transfer matrix, sparse rows
+	UpdateTransferMatrix(buffer);
+	if (!transferMatrix.IsEmpty() && !saveSelected) {
+		xml_node transferNode = resultNode.append_child("TransferMatrix");
+		transferNode.append_attribute("nbFacets") = transferMatrix.facets.size();
+		for (size_t i = 0; i < transferMatrix.facets.size(); i++) {
+			xml_node sourceNode = transferNode.append_child("Source");
+			sourceNode.append_attribute("id") = transferMatrix.facets[i];
+			sourceNode.append_attribute("launched") = transferMatrix.launched[i];
+			for (size_t k = transferMatrix.rowStart[i]; k < transferMatrix.rowStart[i + 1]; k++) {
+				xml_node targetNode = sourceNode.append_child("Target");
+				targetNode.append_attribute("id") = transferMatrix.facets[transferMatrix.columns[k]];
+				targetNode.append_attribute("probability") = transferMatrix.probability[k];
+				targetNode.append_attribute("error") = transferMatrix.error[k];
+			}
+		}
+	}
+
 	return true;
 }
 
@@ -2757,6 +2883,7 @@ void MolflowGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgr
 	//mApp->ClearAllViews();
 	//mApp->ClearFormulas();
 	Clear();
+	transferMatrix.Clear();
 	xml_node geomNode = loadXML.child("Geometry");
 
 	//Vertices
@@ -2932,6 +3059,8 @@ void MolflowGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgr
 			work->wp.motionVector2.y = v2.attribute("y").as_double();
 			work->wp.motionVector2.z = v2.attribute("z").as_double();
 		}
+
+		LoadXML_engineFacets(simuParamNode.child("EngineFacets"), 0);
 	}
 
 	InitializeGeometry();
@@ -2954,6 +3083,7 @@ void MolflowGeometry::LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgr
 		double nU = f->sh.U.Norme();
 		f->tRatio = f->sh.texWidthD / nU;
 	}
+	mApp->SnapshotEngineFacets();
 }
 
 void MolflowGeometry::InsertXML(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg, bool newStr){
@@ -3069,6 +3199,7 @@ void MolflowGeometry::InsertXML(pugi::xml_node loadXML, Worker *work, GLProgress
 			s.selection.push_back(iNode.attribute("facet").as_int() + sh.nbFacet); //offset selection numbers
 		mApp->AddSelection(s);
 	}
+	if (isMolflowFile) LoadXML_engineFacets(simuParamNode.child("EngineFacets"), sh.nbFacet);
 
 	xml_node viewNode = interfNode.child("Views");
 	for (xml_node newView : selNode.children("View")) {
@@ -3125,6 +3256,7 @@ void MolflowGeometry::InsertXML(pugi::xml_node loadXML, Worker *work, GLProgress
 	if (newStr) sh.nbSuper += nbNewSuper;
 	else if (sh.nbSuper < structId + nbNewSuper) sh.nbSuper = structId + nbNewSuper;
 	InitializeGeometry();
+	mApp->SnapshotEngineFacets(); //Covers the inserted facets
 	//AdjustProfile();
 	//isLoaded = true; //InitializeGeometry() sets to true
 
@@ -3429,6 +3561,37 @@ bool MolflowGeometry::LoadXML_simustate(pugi::xml_node loadXML, Dataport *dpHit,
 	work->globalHitCache.texture_limits[2].min.moments_only = minMaxNode.child("Moments_only").child("Imp.rate").attribute("min").as_double();
 	work->globalHitCache.texture_limits[2].max.moments_only = minMaxNode.child("Moments_only").child("Imp.rate").attribute("max").as_double();
 
+	//Transfer matrix (facets listed as sources, in row order)
+	transferMatrix.Clear();
+	xml_node transferNode = resultNode.child("TransferMatrix");
+	if (transferNode) {
+		std::vector<size_t> rowOfFacet(sh.nbFacet, (size_t)-1);
+		for (xml_node sourceNode : transferNode.children("Source")) {
+			size_t id = (size_t)sourceNode.attribute("id").as_llong();
+			if (id >= sh.nbFacet) break;
+			rowOfFacet[id] = transferMatrix.facets.size();
+			transferMatrix.facets.push_back(id);
+			transferMatrix.launched.push_back(sourceNode.attribute("launched").as_double());
+		}
+		bool ok = transferMatrix.facets.size() == (size_t)transferNode.attribute("nbFacets").as_llong();
+		transferMatrix.rowStart.push_back(0);
+		for (xml_node sourceNode : transferNode.children("Source")) {
+			if (!ok) break;
+			for (xml_node targetNode : sourceNode.children("Target")) {
+				size_t id = (size_t)targetNode.attribute("id").as_llong();
+				if (id >= sh.nbFacet || rowOfFacet[id] == (size_t)-1) {
+					ok = false;
+					break;
+				}
+				transferMatrix.columns.push_back(rowOfFacet[id]);
+				transferMatrix.probability.push_back(targetNode.attribute("probability").as_double());
+				transferMatrix.error.push_back(targetNode.attribute("error").as_double());
+			}
+			transferMatrix.rowStart.push_back(transferMatrix.columns.size());
+		}
+		if (!ok) transferMatrix.Clear(); //Doesn't match the geometry
+	}
+
 	ReleaseDataport(dpHit);
 	return true;
 }
\ No newline at end of file
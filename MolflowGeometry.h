@@ -27,6 +27,18 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #define TEXTURE_MODE_DENSITY 2
 #define SYNVERSION 10
 
+// Engine results appended to the hits dataport by the subprocesses, after the regular hits and in this order
+#define HITS_SPECIES          0 // Extra species facet counters, [species][facet][moment]
+#define HITS_SPECIES_TEXTURES 1 // Extra species textures, [species][textured facet][moment][cell]
+#define HITS_SWEEP            2 // Sticking sweep facet counters, [scenario][facet][moment]
+#define HITS_ESTIMATOR        3 // Forced detection counters, [target][moment]
+#define HITS_ADJOINT          4 // Adjoint results, one per facet
+#define HITS_CONVERGENCE      5 // Batch-means statistics of the watched facets
+#define HITS_QUOTA            6 // Desorption quota counter
+#define HITS_TRANSFER         7 // Launched molecules of each source, then the source-target tallies
+#define HITS_COVERING         8 // Covering evolution: finished steps, then time and coverings after each step
+#define HITS_END              9
+
 class Worker;
 
 class MolflowGeometry: public Geometry {
@@ -63,6 +75,7 @@ public:
 	void LoadXML_geom(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg);
 	void InsertXML(pugi::xml_node loadXML, Worker *work, GLProgress *progressDlg, bool newStr);
 	bool LoadXML_simustate(pugi::xml_node loadXML, Dataport *dpHit, Worker *work, GLProgress *progressDlg);
+	void LoadXML_engineFacets(pugi::xml_node engineNode, size_t idOffset); //Appends the engine facet lists of a file, ids offset by idOffset
 
 	// Geometry
 	void     BuildPipe(double L, double R, double s, int step);
@@ -71,6 +84,14 @@ public:
 	// Memory usage (in bytes)
 	size_t GetGeometrySize();
 	size_t GetHitsSize(std::vector<double> *moments);
+	size_t GetHitsOffset(size_t block, size_t nbMoments); //Start of one of the HITS_* blocks, HITS_END: total size
+	size_t GetSpeciesTextureCells(size_t nbMoments); //Texture cells of one extra species, all textured facets and moments
+	size_t GetSpeciesTextureOffset(size_t species, size_t facetId, size_t nbMoments); //Constant flow texture of a textured facet for an extra species
+
+	// Transfer matrix of the last transfer matrix run (or loaded with the results)
+	TransferMatrix transferMatrix;
+	void UpdateTransferMatrix(BYTE *buffer); //From the hits dataport, kept if the run has no transfer results
+	size_t GetCoveringTimelineSize(); //HITS_COVERING block, 0 if the covering evolution is off
 
 	// Raw data buffer (geometry)
 	void CopyGeometryBuffer(BYTE *buffer,const OntheflySimulationParams& ontheflyParams);
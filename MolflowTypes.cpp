@@ -18,6 +18,8 @@ GNU General Public License for more details.
 Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #include "MolflowTypes.h"
+#include <math.h>
+#include <algorithm>
 
 ProfileSlice& ProfileSlice::operator+=(const ProfileSlice& rhs)
 {
@@ -34,3 +36,117 @@ TextureCell& TextureCell::operator+=(const TextureCell& rhs)
 	this->sum_1_per_ort_velocity += rhs.sum_1_per_ort_velocity;
 	return *this;
 }
+
+void BatchStatistics::Add(double batchValue)
+{
+	nbBatches += 1.0;
+	sum += batchValue;
+	sumSquares += batchValue * batchValue;
+}
+
+BatchStatistics& BatchStatistics::operator+=(const BatchStatistics& rhs)
+{
+	this->nbBatches += rhs.nbBatches;
+	this->sum += rhs.sum;
+	this->sumSquares += rhs.sumSquares;
+	return *this;
+}
+
+double BatchStatistics::RelativeError() const
+{
+	if (nbBatches < 2.0 || sum == 0.0) return -1.0;
+	double mean = sum / nbBatches;
+	double variance = (sumSquares / nbBatches - mean * mean) * nbBatches / (nbBatches - 1.0);
+	if (variance < 0.0) variance = 0.0; //Rounding
+	return sqrt(variance / nbBatches) / fabs(mean);
+}
+
+FacetConvergence& FacetConvergence::operator+=(const FacetConvergence& rhs)
+{
+	this->absorption += rhs.absorption;
+	this->covering += rhs.covering;
+	this->pressure += rhs.pressure;
+	return *this;
+}
+
+double FacetConvergence::MaxRelativeError() const
+{
+	double maxError = -1.0;
+	for (const BatchStatistics* stat : { &absorption, &covering, &pressure }) {
+		double error = stat->RelativeError();
+		if (error > maxError) maxError = error;
+	}
+	return maxError;
+}
+
+void TransferMatrix::Clear()
+{
+	facets.clear();
+	launched.clear();
+	rowStart.clear();
+	columns.clear();
+	probability.clear();
+	error.clear();
+}
+
+void TransferMatrix::Build(const std::vector<size_t>& transferFacets, const double* launchedCounts, const TransferEntry* entries)
+{
+	Clear();
+	size_t nbFacets = transferFacets.size();
+	facets = transferFacets;
+	launched.assign(launchedCounts, launchedCounts + nbFacets);
+	rowStart.push_back(0);
+	for (size_t i = 0; i < nbFacets; i++) {
+		double n = launched[i];
+		for (size_t j = 0; j < nbFacets; j++) {
+			const TransferEntry& entry = entries[i * nbFacets + j];
+			if (n == 0.0 || entry.sum == 0.0) continue;
+			double p = entry.sum / n;
+			double variance = (n > 1.0) ? (entry.sumSquares / n - p * p) * n / (n - 1.0) : 0.0; //Of one trajectory's weight
+			if (variance < 0.0) variance = 0.0; //Rounding
+			columns.push_back(j);
+			probability.push_back(p);
+			error.push_back(sqrt(variance / n));
+		}
+		rowStart.push_back(columns.size());
+	}
+}
+
+bool TransferMatrix::Step(std::vector<double>& x, const std::vector<double>& rate, const std::vector<double>& source, double dt) const
+{
+	// Unknowns are the fluxes z = rate*x leaving each facet at the end of the step:
+	// z_j (1/rate_j + dt (1-P_jj)) = x_j + dt (sum_i P_ij source_i + sum_i!=j P_ij z_i)
+	// Rows sum to at most 1, so the iteration contracts. Facets with rate 0 keep what they get
+	size_t n = facets.size();
+	std::vector<double> diagonal(n, 0.0), arriving(n, 0.0), z(n), zNew(n), y(n);
+	for (size_t i = 0; i < n; i++) {
+		for (size_t k = rowStart[i]; k < rowStart[i + 1]; k++) {
+			if (columns[k] == i) diagonal[i] = probability[k];
+			arriving[columns[k]] += probability[k] * source[i];
+		}
+		z[i] = rate[i] * x[i]; //Explicit guess
+	}
+	bool converged = false;
+	for (size_t iter = 0; iter < 1000 && !converged; iter++) {
+		std::fill(y.begin(), y.end(), 0.0);
+		for (size_t i = 0; i < n; i++)
+			for (size_t k = rowStart[i]; k < rowStart[i + 1]; k++)
+				if (columns[k] != i) y[columns[k]] += probability[k] * z[i];
+		double maxChange = 0.0, maxFlux = 0.0;
+		for (size_t j = 0; j < n; j++) {
+			zNew[j] = (rate[j] > 0.0) ? (x[j] + dt * (arriving[j] + y[j])) / (1.0 / rate[j] + dt * (1.0 - diagonal[j])) : 0.0;
+			maxChange = std::max(maxChange, fabs(zNew[j] - z[j]));
+			maxFlux = std::max(maxFlux, zNew[j]);
+		}
+		z.swap(zNew);
+		converged = maxChange <= 1E-12 * maxFlux;
+	}
+	if (!converged) return false;
+	std::fill(y.begin(), y.end(), 0.0);
+	for (size_t i = 0; i < n; i++)
+		for (size_t k = rowStart[i]; k < rowStart[i + 1]; k++)
+			if (columns[k] != i) y[columns[k]] += probability[k] * z[i];
+	for (size_t j = 0; j < n; j++)
+		x[j] = (rate[j] > 0.0) ? z[j] / rate[j] : x[j] + dt * (arriving[j] + y[j]);
+	return true;
+}
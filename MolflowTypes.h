@@ -19,6 +19,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #pragma once
 #include "GLApp/GlTypes.h"
+#include <vector>
 //#include "Buffer_shared.h"
 
 // Desorption type
@@ -141,6 +142,96 @@ public:
 	}
 };
 
+//Subprocess engine settings, passed with the geometry on load (not changeable on-the-fly)
+class EngineParams {
+public:
+	size_t nbThreads = 1; //Monte Carlo worker threads per subprocess, sharing one copy of the geometry
+	size_t randomSeed = 0; //Run seed of the particle random streams, 0: new seed on every load
+	std::vector<double> speciesMasses; //Extra gas masses (g/mol) tallied on the traced trajectories, none: single species
+	std::vector<size_t> sweepFacets; //Facets (global index) with a sticking sweep
+	std::vector<std::vector<double>> sweepStickings; //Sticking of each sweep scenario, same count for every facet in sweepFacets
+	double rouletteThreshold = 0.0; //Weighted particles below this play Russian roulette instead of the lowFluxCutoff, 0: off
+	size_t splitFactor = 1; //Copies made of a particle crossing or hitting a splitting facet, 1: off
+	std::vector<size_t> splitFacets; //Facets (global index) marking the important regions
+	std::vector<size_t> estimatorFacets; //Target facets (global index) of the forced detection estimator
+	int adjointTarget = -1; //Adjoint mode: particles start from this facet (global index), -1: regular forward run
+	std::vector<size_t> watchFacets; //Facets (global index) with batch-means error estimates
+	size_t batchSize = 1000; //Desorbed particles per batch (in each thread)
+	double targetRelativeError = 0.0; //Stop once all watched facets are below this relative standard error, 0: never
+	size_t packetSize = 1; //Particles traced together by each thread (ray packets), 1: one at a time
+	std::vector<size_t> transferFacets; //Transfer matrix mode: facets (global index) desorbing in turn, absorptions on them scored per source
+	std::vector<size_t> coveringFacets; //Covering evolution: facets (global index) whose covering desorbs and sets their sticking, none: off
+	size_t coveringSteps = 100; //Time steps run by the subprocess without reloading
+	double coveringTimeStep = 1.0; //Duration of one step (s)
+	size_t stepDesorptions = 100000; //Test particles desorbed in each step
+	size_t bvhWidth = 2; //Children per BVH node traversed by Intersect(): 2 (binary), 4 (SSE) or 8 (AVX)
+
+	template<class Archive>
+	void serialize(Archive & archive)
+	{
+		archive(nbThreads, randomSeed, speciesMasses, sweepFacets, sweepStickings, rouletteThreshold, splitFactor, splitFacets, estimatorFacets, adjointTarget,
+			watchFacets, batchSize, targetRelativeError, packetSize, transferFacets, coveringFacets, coveringSteps, coveringTimeStep, stepDesorptions, bvhWidth);
+	}
+};
+
+//Batch means of one facet quantity, each batch summing the same number of desorbed particles
+class BatchStatistics {
+public:
+	double nbBatches = 0.0;
+	double sum = 0.0;
+	double sumSquares = 0.0;
+	void Add(double batchValue);
+	BatchStatistics& operator+=(const BatchStatistics& rhs);
+	double RelativeError() const; //Relative standard error of the mean, -1 if not known yet (less than 2 batches or zero mean)
+};
+
+//Convergence of one watched facet (constant flow), in the hits dataport after the adjoint results
+class FacetConvergence {
+public:
+	BatchStatistics absorption; //nbAbsEquiv
+	BatchStatistics covering;
+	BatchStatistics pressure; //sum_v_ort
+	FacetConvergence& operator+=(const FacetConvergence& rhs);
+	double MaxRelativeError() const; //Over the quantities with a known error, -1 if none
+};
+
+//Adjoint mode result of one facet, in the hits dataport after the forward results (one per facet)
+//Divided by the number of adjoint particles launched: transfer factor of the facet to the target,
+//and its contribution to the target's incoming flux
+class AdjointResult {
+public:
+	double nbHitEquiv = 0.0; //Adjoint particles arriving on the facet
+	double transfer = 0.0; //Sum of arrivals times target area / facet area (halved or doubled for 2-sided facets)
+	double flux = 0.0; //Same times the facet's outgassing (molecules/s)
+};
+
+//Transfer matrix mode tally of one source-target pair, in the hits dataport after the quota counter
+//(launched molecules of each source first, then these entries [source][target])
+class TransferEntry {
+public:
+	double sum = 0.0; //Absorbed weight on the target
+	double sumSquares = 0.0; //Squared weight of each trajectory on the target
+};
+
+//Facet-to-facet transfer probabilities of a transfer matrix run, in compressed sparse rows:
+//entry (i,j) is the chance that a molecule desorbed from facets[i] gets absorbed on facets[j]
+class TransferMatrix {
+public:
+	std::vector<size_t> facets; //Global index of each row (and column)
+	std::vector<double> launched; //Molecules desorbed from each row's facet
+	std::vector<size_t> rowStart; //First entry of each row, facets.size()+1 values
+	std::vector<size_t> columns;
+	std::vector<double> probability;
+	std::vector<double> error; //Standard error of each probability
+
+	void Clear();
+	bool IsEmpty() const { return columns.empty(); }
+	void Build(const std::vector<size_t>& transferFacets, const double* launchedCounts, const TransferEntry* entries); //Zero entries dropped
+	//One implicit Euler step of the coverings x (one per row): dx/dt = P^T (rate*x + source) - rate*x.
+	//Jacobi iterations on the desorption fluxes rate*x, false if they don't converge
+	bool Step(std::vector<double>& x, const std::vector<double>& rate, const std::vector<double>& source, double dt) const;
+};
+
 //Just for AC matrix calculation in Molflow, old mesh structure:
 typedef struct {
 
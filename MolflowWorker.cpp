@@ -1040,6 +1040,8 @@ void Worker::ComputeAC(float appTime) {
 }
 
 void Worker::RealReload() { //Sharing geometry with workers
+	mApp->RemapEngineFacets(); //Facets may have been removed or reordered since the lists were set
+
 	GLProgress *progressDlg = new GLProgress("Performing preliminary calculations on geometry...", "Passing Geometry to workers");
 	progressDlg->SetVisible(true);
 	progressDlg->SetProgress(0.0);
@@ -1187,6 +1189,7 @@ std::ostringstream Worker::SerializeForLoader()
 	outputarchive(
 		CEREAL_NVP(wp),
 		CEREAL_NVP(ontheflyParams),
+		cereal::make_nvp("engineParams", mApp->engineParams),
 		CEREAL_NVP(CDFs),
 		CEREAL_NVP(IDs),
 		CEREAL_NVP(parameters),
@@ -1883,6 +1886,7 @@ void Worker::ImportLoadBuffer(char *fileName)
 		//Worker params
 		inputarchive(wp);
 		inputarchive(ontheflyParams);
+		inputarchive(mApp->engineParams);
 		inputarchive(CDFs);
 		inputarchive(IDs);
 		inputarchive(parameters);
@@ -1891,6 +1895,7 @@ void Worker::ImportLoadBuffer(char *fileName)
 		inputarchive(desorptionParameterIDs);
 
 		geom->ImportFromLoader(inputarchive);
+		mApp->SnapshotEngineFacets(); //Engine facet lists came with this geometry
 
 	//inputarchive goes out of scope, file released
 
@@ -19,29 +19,34 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 */
 #include "Simulation.h"
 #include "IntersectAABB_shared.h"
-
-SuperStructure::SuperStructure()
-{
-	aabbTree = NULL;
-}
-
-SuperStructure::~SuperStructure()
-{
-	SAFE_DELETE(aabbTree);
-}
+#include <math.h>
+#include <algorithm>
 
 Simulation::Simulation()
 {
 	totalDesorbed = 0;
+	nbRouletteKilled = 0;
+	nbSplit = 0;
+	prIdx = 0;
+	speciesOffset = speciesTextureOffset = sweepOffset = estimatorOffset = adjointOffset = 0;
+	speciesTextureCells = 0;
+	adjointTarget = NULL;
+	watchOffset = 0;
+	maxRelativeError = -1.0;
+	converged = false;
+	quotaOffset = 0;
+	desorptionQuota = NULL;
+	transferOffset = coveringOffset = 0;
+	coveringStep = 0;
+	stepEnd = 0;
+	particleWeight = 0.0;
+	nbScenarios = 0;
 
 	loadOK = false;
 	wp.sMode = MC_MODE;
-	currentParticle.lastHitFacet = NULL;
 
 	hasVolatile = false;
 
-	memset(&tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
-
 	sh.nbSuper = 0;
 	acDensity =
 		acMatrix =
@@ -57,3 +62,179 @@ Simulation::Simulation()
 		acLines =
 		acTLines = NULL;
 }
+
+bool AliasTable::Build(const std::vector<double>& weights)
+{
+	size_t n = weights.size();
+	double sum = 0.0;
+	for (const double& w : weights) sum += w;
+	if (n == 0 || !(sum > 0.0)) {
+		probability.clear();
+		alias.clear();
+		return false;
+	}
+
+	probability.assign(n, 1.0);
+	alias.resize(n);
+	std::vector<double> scaled(n);
+	std::vector<size_t> small, large;
+	for (size_t i = 0; i < n; i++) {
+		alias[i] = i;
+		scaled[i] = weights[i] * (double)n / sum;
+		if (scaled[i] < 1.0) small.push_back(i);
+		else large.push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		size_t s = small.back(); small.pop_back();
+		size_t l = large.back();
+		probability[s] = scaled[s];
+		alias[s] = l;
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+		if (scaled[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	//Columns left in either list are full (up to rounding), probability 1.0 set above
+	return true;
+}
+
+size_t AliasTable::Sample(const double& r) const
+{
+	double x = r * (double)probability.size();
+	size_t column = (size_t)x;
+	if (column >= probability.size()) column = probability.size() - 1;
+	return (x - (double)column < probability[column]) ? column : alias[column];
+}
+
+double SolveMaxwellCDF(double p) {
+	//Returns x = v^2/(2a^2) where exp(-x)*(1+x) = 1-p, Newton's method on log(1+x) - x - log(1-p) = 0
+	if (p <= 0.0) return 0.0;
+	double L = -log1p(-p);
+	double x = (p < 0.5) ? sqrt(2.0 * p) : L + log1p(L); //Small x: F ~ x^2/2, large x: x ~ L + log(1+L)
+	for (size_t i = 0; i < 100; i++) {
+		double next = x - (log1p(x) - x + L) / (-x / (1.0 + x));
+		if (next <= 0.0) next = 0.5 * x;
+		if (abs(next - x) < 1E-15 * (1.0 + x)) return next;
+		x = next;
+	}
+	return x;
+}
+
+void MaxwellInverseCDF::Build(double gasTempKelvins, double gasMassGramsPerMol, size_t size)
+{
+	a = sqrt(kb*gasTempKelvins / (gasMassGramsPerMol*1.67E-27)); //Same constants as Worker::Generate_CDF
+	speeds.resize(size);
+	for (size_t i = 0; i < size; i++)
+		speeds[i] = a * sqrt(2.0 * SolveMaxwellCDF((double)i / (double)size));
+}
+
+double MaxwellInverseCDF::Sample(const double& r) const
+{
+	double x = r * (double)speeds.size();
+	size_t i = (size_t)x;
+	if (i + 1 < speeds.size()) return speeds[i] + (x - (double)i) * (speeds[i + 1] - speeds[i]);
+	//Tail: fixed point of x = L + log(1+x), converges fast since x is large here
+	double L = -log1p(-r);
+	double tail = L + log1p(L);
+	for (size_t j = 0; j < 4; j++) tail = L + log1p(tail);
+	return a * sqrt(2.0 * tail);
+}
+
+bool FastLookupTable::Build(const std::vector<std::pair<double, double>>& knots, bool allowExtrapolate)
+{
+	if (knots.empty()) return false;
+	extrapolate = allowExtrapolate;
+	xs.resize(knots.size()); ys.resize(knots.size());
+	for (size_t i = 0; i < knots.size(); i++) {
+		xs[i] = knots[i].first;
+		ys[i] = knots[i].second;
+	}
+	size_t nbBuckets = 2 * xs.size();
+	logGrid = xs.front() > 0.0 && xs.back() > 100.0 * xs.front(); //Catalog curves are often given on log time scales
+	gridMin = logGrid ? log(xs.front()) : xs.front();
+	double gridMax = logGrid ? log(xs.back()) : xs.back();
+	gridStep = (gridMax > gridMin) ? (gridMax - gridMin) / (double)nbBuckets : 1.0;
+	bucketStart.resize(nbBuckets);
+	size_t i = 0;
+	for (size_t b = 0; b < nbBuckets; b++) {
+		double edge = gridMin + (double)b * gridStep;
+		if (logGrid) edge = exp(edge);
+		while (i + 2 < xs.size() && xs[i + 1] <= edge) i++;
+		bucketStart[b] = i;
+	}
+	return true;
+}
+
+double FastLookupTable::Get(const double& x) const
+{
+	size_t n = xs.size();
+	if (n < 2) return n ? ys[0] : 0.0;
+	size_t i;
+	if (x <= xs.front()) {
+		if (!extrapolate) return ys.front();
+		i = 0;
+	}
+	else if (x >= xs.back()) {
+		if (!extrapolate) return ys.back();
+		i = n - 2;
+	}
+	else {
+		double g = logGrid ? log(x) : x;
+		size_t b = (size_t)((g - gridMin) / gridStep);
+		if (b >= bucketStart.size()) b = bucketStart.size() - 1;
+		i = bucketStart[b];
+		while (i > 0 && xs[i] > x) i--; //rounding at the bucket edge
+		while (xs[i + 1] <= x) i++;
+	}
+	double dx = xs[i + 1] - xs[i];
+	if (dx == 0.0) return ys[i + 1]; //step at the end of the curve
+	return ys[i] + (x - xs[i]) * (ys[i + 1] - ys[i]) / dx;
+}
+
+void ParticleRandomStream::Seed(uint64_t seed)
+{
+	key[0] = (uint32_t)seed;
+	key[1] = (uint32_t)(seed >> 32);
+	SetParticle(0);
+}
+
+void ParticleRandomStream::SetParticle(uint64_t index)
+{
+	particleIndex = index;
+	blockIndex = 0;
+	position = 2 * randomBatchBlocks; //Refill on next draw
+}
+
+void ParticleRandomStream::Fill(double* out, size_t nbBlocks)
+{
+	// Lanes are independent blocks, kept in separate arrays so the rounds vectorize
+	uint32_t c0[randomBatchBlocks], c1[randomBatchBlocks], c2[randomBatchBlocks], c3[randomBatchBlocks];
+	for (size_t done = 0; done < nbBlocks; done += randomBatchBlocks) {
+		size_t nbLanes = std::min(randomBatchBlocks, nbBlocks - done);
+		for (size_t l = 0; l < randomBatchBlocks; l++) {
+			uint64_t block = blockIndex + l;
+			c0[l] = (uint32_t)block; c1[l] = (uint32_t)(block >> 32);
+			c2[l] = (uint32_t)particleIndex; c3[l] = (uint32_t)(particleIndex >> 32);
+		}
+		uint32_t k0 = key[0], k1 = key[1];
+		for (size_t round = 0; round < 10; round++) {
+			for (size_t l = 0; l < randomBatchBlocks; l++) {
+				uint64_t p0 = (uint64_t)0xD2511F53 * c0[l];
+				uint64_t p1 = (uint64_t)0xCD9E8D57 * c2[l];
+				uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[l] ^ k0;
+				uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3[l] ^ k1;
+				c1[l] = (uint32_t)p1;
+				c3[l] = (uint32_t)p0;
+				c0[l] = n0;
+				c2[l] = n2;
+			}
+			k0 += 0x9E3779B9; k1 += 0xBB67AE85;
+		}
+		for (size_t l = 0; l < nbLanes; l++) {
+			out[2 * (done + l)] = (double)(((uint64_t)c0[l] << 21) ^ (c1[l] >> 11)) * (1.0 / 9007199254740992.0);
+			out[2 * (done + l) + 1] = (double)(((uint64_t)c2[l] << 21) ^ (c3[l] >> 11)) * (1.0 / 9007199254740992.0);
+		}
+		blockIndex += nbLanes;
+	}
+}
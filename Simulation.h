@@ -26,10 +26,28 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Vector.h"
 #include "Parameter.h"
 #include <tuple>
+#include <stdint.h>
+#include <atomic>
 
 const double carbondiameter = 2 * 76E-12;
 const double kb = 1.38E-23;
 const double tau = 1E-13;
+const size_t inverseCDFSize = 1024; //Probability steps of the Maxwell speed samplers
+const size_t randomBatchBlocks = 8; //Philox blocks generated together, 2 doubles each
+const size_t maxPendingSplits = 1024; //Split copies waiting to be traced per thread, no more splitting above
+const double minConvergenceBatches = 20.0; //Batches of every watched facet before the relative error can stop the run
+const size_t angleMapGuideCells = 4; //Guide table cells per angle map line (theta) and per phi cell
+const size_t maxAngleMapGuideSize = 1 << 21; //Phi guide entries per facet, one per cell (then binary search) above
+const size_t maxPacketSize = 16; //Lanes of a ray packet, a multiple of the 4 rays tested together
+const size_t polygonGridMinVertices = 8; //Facets with more vertices get a point-in-facet grid
+const llong maxQuotaChunk = 1024; //Particles claimed at once from the shared desorption quota
+const double desorptionEnergy = 1.5E-21; //E_de (J) of the first order desorption from the covering
+const double adsorptionEnergy = 1E-21; //E_ad (J) of the covering-dependent sticking
+const double stickingEmpty = 0.1; //Sticking factor on a clean surface (before the temperature term)
+const double stickingFull = 0.2; //Same from one monolayer on
+
+//The quota counter is shared by the subprocesses through the hits dataport, it must not need a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Desorption quota requires lock-free 64-bit atomics");
 
 class Anglemap {
 public:
@@ -44,8 +62,84 @@ public:
 	double GetPhipdfValue(const double & thetaIndex, const int & phiIndex, const AnglemapParams & anglemapParams);
 	double GetPhiCDFValue(const double& thetaIndex, const int& phiIndex, const AnglemapParams& anglemapParams);
 	double GetPhiCDFSum(const double & thetaIndex, const AnglemapParams & anglemapParams);
-	std::tuple<double, int, double> GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams);
-	double GeneratePhiFromAngleMap(const int& thetaLowerIndex, const double& thetaOvershoot, const AnglemapParams& anglemapParams);
+	std::tuple<double, int, double> GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams, double lookupValue);
+	double GeneratePhiFromAngleMap(const int& thetaLowerIndex, const double& thetaOvershoot, const AnglemapParams& anglemapParams, double lookupValue);
+
+	// Guide tables (Chen-Asau) for desorption: where the CDF searches of the generators start, the inversion itself is unchanged
+	std::vector<int> thetaGuide; //Last theta_CDF index below probability g/size (-1: none), empty: binary search
+	std::vector<int> phiGuide;   //Same for each phi_CDFs line, [theta line][cell], empty: binary search
+	size_t phiGuideCells;        //Guide cells of each phi line
+	bool BuildGuideTables(const AnglemapParams& anglemapParams);
+	int FindThetaLowerIndex(const double& lookupValue);
+	int FindPhiLowerIndex(const double& lookupValue, const double& weigh, const size_t& line1, const size_t& line2, const AnglemapParams& anglemapParams); //In the phi CDF blended from two lines
+	std::pair<double, double> SampleInverse(const double& r1, const double& r2, const AnglemapParams& anglemapParams); //theta, phi
+};
+
+// Walker/Vose alias table: draws an index proportionally to its weight in constant time
+class AliasTable {
+public:
+	std::vector<double> probability; // Chance of keeping the drawn column
+	std::vector<size_t> alias;       // Column taken otherwise
+
+	bool Build(const std::vector<double>& weights);
+	size_t Sample(const double& r) const; // r uniform in [0,1)
+};
+
+// Inverse of the wall-collision Maxwell speed CDF, F(v) = 1-exp(-x)*(1+x) with x = v^2/(2a^2),
+// tabulated on uniform probability steps. The last step (v -> infinity) is solved analytically
+class MaxwellInverseCDF {
+public:
+	double a; // Distribution parameter sqrt(kT/m) in m/s
+	std::vector<double> speeds; // Speed at probability i/speeds.size()
+
+	void Build(double gasTempKelvins, double gasMassGramsPerMol, size_t size);
+	double Sample(const double& r) const; // r uniform in [0,1)
+};
+
+// Piecewise linear y(x) with a uniform bucket index over x (logarithmic if x spans decades),
+// a lookup is one bucket read and a short scan instead of a search over the whole curve
+class FastLookupTable {
+public:
+	std::vector<double> xs; // Knots, increasing
+	std::vector<double> ys;
+	std::vector<size_t> bucketStart; // Last knot at or before each bucket's lower edge
+	double gridMin;
+	double gridStep;
+	bool logGrid;
+	bool extrapolate; // Linear extrapolation beyond the knots, otherwise clamp to the end values
+
+	bool Build(const std::vector<std::pair<double, double>>& knots, bool allowExtrapolate);
+	double Get(const double& x) const;
+};
+
+// Philox4x32-10 counter-based generator (Salmon et al., SC'11). Random numbers of a particle depend only on
+// (run seed, particle index, draw number), so any worker can trace any particle and get the same trajectory
+class ParticleRandomStream {
+public:
+	uint32_t key[2];         // Run seed
+	uint64_t particleIndex;  // Counter words 2-3
+	uint64_t blockIndex;     // Counter words 0-1, next block to generate
+	double   buffer[2 * randomBatchBlocks];
+	size_t   position;       // Next unused value in buffer
+
+	void Seed(uint64_t seed);
+	void SetParticle(uint64_t index); // Restarts the stream at the first draw of a particle
+	void Fill(double* out, size_t nbBlocks); // 2*nbBlocks values in [0,1), next blocks of the current particle
+	double Next() {
+		if (position == 2 * randomBatchBlocks) {
+			Fill(buffer, randomBatchBlocks);
+			position = 0;
+		}
+		return buffer[position++];
+	}
+};
+
+// Point-in-facet lookup over the UV square, built on load for facets with many vertices. Cells clear of
+// every edge answer directly, the others run the full IsInFacet() crossing test
+class PolygonGrid {
+public:
+	size_t size = 0; //Cells per side, 0: no grid
+	std::vector<char> cells; //Row by row (v): 0 outside, 1 inside, 2 crossed by an edge
 };
 
 // Local facet structure
@@ -55,17 +149,17 @@ public:
 
 	std::vector<size_t>      indices;          // Indices (Reference to geometry vertex)
 	std::vector<Vector2d> vertices2;        // Vertices (2D plane space, UV coordinates)
-	std::vector<std::vector<TextureCell>>     texture;            // Texture hit recording (taking area, temperature, mass into account), 1+nbMoments
 	std::vector<double>   textureCellIncrements;              // Texure increment
+	bool     isInstrumented;    // Texture, direction, profile, angle map, histogram or logger recording, see UpdateInstrumentedFacets()
 	std::vector<bool>     largeEnough;      // cells that are NOT too small for autoscaling
 	double   fullSizeInc;       // Texture increment of a full texture element
-	std::vector<std::vector<DirectionCell>>     direction;       // Direction field recording (average), 1+nbMoments
 	//bool     *fullElem;         // Direction field recording (only on full element)
-	std::vector<std::vector<ProfileSlice>> profile;         // Distribution and hit recording
-	std::vector<double>   outgassingMap; // Cumulative outgassing map when desorption is based on imported file
+	std::vector<double>   outgassingMap; // Outgassing map when desorption is based on imported file, released once outgassingMapTable is built
+	AliasTable outgassingMapTable; // Picks a map cell proportionally to its outgassing
 	double outgassingMapWidthD; //actual outgassing file map width
 	double outgassingMapHeightD; //actual outgassing file map height
 	Anglemap angleMap;
+	PolygonGrid polygonGrid;
 
 	// Temporary var (used in Intersect for collision)
 	double colDist;
@@ -88,11 +182,6 @@ public:
 	int IDid;  //If time-dependent desorption, which is its ID*/
 	size_t globalId; //Global index (to identify when superstructures are present)
 
-	// Facet hit counters
-	std::vector<FacetHitBuffer> tmpCounter; //1+nbMoment
-	std::vector<FacetHistogramBuffer> tmpHistograms; //1+nbMoment
-	void  ResetCounter();
-	void	ResizeCounter(size_t nbMoments);
 	bool  InitializeOnLoad(const size_t& globalId);
 
 	void InitializeHistogram();
@@ -105,23 +194,95 @@ public:
 
 	bool InitializeAngleMap();
 
-	void InitializeOutgassingMap();
+	bool InitializeOutgassingMap();
+
+	bool InitializePolygonGrid();
+
+	bool IsInside(const double& u, const double& v) const; //IsInFacet() through the polygon grid
 
 	bool InitializeLinkAndVolatile(const size_t & id);
 
 	void RegisterTransparentPass(); //Allows one shared Intersect routine between MolFlow and Synrad
 };
 
-// Local simulation structure
+// Hit recording of one facet by one MC thread (the geometry itself is shared read-only between threads)
+class FacetHitState {
+public:
+	std::vector<FacetHitBuffer> tmpCounter; //1+nbMoment
+	std::vector<FacetHistogramBuffer> tmpHistograms; //1+nbMoment
+	std::vector<std::vector<TextureCell>>     texture;            // Texture hit recording (taking area, temperature, mass into account), 1+nbMoments
+	std::vector<std::vector<DirectionCell>>     direction;       // Direction field recording (average), 1+nbMoments
+	std::vector<std::vector<ProfileSlice>> profile;         // Distribution and hit recording
+	std::vector<size_t>   angleMapPdf;   // Recorded incident angle map
+	bool   hitted;        // Has something to send on next UpdateMCHits
+	bool   ready;         // Volatile state
 
-class AABBNODE;
+	bool  Initialize(SubprocessFacet& f, size_t nbMoments);
+	void  ResetCounter();
+};
+
+// Ray/facet test data of one facet, kept in leaf order next to bvhFacets: a leaf's tests read one contiguous block
+// (two cache lines per facet), the facet itself is only read for hits inside its UV parallelogram
+class FacetRayData {
+public:
+	Vector3d origin; //sh.O
+	Vector3d normal; //sh.Nuv, sign of the back facet test
+	Vector3d uInverse; //Dual basis of (U,V,Nuv): u = uInverse.(p-origin) and v = vInverse.(p-origin) for p in the plane
+	Vector3d vInverse;
+	bool is2sided;
+	bool opaque; //Constant opacity of 1, no random number drawn
+};
+
+// Node of a structure's flattened BVH (depth-first: the left child of an inner node is the next node)
+class BVHNode {
+public:
+	float bbMin[3]; //Rounded outwards from the facets' double bounds
+	float bbMax[3];
+	uint32_t offset; //Inner node: index of the right child, leaf: first facet in the structure's bvhFacets
+	uint32_t count; //Facets of a leaf, 0 for inner nodes
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
+
+// Node of a structure's wide BVH (ep.bvhWidth 4 or 8), collapsed from the binary one. The bounds of
+// its children are stored as structure-of-arrays, to be tested together in one SIMD step
+template <size_t W> class WideBVHNode {
+public:
+	float minX[W], minY[W], minZ[W]; //Padded for the float ray/box test
+	float maxX[W], maxY[W], maxZ[W];
+	uint32_t child[W]; //Inner child: node index, leaf child: first facet in bvhFacets
+	uint32_t count[W]; //Facets of a leaf child, 0 for an inner child
+	uint32_t nbChildren;
+};
+
+// Tree statistics printed in the load log
+class BVHStatistics {
+public:
+	size_t nbNodes = 0;
+	size_t nbLeaves = 0;
+	size_t maxDepth = 0;
+	size_t maxLeafSize = 0;
+	double sahCost = 0.0; //Expected cost of a ray through the root box, in facet tests (one node visit counted as one test)
+};
+
+// Local simulation structure
 
 class SuperStructure {
 public:
-	SuperStructure();
-	~SuperStructure();
 	std::vector<SubprocessFacet>  facets;   // Facet handles
-	AABBNODE* aabbTree; // Structure AABB tree
+	std::vector<BVHNode> bvhNodes; // Structure BVH, built by BuildBVH() on load, empty if no facets
+	std::vector<SubprocessFacet*> bvhFacets; // Facets in leaf order
+	std::vector<FacetRayData> bvhRayData; // Same order
+	BVHStatistics bvhStats;
+	std::vector<WideBVHNode<4>> bvh4Nodes; // Wide BVH used instead if ep.bvhWidth is 4
+	std::vector<WideBVHNode<8>> bvh8Nodes; // Same, ep.bvhWidth 8
+};
+
+class TransparentHit {
+public:
+	SubprocessFacet* facet;
+	double colDist;
+	double colU;
+	double colV;
 };
 
 class CurrentParticleStatus {
@@ -137,33 +298,185 @@ public:
 	size_t   structureId;        // Current structure
 	int      teleportedFrom;   // We memorize where the particle came from: we can teleport back
 	SubprocessFacet *lastHitFacet;     // Last hitted facet
-	std::vector<SubprocessFacet*> transparentHitBuffer; //Storing this buffer simulation-wide is cheaper than recreating it at every Intersect() call
+	double   colU;             // Collision coordinates on the facet being recorded
+	double   colV;
+	std::vector<TransparentHit> transparentHitBuffer; //Storing this buffer simulation-wide is cheaper than recreating it at every Intersect() call
+	std::vector<double> speciesFlightTime; //Flight time of each extra species along the same path
+	std::vector<double> scenarioRatio; //Weight of the trajectory in each sticking sweep scenario (oriRatio of the base run), likelihood ratios of the outcomes on swept facets
+	std::vector<double> scenarioRatioBeforeCollision; //Local copy while splitting in low flux mode
+	bool splitPending; //Crossed a splitting facet on the way to the next hit
+	SubprocessFacet *pendingReflection; //Split copy made during a bounce: its own reflection off this facet is still to be drawn
+	bool nextEventCovered; //Last emission was diffuse and already tallied by the forced detection estimator
+	int transferRow; //Transfer matrix mode: source position in ep.transferFacets, -1: nothing to score
+	bool transferOriginal; //Counts as a launched molecule when its scores are flushed (false on split copies)
+	std::vector<std::pair<size_t, double>> transferScores; //Absorptions on transfer facets since desorption: column, weight
 };
 
-class Simulation {
+// Packet mode: a particle in flight with its own random stream, swapped into the thread's currentParticle and random to be recorded
+class ParticleLane {
 public:
+	CurrentParticleStatus particle;
+	ParticleRandomStream random;
+};
 
-	Simulation();
+// Rays of a thread's lanes in structure-of-arrays form, intersected together by PacketIntersect()
+class RayPacket {
+public:
+	size_t nbRays;
+	size_t lane[maxPacketSize]; //Lane of each ray
+	size_t structureId[maxPacketSize];
+	SubprocessFacet* lastHitFacet[maxPacketSize];
+	double posX[maxPacketSize], posY[maxPacketSize], posZ[maxPacketSize];
+	double oppX[maxPacketSize], oppY[maxPacketSize], oppZ[maxPacketSize]; //Opposite of the direction
+	double invX[maxPacketSize], invY[maxPacketSize], invZ[maxPacketSize]; //Inverse of the direction, 0 on null components
+	bool nullX[maxPacketSize], nullY[maxPacketSize], nullZ[maxPacketSize];
+	double minLength[maxPacketSize]; //Closest opaque hit
+	SubprocessFacet* collidedFacet[maxPacketSize];
+	double colU[maxPacketSize], colV[maxPacketSize];
+	std::vector<TransparentHit> candidates[maxPacketSize]; //Partially transparent facets crossed in traversal order, opacity drawn by ResolvePacketRay()
+
+	void Add(const size_t& laneIndex, const CurrentParticleStatus& particle);
+};
+
+// State of one Monte Carlo worker thread. Everything written during tracing lives here,
+// summed into the 'hits' dataport by UpdateMCHits()
+class SimulationThread {
+public:
+	size_t threadIndex;
+	CurrentParticleStatus currentParticle;
 	GlobalHitBuffer tmpGlobalResult; //Global results since last UpdateMCHits
 	std::vector<FacetHistogramBuffer> tmpGlobalHistograms; //Recorded histogram since last UpdateMCHits, 1+nbMoment copies
 	std::vector<ParticleLoggerItem> tmpParticleLog; //Recorded particle log since last UpdateMCHits
+	std::vector<FacetHitState> facetStates; //Indexed by globalId
+	std::vector<size_t> triggeredVolatiles; //globalId of volatile facets absorbed on during the current trajectory
+	llong totalDesorbed; //Desorptions of this thread (not reset on UpdateMCHits)
+	ParticleRandomStream random;
+	size_t workerIndex; //Index among all MC threads of all subprocesses
+	size_t nbWorkers;   //Number of MC threads of all subprocesses
+	llong quotaNext, quotaEnd; //Particle indices claimed from the shared quota and not desorbed yet
+	double activeMomentsTime; //Hit time for which activeMoments was resolved
+	std::vector<size_t> activeMoments; //Moment indices (0: constant flow) whose time window contains activeMomentsTime
+	std::vector<size_t> speciesMoments; //Same for the extra species currently recorded, not cached
+	std::vector<FacetHitBuffer> speciesCounters; //Extra species facet counters since last UpdateMCHits, [species][globalId][moment]
+	std::vector<TextureCell> speciesTextures; //Extra species textures since last UpdateMCHits, [species][textured facet][moment][cell]
+	std::vector<FacetHitBuffer> sweepCounters; //Sticking sweep facet counters since last UpdateMCHits, [scenario][globalId][moment]
+	std::vector<FacetHitBuffer> estimatorCounters; //Forced detection counters since last UpdateMCHits, [target][moment]
+	std::vector<size_t> estimatorMoments; //Active moments at the estimated arrival time, not cached
+	std::vector<AdjointResult> adjointCounters; //Adjoint mode results since last UpdateMCHits, indexed by globalId
+	std::vector<FacetConvergence> convergenceStats; //Batches of the watched facets closed since last UpdateMCHits
+	std::vector<double> batchValues; //Open batch of each watched facet: absorption, covering, pressure (not reset on UpdateMCHits)
+	size_t batchDesorbed; //Particles desorbed in the open batch
+	bool lanesWaiting; //Packet mode: lanes left idle until the last particle of the open batch ends
+	std::vector<double> transferLaunched; //Transfer matrix mode: flushed molecules of each source since last UpdateMCHits
+	std::vector<TransferEntry> transferCounters; //Same for the absorptions, [source][target]
+	std::vector<double> stepAbsorbed; //Covering evolution: absorbed weight on each evolving facet during the current step
+	std::vector<CurrentParticleStatus> splitParticles; //Copies left by splitting, traced before the next desorption
+	std::vector<ParticleLane> lanes; //Packet mode (ep.packetSize > 1), empty: currentParticle is traced alone
+	size_t activeLane; //Lane swapped into currentParticle, only lane 0 feeds the hit cache so that trajectories stay continuous
+	RayPacket packet;
+	llong nbRouletteKilled; //Particles lost at Russian roulette (not reset on UpdateMCHits)
+	llong nbSplit; //Copies created by splitting (not reset on UpdateMCHits)
+
+	bool Initialize(size_t index, uint64_t seed);
+	const std::vector<size_t>& GetActiveMoments(const double& time);
+	void FindActiveMoments(const double& time, std::vector<size_t>& moments) const;
+	bool ClaimParticle(llong& particleIndex);
+	void SwapLane(const size_t& lane); //Called in pairs: swaps the lane's particle and random stream in, then back out
+	bool IsRunning() const; //A particle is in flight (in any lane)
+	bool OtherLanesInFlight() const; //A particle is in flight in a lane other than the one swapped in
+	bool StartParticles(); //Desorbs wherever no particle is in flight, false if none could start
+	void ResetTmpCounters();
+	double rnd() { return random.Next(); } //[0,1) with 53 random bits, Random.h's generator isn't thread-safe
+};
+
+extern thread_local SimulationThread* tHandle; //Thread running the current particle, declared in SimulationMC.cpp
+
+class Simulation {
+public:
+
+	Simulation();
 
 	llong totalDesorbed;           // Total number of desorptions (for this process, not reset on UpdateMCHits)
+	llong nbRouletteKilled;        // Same for Russian roulette kills
+	llong nbSplit;                 // Same for split copies
+	size_t prIdx;                  // Index of this subprocess
 
 	std::vector<std::vector<std::pair<double, double>>> CDFs; //cumulative distribution function for each temperature
+	std::vector<MaxwellInverseCDF> inverseCDFs; //speed sampler for each temperature, built on load
 	std::vector<std::vector<std::pair<double, double>>> IDs; //integrated distribution function for each time-dependent desorption type
 	std::vector<double> temperatures; //keeping track of all temperatures that have a CDF already generated
 	std::vector<double> moments;      //time values (seconds) when a simulation state is measured
+	std::vector<double> sortedMoments; //moments in increasing order, for the active window search
+	std::vector<size_t> sortedMomentIndices; //hit buffer index (1-based, 0 is constant flow) of each sorted moment
 	std::vector<size_t> desorptionParameterIDs; //time-dependent parameters which are used as desorptions, therefore need to be integrated
 	std::vector<Parameter> parameters; //Time-dependent parameters 
+	std::vector<FastLookupTable> parameterTables; //Resampled parameters for GetStickingAt/GetOpacityAt, built on load
+	std::vector<FastLookupTable> desorptionTimeTables; //Inverse of each IDs entry (cumulated desorption -> time), built on load
 
 	// Geometry
 	GeomProperties sh;
 	WorkerParams wp;
 	OntheflySimulationParams ontheflyParams;
+	EngineParams ep;
 
 	std::vector<Vector3d>   vertices3;        // Vertices
-	std::vector<SuperStructure> structures; //They contain the facets  
+	std::vector<SuperStructure> structures; //They contain the facets. With several structures, one more at the end holds the facets in all structures (superIdx -1), stored and traced once  
+	std::vector<SubprocessFacet*> facetsByGlobalId; //Facet of each global index
+
+	// Multi-species mode: extra gases follow the traced trajectories with scaled speeds
+	std::vector<double> speciesSpeedFactors; //sqrt(wp.gasMass/mass) of each extra species
+	size_t speciesOffset; //Extra species counters in the hits dataport, after the regular hits
+	std::vector<size_t> speciesTextureStart; //Indexed by globalId: first cell of the facet's textures in a species' texture block (textured facets only)
+	size_t speciesTextureCells; //Texture cells of one species, all textured facets and moments
+	size_t speciesTextureOffset; //Extra species textures in the hits dataport, after their counters
+
+	// Sticking sweep: every scenario follows the traced trajectories with its own weight
+	size_t nbScenarios;
+	std::vector<std::vector<double>> sweepStickings; //Indexed by globalId, sticking of each scenario (empty: facet not swept)
+	size_t sweepOffset; //Sticking sweep counters in the hits dataport, after the extra species textures
+
+	// Variance reduction for weighted particles
+	std::vector<char> isSplitFacet; //Indexed by globalId, empty if splitting is off
+
+	// Forced detection (next-event) estimator
+	std::vector<SubprocessFacet*> estimatorFacets; //Target facets
+	std::vector<int> estimatorIndex; //Indexed by globalId: position in estimatorFacets, -1 if not a target (empty if no targets)
+	size_t estimatorOffset; //Estimator counters in the hits dataport, after the sticking sweep
+
+	// Adjoint mode: particles launched from one target, arrivals scored by reciprocity
+	SubprocessFacet* adjointTarget; //NULL in a regular forward run
+	std::vector<double> adjointScale; //Indexed by globalId: target area / facet area with the 2-sided factors, 0: not scored
+	std::vector<double> adjointSourceRate; //Indexed by globalId: constant flow outgassing (molecules/s)
+	size_t adjointOffset; //Adjoint results in the hits dataport, after the estimator
+
+	// Convergence: batch means of the watched facets
+	std::vector<int> watchIndex; //Indexed by globalId: position in ep.watchFacets, -1 if not watched (empty if none)
+	size_t watchOffset; //Convergence statistics in the hits dataport, after the adjoint results
+	double maxRelativeError; //Largest error of the watched facets at the last UpdateMCHits, -1 if not known
+	bool converged; //All watched facets below ep.targetRelativeError
+
+	// Desorption quota: next particle index of all subprocesses, claimed in chunks up to the desorption limit
+	size_t quotaOffset; //Quota counter in the hits dataport, after the convergence statistics (cleared with the hits)
+	std::atomic<llong>* desorptionQuota; //Points into the hits dataport, NULL until it is connected
+
+	// Transfer matrix mode: the transfer facets desorb in turn, absorptions on them are scored per source
+	std::vector<int> transferIndex; //Indexed by globalId: position in ep.transferFacets, -1 if not a transfer facet (empty if none)
+	size_t transferOffset; //Launched molecules and transfer tallies in the hits dataport, after the quota counter
+
+	// Covering evolution: time steps run in this subprocess, each desorbing the coverings and the constant outgassing
+	std::vector<int> coveringIndex; //Indexed by globalId: position in ep.coveringFacets, -1 if not evolving (empty if off)
+	std::vector<double> initialCovering; //Covering (molecules) of each evolving facet in the hits dataport at load
+	std::vector<double> covering; //Current covering of each evolving facet
+	std::vector<double> stepLoss; //Molecules desorbed from each covering during the current step
+	std::vector<double> coveringTimeline; //Time (s) and coverings after each finished step
+	size_t coveringStep; //Finished steps
+	llong stepEnd; //Quota index ending the current step
+	double particleWeight; //Molecules per test particle in the current step
+	size_t coveringOffset; //Finished steps and the timeline in the hits dataport, after the transfer tallies
+
+	// Desorption sources (built on load)
+	std::vector<SubprocessFacet*> sourceFacets; // Outgassing facets
+	AliasTable sourceTable;                     // Picks a source facet, weighted by its desorbed molecules
 
 	double stepPerSec;  // Avg number of step per sec
 	//Facet size counters
@@ -178,8 +491,8 @@ public:
 	bool hasVolatile;   // Contains volatile facet
 	double calcACTime;  // AC matrix calculation time
 
-	// Particle coordinates (MC)
-	CurrentParticleStatus currentParticle;
+	// MC worker threads (particle coordinates and hit buffers)
+	std::vector<SimulationThread> threads;
 
 
 	// Angular coefficient (opaque facets)
@@ -217,18 +530,29 @@ void ClearSimulation();
 void SetState(size_t state, const char *status, bool changeState = true, bool changeStatus = true);
 void SetErrorSub(const char *msg);
 void ClearACMatrix();
-bool LoadSimulation(Dataport *loader);
+bool LoadSimulation(Dataport *loader, int prIdx);
 bool UpdateOntheflySimuParams(Dataport *loader);
+void UpdateInstrumentedFacets();
 bool StartSimulation(size_t sMode);
 void ResetSimulation();
 bool SimulationRun();
 bool SimulationMCStep(size_t nbStep);
+bool SimulationMCPacketStep(size_t nbStep);
+bool ProcessIntersection(const bool& found, SubprocessFacet* collidedFacet, const double& d);
+void BuildBVH(SuperStructure& s, const size_t& width, const size_t& nbThreads);
+const char* WideBVHInstructions();
+std::tuple<bool, SubprocessFacet*, double> ThreadIntersect(const Vector3d& rayPos, const Vector3d& rayDir);
+void PacketIntersect(RayPacket& packet);
+std::tuple<bool, SubprocessFacet*, double> ResolvePacketRay(RayPacket& packet, const size_t& ray);
+double ThreadTransmission(const Vector3d& rayPos, const Vector3d& rayDir, double maxLength, SubprocessFacet* const source, SubprocessFacet* const target);
+void RecordTransparentPass(SubprocessFacet *f, double colDist);
 void IncreaseDistanceCounters(double d);
 bool SimulationACStep(int nbStep);
 void RecordHit(const int& type);
 void RecordLeakPos();
 bool StartFromSource();
 void PerformBounce(SubprocessFacet *iFacet);
+void PerformReflection(SubprocessFacet *iFacet);
 void RecordAbsorb(SubprocessFacet *iFacet);
 void RecordHistograms(SubprocessFacet * iFacet);
 void PerformTeleport(SubprocessFacet *iFacet);
@@ -248,7 +572,23 @@ int GetIDId(int paramId);
 void   UpdateVelocity(SubprocessFacet *collidedFacet);
 double GenerateRandomVelocity(int CDFId);
 double GenerateDesorptionTime(SubprocessFacet* src);
+bool BuildParameterTables();
 double GetStickingAt(SubprocessFacet *src, double time);
 double GetOpacityAt(SubprocessFacet *src, double time);
+void   RecordNextEvent(SubprocessFacet *src);
+void   RecordAdjointHit(SubprocessFacet *f);
+void   CloseBatch();
+void   FlushTransferScores();
+void   InitCoveringEvolution(BYTE *buffer);
+void   ResetCoveringEvolution();
+void   SetCoveringSources();
+bool   NextCoveringStep();
+double CoveringSticking(const SubprocessFacet& f, const double& covering);
+void   RecordEstimator(size_t targetIndex, double time, double weight, double ortVelocity);
+bool   PlayRoulette(double weight);
+void   SplitParticle(SubprocessFacet *reflectionFacet = NULL);
+void   IncreaseSweepCounters(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort);
+bool   GetSpeciesTime(const size_t& species, const double& time, double& speciesTime);
+void   IncreaseSpeciesCounters(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort);
 void   IncreaseFacetCounter(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort);
 void   TreatMovingFacet();
\ No newline at end of file
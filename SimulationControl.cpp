@@ -32,8 +32,12 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Simulation.h"
 #include "IntersectAABB_shared.h"
 #include "Random.h"
+#include "GLApp/MathTools.h" //PI
 #include <sstream>
 #include <fstream>
+#include <thread>
+#include <algorithm>
+#include <limits>
 
 #include <cereal/types/utility.hpp>
 #include <cereal/archives/binary.hpp>
@@ -42,6 +46,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 
 // Global handles
 extern Simulation* sHandle; //Declared at molflowSub.cpp
+extern size_t GetLocalState();
 
 // Timing stuff
 
@@ -124,7 +129,7 @@ DWORD GetSeed() {
 }*/
 
 
-bool LoadSimulation(Dataport *loader) {
+bool LoadSimulation(Dataport *loader, int prIdx) {
 	double t1, t0;
 	DWORD seed;
 	//char err[128];
@@ -135,6 +140,7 @@ bool LoadSimulation(Dataport *loader) {
 
 	SetState(PROCESS_STARTING, "Clearing previous simulation");
 	ClearSimulation();
+	sHandle->prIdx = (size_t)prIdx;
 
 	/* //Mutex not necessary: by the time the COMMAND_LOAD is issued the interface releases the handle, concurrent reading is safe and it's only destroyed by the interface when all processes are ready loading
 	   //Result: faster, parallel loading
@@ -166,6 +172,7 @@ bool LoadSimulation(Dataport *loader) {
 		//Worker params
 		inputarchive(sHandle->wp);
 		inputarchive(sHandle->ontheflyParams);
+		inputarchive(sHandle->ep);
 		inputarchive(sHandle->CDFs);
 		inputarchive(sHandle->IDs);
 		inputarchive(sHandle->parameters);
@@ -173,11 +180,29 @@ bool LoadSimulation(Dataport *loader) {
 		inputarchive(sHandle->moments);
 		inputarchive(sHandle->desorptionParameterIDs);
 
+		//Sorted copy of the moments, the hit buffer layout keeps the user's order
+		std::vector<size_t> order(sHandle->moments.size());
+		for (size_t m = 0; m < order.size(); m++) order[m] = m;
+		std::stable_sort(order.begin(), order.end(), [](const size_t& a, const size_t& b) {return sHandle->moments[a] < sHandle->moments[b]; });
+		sHandle->sortedMoments.clear(); sHandle->sortedMomentIndices.clear();
+		for (const size_t& m : order) {
+			sHandle->sortedMoments.push_back(sHandle->moments[m]);
+			sHandle->sortedMomentIndices.push_back(m + 1);
+		}
+
+		//Speed samplers, one per temperature (same order as CDFs)
+		sHandle->inverseCDFs.resize(sHandle->temperatures.size());
+		for (size_t i = 0; i < sHandle->temperatures.size(); i++)
+			sHandle->inverseCDFs[i].Build(sHandle->temperatures[i], sHandle->wp.gasMass, inverseCDFSize);
+
+		//Lookup tables for time-dependent sticking, opacity and desorption
+		if (!BuildParameterTables()) return false;
+
 		//Geometry
 		inputarchive(sHandle->sh);
 		inputarchive(sHandle->vertices3);
 
-		sHandle->structures.resize(sHandle->sh.nbSuper); //Create structures
+		sHandle->structures.resize(sHandle->sh.nbSuper > 1 ? sHandle->sh.nbSuper + 1 : sHandle->sh.nbSuper); //Create structures, and the one of the facets in all structures
 
 		//Facets
 		for (size_t i = 0; i < sHandle->sh.nbFacet; i++) { //Necessary because facets is not (yet) a vector in the interface
@@ -193,9 +218,7 @@ bool LoadSimulation(Dataport *loader) {
 			//Some initialization
 			if (!f.InitializeOnLoad(i)) return false;
 			if (f.sh.superIdx == -1) { //Facet in all structures
-				for (auto& s : sHandle->structures) {
-					s.facets.push_back(f);
-				}
+				sHandle->structures.back().facets.push_back(f);
 			}
 			else {
 				sHandle->structures[f.sh.superIdx].facets.push_back(f); //Assign to structure
@@ -203,17 +226,6 @@ bool LoadSimulation(Dataport *loader) {
 		}
 	}//inputarchive goes out of scope, file released
 
-	//Initialize global histogram
-	FacetHistogramBuffer hist;
-	hist.nbHitsHistogram.resize(sHandle->wp.globalHistogramParams.recordBounce ? sHandle->wp.globalHistogramParams.GetBounceHistogramSize() : 0); hist.nbHitsHistogram.shrink_to_fit();
-	hist.distanceHistogram.resize(sHandle->wp.globalHistogramParams.recordDistance ? sHandle->wp.globalHistogramParams.GetDistanceHistogramSize() : 0); hist.distanceHistogram.shrink_to_fit();
-	hist.timeHistogram.resize(sHandle->wp.globalHistogramParams.recordTime ? sHandle->wp.globalHistogramParams.GetTimeHistogramSize() : 0); hist.timeHistogram.shrink_to_fit();
-	
-	sHandle->tmpGlobalHistograms = std::vector<FacetHistogramBuffer>(1 + sHandle->moments.size(), hist);
-
-	//Reserve particle log
-	if (sHandle->ontheflyParams.enableLogging) sHandle->tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess);
-
 
 
 	/* //Old dataport-based loading, replaced by above serialization
@@ -466,20 +478,355 @@ bool LoadSimulation(Dataport *loader) {
 	//ReleaseDataport(loader); //Commented out as AccessDataport removed
 	*/
 
-	// Build all AABBTrees
-	size_t maxDepth=0;
+	// Build the structure BVHs, several structures at once (large ones also split their own build)
+	size_t nbBuilders = Min((size_t)std::thread::hardware_concurrency(), sHandle->structures.size());
+	size_t buildThreads = Max((size_t)1, (size_t)std::thread::hardware_concurrency() / Max(nbBuilders, (size_t)1)); //Shared out between the builders
+	std::atomic<size_t> nextStructure(0);
+	std::atomic<bool> bvhFailed(false);
+	auto bvhBuilder = [&nextStructure, &bvhFailed, buildThreads]() {
+		for (size_t i = nextStructure++; i < sHandle->structures.size(); i = nextStructure++) {
+			try {
+				BuildBVH(sHandle->structures[i], sHandle->ep.bvhWidth, buildThreads);
+			}
+			catch (...) {
+				bvhFailed = true;
+			}
+		}
+	};
+	std::vector<std::thread> bvhWorkers;
+	try {
+		for (size_t i = 1; i < nbBuilders; i++)
+			bvhWorkers.emplace_back(bvhBuilder);
+	}
+	catch (...) {} //Fewer builders
+	bvhBuilder();
+	for (auto& w : bvhWorkers) w.join();
+	if (bvhFailed) {
+		SetErrorSub("Not enough memory to build the ray tracing trees");
+		return false;
+	}
+
+	// Global index table, resolves teleport destinations
+	sHandle->facetsByGlobalId.assign(sHandle->sh.nbFacet, NULL);
 	for (auto& s : sHandle->structures) {
-		std::vector<SubprocessFacet*> facetPointers; facetPointers.reserve(s.facets.size());
 		for (auto& f : s.facets) {
-			facetPointers.push_back(&f);
+			if (!sHandle->facetsByGlobalId[f.globalId]) sHandle->facetsByGlobalId[f.globalId] = &f;
+		}
+	}
+	for (SubprocessFacet* f : sHandle->facetsByGlobalId) {
+		if (f->sh.teleportDest < -1 || f->sh.teleportDest > (int)sHandle->sh.nbFacet) {
+			std::ostringstream err;
+			err << "Teleport destination of facet " << f->globalId + 1 << " not found (facet " << f->sh.teleportDest << " does not exist)";
+			SetErrorSub(err.str().c_str());
+			return false;
+		}
+	}
+
+	// Desorption source table
+	std::vector<double> sourceWeights;
+	for (size_t s = 0; s < sHandle->structures.size(); s++) {
+		for (auto& f : sHandle->structures[s].facets) {
+			if (f.sh.desorbType == DES_NONE) continue;
+			double facetOutgassing;
+			if (f.sh.useOutgassingFile) //Using SynRad-generated outgassing map
+				facetOutgassing = sHandle->wp.latestMoment * f.sh.totalOutgassing / (1.38E-23*f.sh.temperature);
+			else //constant or time-dependent outgassing
+				facetOutgassing = (f.sh.outgassing_paramId >= 0)
+					? sHandle->IDs[f.sh.IDid].back().second / (1.38E-23*f.sh.temperature)
+					: sHandle->wp.latestMoment*f.sh.outgassing / (1.38E-23*f.sh.temperature);
+			if (facetOutgassing > 0.0) {
+				sHandle->sourceFacets.push_back(&f);
+				sourceWeights.push_back(facetOutgassing);
+			}
+		}
+	}
+	if (!sHandle->sourceTable.Build(sourceWeights)) sHandle->sourceFacets.clear();
+	UpdateInstrumentedFacets();
+
+	// Multi-species mode: only speeds depend on the mass, so paths can be shared as long as nothing depends on time
+	sHandle->speciesSpeedFactors.clear();
+	for (const double& mass : sHandle->ep.speciesMasses) {
+		if (!(mass >= sHandle->wp.gasMass)) {
+			SetErrorSub("Extra species can't be lighter than the simulated gas");
+			return false;
+		}
+		sHandle->speciesSpeedFactors.push_back(sqrt(sHandle->wp.gasMass / mass));
+	}
+	if (!sHandle->speciesSpeedFactors.empty()) {
+		for (const auto& s : sHandle->structures) {
+			for (const auto& f : s.facets) {
+				if (f.sh.isMoving || f.sh.sticking_paramId != -1 || f.sh.opacity_paramId != -1) {
+					std::stringstream tmp;
+					tmp << "Facet " << f.globalId + 1 << ": moving facets and time-dependent sticking or opacity can't be used with extra species";
+					SetErrorSub(tmp.str().c_str());
+					return false;
+				}
+			}
+		}
+	}
+	sHandle->speciesOffset = sizeof(GlobalHitBuffer) + sHandle->wp.globalHistogramParams.GetDataSize() +
+		sHandle->textTotalSize + sHandle->profTotalSize + sHandle->dirTotalSize + sHandle->angleMapTotalSize + sHandle->histogramTotalSize
+		+ sHandle->sh.nbFacet * sizeof(FacetHitBuffer) * (1 + sHandle->moments.size());
+	sHandle->speciesTextureStart.assign(sHandle->sh.nbFacet, 0);
+	sHandle->speciesTextureCells = 0;
+	if (!sHandle->speciesSpeedFactors.empty()) {
+		for (SubprocessFacet* f : sHandle->facetsByGlobalId) {
+			if (!f->sh.isTextured) continue;
+			sHandle->speciesTextureStart[f->globalId] = sHandle->speciesTextureCells;
+			sHandle->speciesTextureCells += (1 + sHandle->moments.size()) * f->sh.texWidth * f->sh.texHeight;
+		}
+	}
+	sHandle->speciesTextureOffset = sHandle->speciesOffset
+		+ sHandle->speciesSpeedFactors.size() * sHandle->sh.nbFacet * sizeof(FacetHitBuffer) * (1 + sHandle->moments.size());
+
+	// Sticking sweep: same number of scenarios on every swept facet
+	sHandle->nbScenarios = sHandle->ep.sweepStickings.empty() ? 0 : sHandle->ep.sweepStickings[0].size();
+	sHandle->sweepStickings.clear();
+	if (sHandle->ep.sweepFacets.size() != sHandle->ep.sweepStickings.size()) {
+		SetErrorSub("Sticking sweep: facet list and sticking list don't match");
+		return false;
+	}
+	if (!sHandle->ep.sweepFacets.empty()) sHandle->sweepStickings.resize(sHandle->sh.nbFacet);
+	for (size_t i = 0; i < sHandle->ep.sweepFacets.size(); i++) {
+		size_t facetId = sHandle->ep.sweepFacets[i];
+		const std::vector<double>& stickings = sHandle->ep.sweepStickings[i];
+		if (facetId >= sHandle->sh.nbFacet || stickings.size() != sHandle->nbScenarios || sHandle->nbScenarios == 0) {
+			SetErrorSub("Sticking sweep: invalid facet or scenario count");
+			return false;
+		}
+		for (const double& s : stickings) {
+			if (!(s >= 0.0 && s <= 1.0)) {
+				std::stringstream tmp;
+				tmp << "Facet " << facetId + 1 << ": sweep sticking must be between 0 and 1";
+				SetErrorSub(tmp.str().c_str());
+				return false;
+			}
+		}
+		sHandle->sweepStickings[facetId] = stickings;
+	}
+	// Russian roulette and splitting
+	if (!(sHandle->ep.rouletteThreshold >= 0.0 && sHandle->ep.rouletteThreshold < 1.0) || sHandle->ep.splitFactor < 1) {
+		SetErrorSub("Invalid roulette threshold or split factor");
+		return false;
+	}
+	if (sHandle->ep.packetSize < 1 || sHandle->ep.packetSize > maxPacketSize) {
+		SetErrorSub("Invalid packet size");
+		return false;
+	}
+	if (sHandle->ep.bvhWidth != 2 && sHandle->ep.bvhWidth != 4 && sHandle->ep.bvhWidth != 8) {
+		SetErrorSub("Invalid BVH width (2, 4 or 8)");
+		return false;
+	}
+	sHandle->isSplitFacet.clear();
+	if (sHandle->ep.splitFactor > 1 && !sHandle->ep.splitFacets.empty()) {
+		sHandle->isSplitFacet.resize(sHandle->sh.nbFacet, false);
+		for (const size_t& id : sHandle->ep.splitFacets) {
+			if (id >= sHandle->sh.nbFacet) {
+				SetErrorSub("Splitting facet index out of range");
+				return false;
+			}
+			sHandle->isSplitFacet[id] = true;
+		}
+	}
+
+	sHandle->sweepOffset = sHandle->speciesTextureOffset
+		+ sHandle->speciesSpeedFactors.size() * sHandle->speciesTextureCells * sizeof(TextureCell);
+
+	// Forced detection targets. Moving facets would change the speed after the estimated emission
+	sHandle->estimatorFacets.clear();
+	sHandle->estimatorIndex.clear();
+	if (!sHandle->ep.estimatorFacets.empty()) {
+		sHandle->estimatorIndex.resize(sHandle->sh.nbFacet, -1);
+		for (const size_t& id : sHandle->ep.estimatorFacets) {
+			if (id >= sHandle->sh.nbFacet) {
+				SetErrorSub("Forced detection target index out of range");
+				return false;
+			}
+			SubprocessFacet* target = sHandle->facetsByGlobalId[id];
+			if (target->sh.superDest || target->sh.teleportDest) {
+				std::stringstream tmp;
+				tmp << "Facet " << id + 1 << ": link and teleport facets can't be forced detection targets";
+				SetErrorSub(tmp.str().c_str());
+				return false;
+			}
+			if (sHandle->estimatorIndex[id] != -1) continue;
+			sHandle->estimatorIndex[id] = (int)sHandle->estimatorFacets.size();
+			sHandle->estimatorFacets.push_back(target);
+		}
+		for (const auto& s : sHandle->structures) {
+			for (const auto& f : s.facets) {
+				if (f.sh.isMoving) {
+					SetErrorSub("Forced detection can't be used with moving facets");
+					return false;
+				}
+			}
+		}
+	}
+	sHandle->estimatorOffset = sHandle->sweepOffset
+		+ sHandle->nbScenarios * sHandle->sh.nbFacet * sizeof(FacetHitBuffer) * (1 + sHandle->moments.size());
+
+	// Adjoint mode. Reciprocity needs steady state, cosine sources and reciprocal (diffuse or specular) reflection
+	sHandle->adjointTarget = NULL;
+	sHandle->adjointScale.clear();
+	sHandle->adjointSourceRate.clear();
+	if (sHandle->ep.adjointTarget >= 0) {
+		if ((size_t)sHandle->ep.adjointTarget >= sHandle->sh.nbFacet) {
+			SetErrorSub("Adjoint target index out of range");
+			return false;
+		}
+		SubprocessFacet* target = sHandle->facetsByGlobalId[sHandle->ep.adjointTarget];
+		if (target->sh.superIdx == -1 || target->sh.superDest || target->sh.teleportDest || !(target->sh.area > 0.0)) {
+			SetErrorSub("Adjoint target must be a regular facet of one structure");
+			return false;
+		}
+		if (!sHandle->wp.calcConstantFlow || sHandle->wp.enableDecay) {
+			SetErrorSub("Adjoint mode needs constant flow and no gas decay");
+			return false;
+		}
+		sHandle->adjointScale.resize(sHandle->sh.nbFacet, 0.0);
+		sHandle->adjointSourceRate.resize(sHandle->sh.nbFacet, 0.0);
+		for (const auto& s : sHandle->structures) {
+			for (const auto& f : s.facets) {
+				std::stringstream tmp;
+				tmp << "Facet " << f.globalId + 1 << ": ";
+				if (f.sh.isMoving || f.sh.isVolatile) tmp << "moving and volatile facets can't be used in adjoint mode";
+				else if (f.sh.teleportDest) tmp << "teleports break reciprocity, can't be used in adjoint mode";
+				else if (f.sh.reflection.diffusePart + f.sh.reflection.specularPart < 0.999999) tmp << "cos^N reflection isn't reciprocal, can't be used in adjoint mode";
+				else if (f.sh.desorbType != DES_NONE && f.sh.desorbType != DES_COSINE) tmp << "only cosine desorption can be used in adjoint mode";
+				else {
+					if (f.sh.superDest || !(f.sh.area > 0.0)) continue; //Not scored
+					sHandle->adjointScale[f.globalId] = target->sh.area / f.sh.area
+						* (target->sh.is2sided ? 2.0 : 1.0) * (f.sh.is2sided ? 0.5 : 1.0); //A 2-sided facet emits half of its molecules on each side
+					if (f.sh.desorbType != DES_NONE) {
+						sHandle->adjointSourceRate[f.globalId] = (f.sh.outgassing_paramId >= 0)
+							? sHandle->IDs[f.sh.IDid].back().second / sHandle->wp.latestMoment / (1.38E-23*f.sh.temperature) //Mean over the desorption window
+							: f.sh.outgassing / (1.38E-23*f.sh.temperature);
+					}
+					else if (f.sh.useOutgassingFile) {
+						sHandle->adjointSourceRate[f.globalId] = f.sh.totalOutgassing / (1.38E-23*f.sh.temperature);
+					}
+					continue;
+				}
+				SetErrorSub(tmp.str().c_str());
+				return false;
+			}
+		}
+		sHandle->adjointTarget = target;
+	}
+	sHandle->adjointOffset = sHandle->estimatorOffset
+		+ sHandle->estimatorFacets.size() * sizeof(FacetHitBuffer) * (1 + sHandle->moments.size());
+
+	// Convergence watch
+	sHandle->watchIndex.clear();
+	if (!sHandle->ep.watchFacets.empty()) {
+		if (sHandle->ep.batchSize == 0 || !(sHandle->ep.targetRelativeError >= 0.0)) {
+			SetErrorSub("Invalid batch size or target relative error");
+			return false;
+		}
+		sHandle->watchIndex.resize(sHandle->sh.nbFacet, -1);
+		for (size_t i = 0; i < sHandle->ep.watchFacets.size(); i++) {
+			if (sHandle->ep.watchFacets[i] >= sHandle->sh.nbFacet) {
+				SetErrorSub("Watched facet index out of range");
+				return false;
+			}
+			sHandle->watchIndex[sHandle->ep.watchFacets[i]] = (int)i;
+		}
+	}
+	sHandle->watchOffset = sHandle->adjointOffset
+		+ (sHandle->adjointTarget ? sHandle->sh.nbFacet * sizeof(AdjointResult) : 0);
+	sHandle->maxRelativeError = -1.0;
+	sHandle->converged = false;
+	sHandle->quotaOffset = sHandle->watchOffset + sHandle->ep.watchFacets.size() * sizeof(FacetConvergence);
+
+	// Transfer matrix mode
+	sHandle->transferIndex.clear();
+	if (!sHandle->ep.transferFacets.empty()) {
+		if (sHandle->adjointTarget) {
+			SetErrorSub("Transfer matrix and adjoint mode can't be combined");
+			return false;
+		}
+		sHandle->transferIndex.resize(sHandle->sh.nbFacet, -1);
+		for (size_t i = 0; i < sHandle->ep.transferFacets.size(); i++) {
+			size_t id = sHandle->ep.transferFacets[i];
+			if (id >= sHandle->sh.nbFacet) {
+				SetErrorSub("Transfer facet index out of range");
+				return false;
+			}
+			SubprocessFacet* f = sHandle->facetsByGlobalId[id];
+			if (f->sh.superIdx == -1 || f->sh.superDest || f->sh.teleportDest || !(f->sh.area > 0.0) || sHandle->transferIndex[id] != -1) {
+				std::stringstream tmp;
+				tmp << "Facet " << id + 1 << ": transfer facets must be distinct regular facets of one structure";
+				SetErrorSub(tmp.str().c_str());
+				return false;
+			}
+			sHandle->transferIndex[id] = (int)i;
+		}
+	}
+	sHandle->transferOffset = sHandle->quotaOffset + sizeof(llong);
+
+	// Covering evolution. Steps end when all particles are traced, which one subprocess can tell on its own
+	sHandle->coveringIndex.clear();
+	sHandle->initialCovering.clear();
+	if (!sHandle->ep.coveringFacets.empty()) {
+		if (sHandle->ontheflyParams.nbProcess != 1) {
+			SetErrorSub("Covering evolution runs in one subprocess (use more threads instead)");
+			return false;
+		}
+		if (sHandle->adjointTarget || !sHandle->transferIndex.empty()) {
+			SetErrorSub("Covering evolution can't be combined with adjoint or transfer matrix mode");
+			return false;
+		}
+		if (sHandle->ep.coveringSteps == 0 || sHandle->ep.stepDesorptions == 0 || !(sHandle->ep.coveringTimeStep > 0.0)) {
+			SetErrorSub("Invalid covering evolution steps");
+			return false;
+		}
+		sHandle->coveringIndex.resize(sHandle->sh.nbFacet, -1);
+		for (size_t i = 0; i < sHandle->ep.coveringFacets.size(); i++) {
+			size_t id = sHandle->ep.coveringFacets[i];
+			if (id >= sHandle->sh.nbFacet) {
+				SetErrorSub("Covering facet index out of range");
+				return false;
+			}
+			SubprocessFacet* f = sHandle->facetsByGlobalId[id];
+			if (f->sh.superIdx == -1 || f->sh.superDest || f->sh.teleportDest || !(f->sh.area > 0.0) || f->sh.sticking_paramId != -1 || sHandle->coveringIndex[id] != -1) {
+				std::stringstream tmp;
+				tmp << "Facet " << id + 1 << ": covering facets must be distinct regular facets of one structure, with constant sticking";
+				SetErrorSub(tmp.str().c_str());
+				return false;
+			}
+			sHandle->coveringIndex[id] = (int)i;
+		}
+		for (SubprocessFacet* f : sHandle->facetsByGlobalId) {
+			if (f->sh.desorbType != DES_NONE && (f->sh.outgassing_paramId >= 0 || f->sh.useOutgassingFile)) {
+				std::stringstream tmp;
+				tmp << "Facet " << f->globalId + 1 << ": covering evolution needs constant outgassing";
+				SetErrorSub(tmp.str().c_str());
+				return false;
+			}
 		}
-		s.aabbTree = BuildAABBTree(facetPointers, 0, maxDepth);
 	}
+	sHandle->coveringOffset = sHandle->transferOffset
+		+ sHandle->ep.transferFacets.size() * sizeof(double) + sHandle->ep.transferFacets.size() * sHandle->ep.transferFacets.size() * sizeof(TransferEntry);
 
 	// Initialise simulation
 
 	seed = GetSeed();
 	rseed(seed);
+	uint64_t runSeed = (sHandle->ep.randomSeed != 0) ? sHandle->ep.randomSeed : (uint64_t)seed; //Same seed in all subprocesses makes the run reproducible
+
+	// MC threads: own particle, hit buffers and random generator, shared geometry
+	if (sHandle->ep.nbThreads < 1) sHandle->ep.nbThreads = 1;
+	try {
+		sHandle->threads.resize(sHandle->ep.nbThreads);
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to create simulation threads");
+		return false;
+	}
+	for (size_t i = 0; i < sHandle->threads.size(); i++) {
+		if (!sHandle->threads[i].Initialize(i, runSeed)) return false;
+	}
+
 	sHandle->loadOK = true;
 	t1 = GetTick();
 	printf("  Load %s successful\n", sHandle->sh.name.c_str());
@@ -487,6 +834,8 @@ bool LoadSimulation(Dataport *loader) {
 
 	printf("  Geom size: %d bytes\n", /*(size_t)(buffer - bufferStart)*/0);
 	printf("  Number of stucture: %zd\n", sHandle->sh.nbSuper);
+	printf("  MC threads: %zd\n", sHandle->threads.size());
+	printf("  Desorbing facets: %zd\n", sHandle->sourceFacets.size());
 	printf("  Global Hit: %zd bytes\n", sizeof(GlobalHitBuffer));
 	printf("  Facet Hit : %zd bytes\n", sHandle->sh.nbFacet * sizeof(FacetHitBuffer));
 	printf("  Texture   : %zd bytes\n", sHandle->textTotalSize);
@@ -494,6 +843,18 @@ bool LoadSimulation(Dataport *loader) {
 	printf("  Direction : %zd bytes\n", sHandle->dirTotalSize);
 
 	printf("  Total     : %zd bytes\n", GetHitsSize());
+	for (size_t i = 0; i < sHandle->structures.size(); i++) {
+		const BVHStatistics& bvh = sHandle->structures[i].bvhStats;
+		std::string name = (i < sHandle->sh.nbSuper) ? std::to_string(i + 1) : "all"; //Facets in all structures
+		printf("  BVH %-6s: %zd nodes (%zd bytes), depth %zd, leaf size avg %.2f max %zd, SAH cost %.2f\n", name.c_str(),
+			bvh.nbNodes, bvh.nbNodes * sizeof(BVHNode), bvh.maxDepth,
+			bvh.nbLeaves ? (double)sHandle->structures[i].facets.size() / (double)bvh.nbLeaves : 0.0, bvh.maxLeafSize, bvh.sahCost);
+		if (!sHandle->structures[i].bvh4Nodes.empty())
+			printf("              4-wide: %zd nodes (%zd bytes)\n", sHandle->structures[i].bvh4Nodes.size(), sHandle->structures[i].bvh4Nodes.size() * sizeof(WideBVHNode<4>));
+		if (!sHandle->structures[i].bvh8Nodes.empty())
+			printf("              8-wide: %zd nodes (%zd bytes)\n", sHandle->structures[i].bvh8Nodes.size(), sHandle->structures[i].bvh8Nodes.size() * sizeof(WideBVHNode<8>));
+	}
+	printf("  Intersect : %s\n", WideBVHInstructions());
 	printf("  Seed: %lu\n", seed);
 	printf("  Loading time: %.3f ms\n", (t1 - t0)*1000.0);
 	return true;
@@ -512,6 +873,7 @@ bool UpdateOntheflySimuParams(Dataport *loader) {
 
 	sHandle->ontheflyParams = READBUFFER(OntheflySimulationParams);
 	ReleaseDataport(loader);
+	UpdateInstrumentedFacets(); //Logged facet may have changed
 
 	return true;
 }
@@ -533,75 +895,195 @@ void UpdateHits(Dataport *dpHit, Dataport* dpLog,int prIdx, DWORD timeout) {
 }
 
 size_t GetHitsSize() {
-	return sizeof(GlobalHitBuffer) + sHandle->wp.globalHistogramParams.GetDataSize() +
-		sHandle->textTotalSize + sHandle->profTotalSize + sHandle->dirTotalSize + sHandle->angleMapTotalSize + sHandle->histogramTotalSize
-		+ sHandle->sh.nbFacet * sizeof(FacetHitBuffer) * (1+sHandle->moments.size());
+	if (sHandle->coveringIndex.empty()) return sHandle->coveringOffset;
+	return sHandle->coveringOffset + sizeof(llong) + sHandle->ep.coveringSteps * (1 + sHandle->ep.coveringFacets.size()) * sizeof(double);
 }
 
 void ResetTmpCounters() {
 	SetState(NULL, "Resetting local cache...", false, true);
 
-	memset(&sHandle->tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
+	for (auto& t : sHandle->threads) {
+		t.ResetTmpCounters();
+	}
+
+}
+
+void SimulationThread::ResetTmpCounters() {
+	memset(&tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
 	
 	//Reset global histograms
-	for (auto& h : sHandle->tmpGlobalHistograms) {
+	for (auto& h : tmpGlobalHistograms) {
 		//Could use ZEROVECTOR as well
 		ZEROVECTOR(h.nbHitsHistogram);
 		ZEROVECTOR(h.distanceHistogram);
 		ZEROVECTOR(h.timeHistogram);
 	}
 
-	for (int j = 0; j < sHandle->sh.nbSuper; j++) {
-		for (auto& f : sHandle->structures[j].facets) {
-			f.ResetCounter();
-			f.hitted = false;
+	for (auto& f : facetStates) {
+		f.ResetCounter();
+		f.hitted = false;
 
-			//Reset facet histograms
-			
-				for (auto& t : f.tmpHistograms) {
-					ZEROVECTOR(t.nbHitsHistogram);
-					ZEROVECTOR(t.distanceHistogram);
-					ZEROVECTOR(t.timeHistogram);
-				}
-			
-
-			for (auto& t : f.texture) {
-				std::fill(t.begin(), t.end(), TextureCell());
-			}
+		//Reset facet histograms
+		for (auto& t : f.tmpHistograms) {
+			ZEROVECTOR(t.nbHitsHistogram);
+			ZEROVECTOR(t.distanceHistogram);
+			ZEROVECTOR(t.timeHistogram);
+		}
 
-			
-			for (auto& p : f.profile) {
-				std::fill(p.begin(), p.end(), ProfileSlice());
-			}
+		for (auto& t : f.texture) {
+			std::fill(t.begin(), t.end(), TextureCell());
+		}
 
-			
-			for (auto& d : f.direction) {
-				std::fill(d.begin(), d.end(), DirectionCell());
-			}
+		for (auto& p : f.profile) {
+			std::fill(p.begin(), p.end(), ProfileSlice());
+		}
 
-			if (f.sh.anglemapParams.record) {
-				ZEROVECTOR(f.angleMap.pdf);
-			}
+		for (auto& d : f.direction) {
+			std::fill(d.begin(), d.end(), DirectionCell());
 		}
+
+		ZEROVECTOR(f.angleMapPdf);
 	}
 
+	std::fill(speciesCounters.begin(), speciesCounters.end(), FacetHitBuffer());
+	std::fill(speciesTextures.begin(), speciesTextures.end(), TextureCell());
+	std::fill(sweepCounters.begin(), sweepCounters.end(), FacetHitBuffer());
+	std::fill(estimatorCounters.begin(), estimatorCounters.end(), FacetHitBuffer());
+	std::fill(adjointCounters.begin(), adjointCounters.end(), AdjointResult());
+	std::fill(convergenceStats.begin(), convergenceStats.end(), FacetConvergence());
+	std::fill(transferLaunched.begin(), transferLaunched.end(), 0.0);
+	std::fill(transferCounters.begin(), transferCounters.end(), TransferEntry());
 }
 
 void ResetSimulation() {
-	sHandle->currentParticle.lastHitFacet = NULL;
+	for (auto& t : sHandle->threads) {
+		t.currentParticle.lastHitFacet = NULL;
+		t.currentParticle.transferRow = -1;
+		t.currentParticle.transferScores.clear();
+		for (auto& lane : t.lanes) {
+			lane.particle.lastHitFacet = NULL;
+			lane.particle.transferRow = -1;
+			lane.particle.transferScores.clear();
+		}
+		t.totalDesorbed = 0;
+		t.quotaNext = t.quotaEnd = 0; //The quota counter itself is cleared with the hits dataport
+		t.tmpParticleLog.clear();
+		t.splitParticles.clear();
+		t.nbRouletteKilled = 0;
+		t.nbSplit = 0;
+		std::fill(t.batchValues.begin(), t.batchValues.end(), 0.0);
+		t.batchDesorbed = 0;
+		t.lanesWaiting = false;
+	}
+	sHandle->maxRelativeError = -1.0;
+	sHandle->converged = false;
 	sHandle->totalDesorbed = 0;
+	sHandle->nbRouletteKilled = 0;
+	sHandle->nbSplit = 0;
+	ResetCoveringEvolution();
 	ResetTmpCounters();
-	sHandle->tmpParticleLog.clear();
 	if (sHandle->acDensity) memset(sHandle->acDensity, 0, sHandle->nbAC * sizeof(ACFLOAT));
 
 }
 
+void InitCoveringEvolution(BYTE *buffer) {
+	// Starting coverings, written by the GUI in the constant flow counters before the load
+	if (sHandle->coveringIndex.empty()) return;
+	sHandle->initialCovering.clear();
+	for (const size_t& id : sHandle->ep.coveringFacets) {
+		FacetHitBuffer* facetHitBuffer = (FacetHitBuffer*)(buffer + sHandle->facetsByGlobalId[id]->sh.hitOffset);
+		sHandle->initialCovering.push_back((double)facetHitBuffer->hit.covering);
+	}
+	ResetCoveringEvolution();
+}
+
+void ResetCoveringEvolution() {
+	if (sHandle->coveringIndex.empty() || sHandle->initialCovering.empty()) return; //Not connected yet
+	sHandle->covering = sHandle->initialCovering;
+	sHandle->stepLoss.assign(sHandle->covering.size(), 0.0);
+	sHandle->coveringTimeline.clear();
+	sHandle->coveringStep = 0;
+	sHandle->stepEnd = (llong)sHandle->ep.stepDesorptions; //The quota counter starts from 0
+	for (auto& t : sHandle->threads) std::fill(t.stepAbsorbed.begin(), t.stepAbsorbed.end(), 0.0);
+	SetCoveringSources();
+}
+
+double CoveringSticking(const SubprocessFacet& f, const double& covering) {
+	// Linear between the clean and the monolayer sticking, times the chance to lose the adsorption energy
+	double nMono = f.sh.area * 1E-4 / (carbondiameter*carbondiameter); //Carbon equivalent particles of one monolayer
+	double coverage = covering * (sHandle->wp.gasMass / 12.011) / nMono;
+	double sticking = (coverage < 1.0) ? stickingEmpty * (1.0 - coverage) + stickingFull * coverage : stickingFull;
+	return sticking * (1.0 - exp(-adsorptionEnergy / (kb*f.sh.temperature)));
+}
+
+void SetCoveringSources() {
+	// Molecules leaving each facet during the step: its covering (first order desorption, exact over the step)
+	// and its constant outgassing. Each test particle stands for the same number of molecules
+	double dt = sHandle->ep.coveringTimeStep;
+	std::vector<double> sourceWeights;
+	double totalMolecules = 0.0;
+	sHandle->sourceFacets.clear();
+	for (size_t s = 0; s < sHandle->structures.size(); s++) {
+		for (auto& f : sHandle->structures[s].facets) {
+			double molecules = (f.sh.desorbType != DES_NONE) ? dt * f.sh.outgassing / (kb*f.sh.temperature) : 0.0;
+			int i = sHandle->coveringIndex[f.globalId];
+			if (i != -1) {
+				double rate = exp(-desorptionEnergy / (kb*f.sh.temperature)) / tau;
+				sHandle->stepLoss[i] = sHandle->covering[i] * (1.0 - exp(-rate * dt));
+				molecules += sHandle->stepLoss[i];
+				f.sh.sticking = CoveringSticking(f, sHandle->covering[i]); //No thread is running
+			}
+			if (molecules > 0.0) {
+				sHandle->sourceFacets.push_back(&f);
+				sourceWeights.push_back(molecules);
+				totalMolecules += molecules;
+			}
+		}
+	}
+	if (!sHandle->sourceTable.Build(sourceWeights)) sHandle->sourceFacets.clear();
+	sHandle->particleWeight = totalMolecules / (double)sHandle->ep.stepDesorptions;
+}
+
+bool NextCoveringStep() {
+	// Every thread has finished: the step's absorptions and desorptions are applied to the coverings,
+	// then the next step starts from the new sources. False after the last step or at the desorption limit
+	if (sHandle->coveringStep >= sHandle->ep.coveringSteps || sHandle->desorptionQuota->load() < sHandle->stepEnd) return false;
+	size_t nbCovering = sHandle->covering.size();
+	std::vector<double> absorbed(nbCovering, 0.0);
+	for (auto& t : sHandle->threads) {
+		for (size_t i = 0; i < nbCovering; i++) absorbed[i] += t.stepAbsorbed[i];
+		std::fill(t.stepAbsorbed.begin(), t.stepAbsorbed.end(), 0.0);
+	}
+	do {
+		for (size_t i = 0; i < nbCovering; i++)
+			sHandle->covering[i] = std::max(sHandle->covering[i] + absorbed[i] * sHandle->particleWeight - sHandle->stepLoss[i], 0.0);
+		std::fill(absorbed.begin(), absorbed.end(), 0.0);
+		sHandle->coveringStep++;
+		sHandle->coveringTimeline.push_back((double)sHandle->coveringStep * sHandle->ep.coveringTimeStep);
+		sHandle->coveringTimeline.insert(sHandle->coveringTimeline.end(), sHandle->covering.begin(), sHandle->covering.end());
+		if (sHandle->coveringStep == sHandle->ep.coveringSteps) return false;
+		SetCoveringSources();
+	} while (sHandle->sourceFacets.empty()); //Nothing desorbs: coverings stay as they are
+	sHandle->stepEnd = sHandle->desorptionQuota->load() + (llong)sHandle->ep.stepDesorptions;
+	for (auto& t : sHandle->threads) {
+		tHandle = &t;
+		t.StartParticles();
+	}
+	return true;
+}
+
 bool StartSimulation(size_t sMode) {
 	sHandle->wp.sMode = sMode;
 	switch (sMode) {
 	case MC_MODE:
-		if (!sHandle->currentParticle.lastHitFacet) StartFromSource();
-		return (sHandle->currentParticle.lastHitFacet != NULL);
+	{
+		bool started = false;
+		for (auto& t : sHandle->threads) {
+			tHandle = &t;
+			started |= t.StartParticles();
+		}
+		return started;
+	}
 	case AC_MODE:
 		if (sHandle->prgAC != 100) {
 			SetErrorSub("AC matrix not calculated");
@@ -618,10 +1100,10 @@ bool StartSimulation(size_t sMode) {
 }
 
 void RecordHit(const int &type) {
-	if (sHandle->tmpGlobalResult.hitCacheSize < HITCACHESIZE) {
-		sHandle->tmpGlobalResult.hitCache[sHandle->tmpGlobalResult.hitCacheSize].pos = sHandle->currentParticle.position;
-		sHandle->tmpGlobalResult.hitCache[sHandle->tmpGlobalResult.hitCacheSize].type = type;
-		sHandle->tmpGlobalResult.hitCacheSize++;
+	if (tHandle->activeLane == 0 && tHandle->tmpGlobalResult.hitCacheSize < HITCACHESIZE) {
+		tHandle->tmpGlobalResult.hitCache[tHandle->tmpGlobalResult.hitCacheSize].pos = tHandle->currentParticle.position;
+		tHandle->tmpGlobalResult.hitCache[tHandle->tmpGlobalResult.hitCacheSize].type = type;
+		tHandle->tmpGlobalResult.hitCacheSize++;
 	}
 }
 
@@ -630,10 +1112,10 @@ void RecordLeakPos() {
 	// Record leak for debugging
 	RecordHit(HIT_REF);
 	RecordHit(HIT_LAST);
-	if (sHandle->tmpGlobalResult.leakCacheSize < LEAKCACHESIZE) {
-		sHandle->tmpGlobalResult.leakCache[sHandle->tmpGlobalResult.leakCacheSize].pos = sHandle->currentParticle.position;
-		sHandle->tmpGlobalResult.leakCache[sHandle->tmpGlobalResult.leakCacheSize].dir = sHandle->currentParticle.direction;
-		sHandle->tmpGlobalResult.leakCacheSize++;
+	if (tHandle->tmpGlobalResult.leakCacheSize < LEAKCACHESIZE) {
+		tHandle->tmpGlobalResult.leakCache[tHandle->tmpGlobalResult.leakCacheSize].pos = tHandle->currentParticle.position;
+		tHandle->tmpGlobalResult.leakCache[tHandle->tmpGlobalResult.leakCacheSize].dir = tHandle->currentParticle.direction;
+		tHandle->tmpGlobalResult.leakCacheSize++;
 	}
 }
 
@@ -659,11 +1141,36 @@ bool SimulationRun() {
 	if (sHandle->stepPerSec != 0.0)
 		nbStep = (int)(sHandle->stepPerSec + 0.5);
 	if (nbStep < 1) nbStep = 1;
+	if (sHandle->converged) return true; //Watched facets below the target error (checked on UpdateMCHits)
 	t0 = GetTick();
 	switch (sHandle->wp.sMode) {
 	case MC_MODE:
-
-		goOn = SimulationMCStep(nbStep);
+		if (sHandle->threads.size() == 1) {
+			tHandle = &sHandle->threads[0];
+			goOn = SimulationMCStep(nbStep);
+		}
+		else {
+			// Every thread traces nbStep bounces, finished threads (desorption limit) are not restarted
+			std::vector<std::thread> workers;
+			std::vector<char> threadGoOn(sHandle->threads.size(), false);
+			for (size_t i = 0; i < sHandle->threads.size(); i++) {
+				if (!sHandle->threads[i].IsRunning()) continue;
+				workers.emplace_back([i, nbStep, &threadGoOn]() {
+					tHandle = &sHandle->threads[i];
+					threadGoOn[i] = SimulationMCStep(nbStep);
+				});
+			}
+			for (auto& w : workers) w.join();
+			goOn = std::find(threadGoOn.begin(), threadGoOn.end(), (char)true) != threadGoOn.end();
+		}
+		if (!goOn && !sHandle->coveringIndex.empty() && GetLocalState() != PROCESS_ERROR)
+			goOn = NextCoveringStep(); //false after the last step
+		sHandle->totalDesorbed = sHandle->nbRouletteKilled = sHandle->nbSplit = 0;
+		for (const auto& t : sHandle->threads) {
+			sHandle->totalDesorbed += t.totalDesorbed;
+			sHandle->nbRouletteKilled += t.nbRouletteKilled;
+			sHandle->nbSplit += t.nbSplit;
+		}
 		break;
 	case AC_MODE:
 		goOn = SimulationACStep(nbStep);
@@ -724,13 +1231,13 @@ int GetIDId(int paramId) {
 
 bool SubprocessFacet::InitializeOnLoad(const size_t& id) {
 	globalId = id;
-	ResizeCounter(sHandle->moments.size()); //Initialize counter
 	if (!InitializeLinkAndVolatile(id)) return false;
-	InitializeOutgassingMap();
+	if (!InitializeOutgassingMap()) return false;
 	if (!InitializeAngleMap()) return false;
 	if (!InitializeTexture()) return false;
 	if (!InitializeProfile()) return false;
 	if (!InitializeDirectionTexture()) return false;
+	if (!InitializePolygonGrid()) return false;
 	InitializeHistogram();
 
 	return true;
@@ -738,12 +1245,6 @@ bool SubprocessFacet::InitializeOnLoad(const size_t& id) {
 
 void SubprocessFacet::InitializeHistogram()
 {
-	FacetHistogramBuffer hist;
-	if (sh.facetHistogramParams.recordBounce) hist.nbHitsHistogram.resize(sh.facetHistogramParams.GetBounceHistogramSize());
-	if (sh.facetHistogramParams.recordDistance) 	hist.distanceHistogram.resize(sh.facetHistogramParams.GetDistanceHistogramSize());
-	if (sh.facetHistogramParams.recordTime) 	hist.timeHistogram.resize(sh.facetHistogramParams.GetTimeHistogramSize());
-	
-	tmpHistograms = std::vector<FacetHistogramBuffer>(1 + sHandle->moments.size(), hist);
 	sHandle->histogramTotalSize += (1 + sHandle->moments.size()) * 
 		(sh.facetHistogramParams.GetBouncesDataSize() 
 		+ sh.facetHistogramParams.GetDistanceDataSize() 
@@ -755,13 +1256,6 @@ bool SubprocessFacet::InitializeDirectionTexture()
 	//Direction
 	if (sh.countDirection) {
 		directionSize = sh.texWidth*sh.texHeight * sizeof(DirectionCell);
-		try {
-			direction = std::vector<std::vector<DirectionCell>>(1 + sHandle->moments.size(), std::vector<DirectionCell>(sh.texWidth*sh.texHeight));
-		}
-		catch (...) {
-			SetErrorSub("Not enough memory to load direction textures");
-			return false;
-		}
 		sHandle->dirTotalSize += directionSize * (1 + sHandle->moments.size());
 	}
 	else directionSize = 0;
@@ -773,13 +1267,6 @@ bool SubprocessFacet::InitializeProfile()
 	//Profiles
 	if (sh.isProfile) {
 		profileSize = PROFILE_SIZE * sizeof(ProfileSlice);
-		try {
-			profile = std::vector<std::vector<ProfileSlice>>(1 + sHandle->moments.size(), std::vector<ProfileSlice>(PROFILE_SIZE));
-		}
-		catch (...) {
-			SetErrorSub("Not enough memory to load profiles");
-			return false;
-		}
 		sHandle->profTotalSize += profileSize * (1 + sHandle->moments.size());
 	}
 	else profileSize = 0;
@@ -793,13 +1280,6 @@ bool SubprocessFacet::InitializeTexture()
 		size_t nbE = sh.texWidth*sh.texHeight;
 		largeEnough.resize(nbE);
 		textureSize = nbE * sizeof(TextureCell);
-		try {
-			texture = std::vector<std::vector<TextureCell>>(1 + sHandle->moments.size(), std::vector<TextureCell>(nbE));
-		}
-		catch (...) {
-			SetErrorSub("Not enough memory to load textures");
-			return false;
-		}
 		fullSizeInc = 1E30;
 		for (size_t j = 0; j < nbE; j++) {
 			if ((textureCellIncrements[j] > 0.0) && (textureCellIncrements[j] < fullSizeInc)) fullSizeInc = textureCellIncrements[j];
@@ -900,6 +1380,10 @@ bool SubprocessFacet::InitializeAngleMap()
 				}
 			}
 
+			if (!angleMap.BuildGuideTables(sh.anglemapParams)) {
+				SetErrorSub("Not enough memory to load incident angle map (guide tables)");
+				return false;
+			}
 		}
 	}
 	else {
@@ -909,17 +1393,78 @@ bool SubprocessFacet::InitializeAngleMap()
 	return true;
 }
 
-void SubprocessFacet::InitializeOutgassingMap()
+bool SubprocessFacet::InitializePolygonGrid()
+{
+	// Cells touched by an edge (grown by a small margin) are marked, the others take the state of their center
+	polygonGrid.size = 0;
+	polygonGrid.cells.clear();
+	size_t nbVertex = vertices2.size();
+	if (nbVertex <= polygonGridMinVertices) return true;
+	size_t size = (nbVertex > 64) ? 32 : 16;
+	try {
+		polygonGrid.cells.assign(size * size, 0);
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to build the point-in-facet grid");
+		return false;
+	}
+	const double margin = 1E-9;
+	double cellSize = 1.0 / (double)size;
+	for (size_t e = 0; e < nbVertex; e++) {
+		const Vector2d& a = vertices2[e];
+		const Vector2d& b = vertices2[(e + 1) % nbVertex];
+		int iMin = Max(0, (int)floor((Min(a.u, b.u) - margin) * size));
+		int iMax = Min((int)size - 1, (int)floor((Max(a.u, b.u) + margin) * size));
+		int jMin = Max(0, (int)floor((Min(a.v, b.v) - margin) * size));
+		int jMax = Min((int)size - 1, (int)floor((Max(a.v, b.v) + margin) * size));
+		for (int j = jMin; j <= jMax; j++) {
+			for (int i = iMin; i <= iMax; i++) {
+				// The edge misses the cell if its four corners are strictly on one side of the edge's line
+				double u0 = i * cellSize - margin, u1 = (i + 1) * cellSize + margin;
+				double v0 = j * cellSize - margin, v1 = (j + 1) * cellSize + margin;
+				double side[4] = {
+					(b.u - a.u) * (v0 - a.v) - (b.v - a.v) * (u0 - a.u),
+					(b.u - a.u) * (v0 - a.v) - (b.v - a.v) * (u1 - a.u),
+					(b.u - a.u) * (v1 - a.v) - (b.v - a.v) * (u0 - a.u),
+					(b.u - a.u) * (v1 - a.v) - (b.v - a.v) * (u1 - a.u) };
+				bool allPositive = side[0] > 0.0 && side[1] > 0.0 && side[2] > 0.0 && side[3] > 0.0;
+				bool allNegative = side[0] < 0.0 && side[1] < 0.0 && side[2] < 0.0 && side[3] < 0.0;
+				if (!allPositive && !allNegative) polygonGrid.cells[j * size + i] = 2;
+			}
+		}
+	}
+	for (size_t j = 0; j < size; j++) {
+		for (size_t i = 0; i < size; i++) {
+			char& cell = polygonGrid.cells[j * size + i];
+			if (cell != 2) cell = IsInFacet(*this, ((double)i + 0.5) * cellSize, ((double)j + 0.5) * cellSize) ? 1 : 0;
+		}
+	}
+	polygonGrid.size = size;
+	return true;
+}
+
+bool SubprocessFacet::InitializeOutgassingMap()
 {
 	if (sh.useOutgassingFile) {
 		//Precalc actual outgassing map width and height for faster generation:
 		outgassingMapWidthD = sh.U.Norme() * sh.outgassingFileRatio;
 		outgassingMapHeightD = sh.V.Norme() * sh.outgassingFileRatio;
-		size_t nbE = sh.outgassingMapWidth*sh.outgassingMapHeight;
-		for (size_t i = 1; i < nbE; i++) {
-			outgassingMap[i] += outgassingMap[i - 1]; //Convert p.d. to cumulative distr. 
+		//Cell selection: same distribution as a search in the cumulative map, one draw and two lookups
+		try {
+			if (!outgassingMapTable.Build(outgassingMap) && sh.totalOutgassing > 0.0) {
+				std::stringstream err; err << "Facet " << globalId + 1 << " has all-zero outgassing map.";
+				SetErrorSub(err.str().c_str());
+				return false;
+			}
 		}
+		catch (...) {
+			SetErrorSub("Not enough memory to load outgassing map");
+			return false;
+		}
+		outgassingMap.clear();
+		outgassingMap.shrink_to_fit();
 	}
+	return true;
 }
 
 bool SubprocessFacet::InitializeLinkAndVolatile(const size_t & id)
@@ -947,3 +1492,260 @@ bool SubprocessFacet::InitializeLinkAndVolatile(const size_t & id)
 	}
 	return true;
 }
+
+bool FacetHitState::Initialize(SubprocessFacet& f, size_t nbMoments)
+{
+	hitted = false;
+	ready = true;
+
+	FacetHistogramBuffer hist;
+	if (f.sh.facetHistogramParams.recordBounce) hist.nbHitsHistogram.resize(f.sh.facetHistogramParams.GetBounceHistogramSize());
+	if (f.sh.facetHistogramParams.recordDistance) 	hist.distanceHistogram.resize(f.sh.facetHistogramParams.GetDistanceHistogramSize());
+	if (f.sh.facetHistogramParams.recordTime) 	hist.timeHistogram.resize(f.sh.facetHistogramParams.GetTimeHistogramSize());
+
+	try {
+		tmpCounter = std::vector<FacetHitBuffer>(1 + nbMoments); //Includes 0-init
+		tmpHistograms = std::vector<FacetHistogramBuffer>(1 + nbMoments, hist);
+		if (f.sh.isTextured) texture = std::vector<std::vector<TextureCell>>(1 + nbMoments, std::vector<TextureCell>(f.sh.texWidth*f.sh.texHeight));
+		if (f.sh.isProfile) profile = std::vector<std::vector<ProfileSlice>>(1 + nbMoments, std::vector<ProfileSlice>(PROFILE_SIZE));
+		if (f.sh.countDirection) direction = std::vector<std::vector<DirectionCell>>(1 + nbMoments, std::vector<DirectionCell>(f.sh.texWidth*f.sh.texHeight));
+		if (f.sh.anglemapParams.record) angleMapPdf.resize(f.sh.anglemapParams.GetMapSize());
+	}
+	catch (...) {
+		std::ostringstream err;
+		err << "Not enough memory to load hit buffers of F#" << f.globalId + 1;
+		SetErrorSub(err.str().c_str());
+		return false;
+	}
+	return true;
+}
+
+bool SimulationThread::Initialize(size_t index, uint64_t seed)
+{
+	threadIndex = index;
+	workerIndex = sHandle->prIdx * sHandle->threads.size() + index;
+	nbWorkers = sHandle->ontheflyParams.nbProcess * sHandle->threads.size();
+	random.Seed(seed);
+	totalDesorbed = 0;
+	batchDesorbed = 0;
+	lanesWaiting = false;
+	quotaNext = quotaEnd = 0;
+	nbRouletteKilled = 0;
+	nbSplit = 0;
+	splitParticles.clear();
+	currentParticle.splitPending = false;
+	currentParticle.pendingReflection = NULL;
+	currentParticle.nextEventCovered = false;
+	currentParticle.lastHitFacet = NULL;
+	currentParticle.transferRow = -1;
+	currentParticle.transferScores.clear();
+	memset(&tmpGlobalResult, 0, sizeof(GlobalHitBuffer));
+	activeMomentsTime = std::numeric_limits<double>::quiet_NaN(); //Never equal, first hit resolves
+	activeMoments.clear();
+	activeMoments.reserve(1 + sHandle->moments.size());
+	speciesMoments.reserve(1 + sHandle->moments.size());
+	estimatorMoments.reserve(1 + sHandle->moments.size());
+	currentParticle.speciesFlightTime.resize(sHandle->speciesSpeedFactors.size());
+	currentParticle.scenarioRatio.resize(sHandle->nbScenarios);
+	currentParticle.scenarioRatioBeforeCollision.resize(sHandle->nbScenarios);
+	try {
+		speciesCounters = std::vector<FacetHitBuffer>(sHandle->speciesSpeedFactors.size() * sHandle->sh.nbFacet * (1 + sHandle->moments.size()));
+		speciesTextures = std::vector<TextureCell>(sHandle->speciesSpeedFactors.size() * sHandle->speciesTextureCells);
+		sweepCounters = std::vector<FacetHitBuffer>(sHandle->nbScenarios * sHandle->sh.nbFacet * (1 + sHandle->moments.size()));
+		estimatorCounters = std::vector<FacetHitBuffer>(sHandle->estimatorFacets.size() * (1 + sHandle->moments.size()));
+		adjointCounters = std::vector<AdjointResult>(sHandle->adjointTarget ? sHandle->sh.nbFacet : 0);
+		convergenceStats = std::vector<FacetConvergence>(sHandle->ep.watchFacets.size());
+		batchValues = std::vector<double>(3 * sHandle->ep.watchFacets.size(), 0.0);
+		size_t nbTransfer = sHandle->transferIndex.empty() ? 0 : sHandle->ep.transferFacets.size();
+		transferLaunched = std::vector<double>(nbTransfer, 0.0);
+		transferCounters = std::vector<TransferEntry>(nbTransfer * nbTransfer);
+		stepAbsorbed = std::vector<double>(sHandle->coveringIndex.empty() ? 0 : sHandle->ep.coveringFacets.size(), 0.0);
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to create species and sweep counters");
+		return false;
+	}
+	triggeredVolatiles.clear();
+	activeLane = 0;
+	// Packet mode. Volatile facets are armed again at each desorption of the thread, which needs one particle at a time
+	lanes.clear();
+	if (sHandle->ep.packetSize > 1 && !sHandle->hasVolatile) {
+		try {
+			lanes = std::vector<ParticleLane>(sHandle->ep.packetSize, ParticleLane{ currentParticle, random });
+			for (auto& candidates : packet.candidates) candidates.reserve(16);
+		}
+		catch (...) {
+			SetErrorSub("Not enough memory to create particle packets");
+			return false;
+		}
+	}
+
+	//Initialize global histogram
+	FacetHistogramBuffer hist;
+	hist.nbHitsHistogram.resize(sHandle->wp.globalHistogramParams.recordBounce ? sHandle->wp.globalHistogramParams.GetBounceHistogramSize() : 0); hist.nbHitsHistogram.shrink_to_fit();
+	hist.distanceHistogram.resize(sHandle->wp.globalHistogramParams.recordDistance ? sHandle->wp.globalHistogramParams.GetDistanceHistogramSize() : 0); hist.distanceHistogram.shrink_to_fit();
+	hist.timeHistogram.resize(sHandle->wp.globalHistogramParams.recordTime ? sHandle->wp.globalHistogramParams.GetTimeHistogramSize() : 0); hist.timeHistogram.shrink_to_fit();
+	tmpGlobalHistograms = std::vector<FacetHistogramBuffer>(1 + sHandle->moments.size(), hist);
+
+	//Reserve particle log
+	if (sHandle->ontheflyParams.enableLogging) tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess / sHandle->threads.size());
+
+	//Facet hit buffers
+	facetStates.resize(sHandle->sh.nbFacet);
+	for (auto& s : sHandle->structures) {
+		for (auto& f : s.facets) {
+			if (!facetStates[f.globalId].Initialize(f, sHandle->moments.size())) return false;
+		}
+	}
+	return true;
+}
+
+void SimulationThread::SwapLane(const size_t& lane)
+{
+	std::swap(currentParticle, lanes[lane].particle);
+	std::swap(random, lanes[lane].random);
+	activeLane = lane;
+}
+
+bool SimulationThread::IsRunning() const
+{
+	if (lanes.empty()) return currentParticle.lastHitFacet != NULL;
+	for (const ParticleLane& lane : lanes)
+		if (lane.particle.lastHitFacet) return true;
+	return false;
+}
+
+bool SimulationThread::OtherLanesInFlight() const
+{
+	for (size_t l = 0; l < lanes.size(); l++)
+		if (l != activeLane && lanes[l].particle.lastHitFacet) return true;
+	return false;
+}
+
+bool SimulationThread::StartParticles()
+{
+	// tHandle must point to this thread
+	if (lanes.empty()) {
+		if (!currentParticle.lastHitFacet) StartFromSource();
+		return currentParticle.lastHitFacet != NULL;
+	}
+	for (size_t l = 0; l < lanes.size(); l++) {
+		if (lanes[l].particle.lastHitFacet) continue;
+		SwapLane(l);
+		StartFromSource();
+		SwapLane(l);
+	}
+	return IsRunning();
+}
+
+bool SimulationThread::ClaimParticle(llong& particleIndex)
+{
+	// Index of the next particle to desorb, false once the desorption limit is reached by all workers together.
+	// Threads claim chunks of the shared counter as they go, so faster workers simply trace more particles
+	llong limit = (llong)sHandle->ontheflyParams.desorptionLimit; //Can change on-the-fly
+	if (!sHandle->coveringIndex.empty() && (limit == 0 || sHandle->stepEnd < limit)) limit = sHandle->stepEnd; //End of the covering step
+	if (quotaNext == quotaEnd || (limit > 0 && quotaNext >= limit)) {
+		llong claimed = sHandle->desorptionQuota->load();
+		llong end;
+		do {
+			if (limit > 0 && claimed >= limit) return false;
+			// Chunks shrink with the remaining quota, down to single particles at the end
+			llong chunk = (limit > 0) ? std::min((limit - claimed) / (2 * (llong)nbWorkers), maxQuotaChunk) : maxQuotaChunk;
+			end = claimed + std::max(chunk, (llong)1);
+		} while (!sHandle->desorptionQuota->compare_exchange_weak(claimed, end));
+		quotaNext = claimed;
+		quotaEnd = end;
+	}
+	particleIndex = quotaNext++;
+	return true;
+}
+
+bool Anglemap::BuildGuideTables(const AnglemapParams& anglemapParams)
+{
+	// Guide cell g holds the last CDF index below g/cells: a lookup starts there and walks forward,
+	// a step or two on average instead of a binary search. Zero-count lines are skipped by the walk, never sampled
+	size_t nbTheta = anglemapParams.thetaLowerRes + anglemapParams.thetaHigherRes;
+	size_t width = anglemapParams.phiWidth;
+	thetaGuide.clear(); phiGuide.clear();
+	phiGuideCells = width * angleMapGuideCells;
+	if (nbTheta * phiGuideCells > maxAngleMapGuideSize) phiGuideCells = width; //Coarser
+	try {
+		thetaGuide.resize(nbTheta * angleMapGuideCells);
+		if (width > 1 && nbTheta * phiGuideCells <= maxAngleMapGuideSize) phiGuide.resize(nbTheta * phiGuideCells);
+	}
+	catch (...) {
+		return false;
+	}
+
+	int i = -1;
+	for (size_t g = 0; g < thetaGuide.size(); g++) {
+		double p = (double)g / (double)thetaGuide.size();
+		while (i + 1 < (int)nbTheta && theta_CDF[i + 1] < p) i++;
+		thetaGuide[g] = i;
+	}
+	for (size_t line = 0; line < phiGuide.size() / Max(phiGuideCells, (size_t)1); line++) {
+		const double* cdf = &phi_CDFs[line * width];
+		int k = -1;
+		for (size_t g = 0; g < phiGuideCells; g++) {
+			double p = (double)g / (double)phiGuideCells;
+			while (k + 1 < (int)width && cdf[k + 1] < p) k++;
+			phiGuide[line * phiGuideCells + g] = k;
+		}
+	}
+	return true;
+}
+
+void ResampleSegment(Parameter& param, double x1, double y1, double x2, double y2, size_t depth, std::vector<std::pair<double, double>>& knots) {
+	//Adds knots in (x1,x2] until linear interpolation matches the parameter's own (possibly log-log) interpolation
+	double xm = 0.5 * (x1 + x2);
+	double ym = param.InterpolateY(xm, false);
+	double linear = 0.5 * (y1 + y2);
+	if (depth < 12 && abs(ym - linear) > 1E-4 * std::max(abs(ym), 1E-30)) {
+		ResampleSegment(param, x1, y1, xm, ym, depth + 1, knots);
+		ResampleSegment(param, xm, ym, x2, y2, depth + 1, knots);
+	}
+	else knots.push_back(std::make_pair(x2, y2));
+}
+
+bool BuildParameterTables() {
+	try {
+		sHandle->parameterTables.resize(sHandle->parameters.size());
+		for (size_t p = 0; p < sHandle->parameters.size(); p++) {
+			Parameter& param = sHandle->parameters[p];
+			std::vector<std::pair<double, double>> knots;
+			if (param.GetSize() == 0) continue;
+			knots.push_back(std::make_pair(param.GetX(0), param.GetY(0)));
+			for (size_t i = 1; i < param.GetSize(); i++) {
+				if (param.GetX(i) > param.GetX(i - 1)) ResampleSegment(param, param.GetX(i - 1), param.GetY(i - 1), param.GetX(i), param.GetY(i), 0, knots);
+				else knots.push_back(std::make_pair(param.GetX(i), param.GetY(i))); //step
+			}
+			sHandle->parameterTables[p].Build(knots, false);
+		}
+
+		sHandle->desorptionTimeTables.resize(sHandle->IDs.size());
+		for (size_t i = 0; i < sHandle->IDs.size(); i++) {
+			std::vector<std::pair<double, double>> inverse; inverse.reserve(sHandle->IDs[i].size());
+			for (const auto& point : sHandle->IDs[i])
+				inverse.push_back(std::make_pair(point.second, point.first));
+			sHandle->desorptionTimeTables[i].Build(inverse, true);
+		}
+	}
+	catch (...) {
+		SetErrorSub("Not enough memory to build parameter lookup tables");
+		return false;
+	}
+	return true;
+}
+
+void UpdateInstrumentedFacets() {
+	// Facets needing recorders besides their counters take the full hit path, the others the plain one
+	bool globalHistograms = sHandle->wp.globalHistogramParams.recordBounce || sHandle->wp.globalHistogramParams.recordDistance || sHandle->wp.globalHistogramParams.recordTime;
+	for (auto& s : sHandle->structures) {
+		for (auto& f : s.facets) {
+			f.isInstrumented = f.sh.countRefl || f.sh.countAbs || f.sh.countTrans || f.sh.countDirection
+				|| f.sh.profileType != PROFILE_NONE || f.sh.anglemapParams.record
+				|| globalHistograms || f.sh.facetHistogramParams.recordBounce || f.sh.facetHistogramParams.recordDistance || f.sh.facetHistogramParams.recordTime
+				|| (sHandle->ontheflyParams.enableLogging && sHandle->ontheflyParams.logFacetId == f.globalId);
+		}
+	}
+}
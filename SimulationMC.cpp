@@ -26,8 +26,10 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 #include "Random.h"
 #include "GLApp/MathTools.h"
 #include <tuple> //std::tie
+#include <algorithm>
 
 extern Simulation *sHandle; //delcared in molflowSub.cpp
+thread_local SimulationThread* tHandle = NULL; //MC thread owning the current particle
 
 // Compute area of all the desorption facet
 
@@ -36,7 +38,7 @@ void CalcTotalOutgassing() {
 
 	// Update texture increment for MC
 	//scale_precomputed=(float)(40.0/(sqrt(8.0*8.31/(PI*sHandle->wp.gasMass*0.001))));
-	for (size_t j = 0; j < sHandle->sh.nbSuper; j++) {
+	for (size_t j = 0; j < sHandle->structures.size(); j++) {
 		for (SubprocessFacet& f : sHandle->structures[j].facets) {
 			if (f.sh.is2sided) {
 				f.fullSizeInc *= 0.5;
@@ -123,9 +125,9 @@ double calcDesorptionRate(SubprocessFacet *iFacet) {//Returns desorption rate in
 //	}
 //
 //	// Basis change (nU,nV,N) -> (x,y,z)
-//	sHandle->currentParticle.direction.x = u*U.x + v*V.x + n*N.x;
-//	sHandle->currentParticle.direction.y = u*U.y + v*V.y + n*N.y;
-//	sHandle->currentParticle.direction.z = u*U.z + v*V.z + n*N.z;
+//	tHandle->currentParticle.direction.x = u*U.x + v*V.x + n*N.x;
+//	tHandle->currentParticle.direction.y = u*U.y + v*V.y + n*N.y;
+//	tHandle->currentParticle.direction.z = u*U.z + v*V.z + n*N.z;
 //
 //}
 //
@@ -139,9 +141,9 @@ double calcDesorptionRate(SubprocessFacet *iFacet) {//Returns desorption rate in
 //
 //	// Basis change (x,y,z) -> (nU,nV,N)
 //	// We use the fact that (nU,nV,N) belongs to SO(3)
-//	double u = Dot(sHandle->currentParticle.direction, iFacet->sh.nU);
-//	double v = Dot(sHandle->currentParticle.direction, iFacet->sh.nV);
-//	double n = Dot(sHandle->currentParticle.direction, iFacet->sh.N);
+//	double u = Dot(tHandle->currentParticle.direction, iFacet->sh.nU);
+//	double v = Dot(tHandle->currentParticle.direction, iFacet->sh.nV);
+//	double n = Dot(tHandle->currentParticle.direction, iFacet->sh.N);
 //
 //	/*
 //	// (u,v,n) -> (theta,phi)
@@ -155,6 +157,19 @@ double calcDesorptionRate(SubprocessFacet *iFacet) {//Returns desorption rate in
 //	*phi = atan2(v, u); // -PI..PI
 //}
 
+void AddFacetCounters(FacetHitBuffer* dst, const std::vector<FacetHitBuffer>& src) {
+	for (size_t i = 0; i < src.size(); i++) {
+		dst[i].hit.nbAbsEquiv += src[i].hit.nbAbsEquiv;
+		dst[i].hit.nbDesorbed += src[i].hit.nbDesorbed;
+		dst[i].hit.nbMCHit += src[i].hit.nbMCHit;
+		dst[i].hit.nbHitEquiv += src[i].hit.nbHitEquiv;
+		dst[i].hit.sum_1_per_ort_velocity += src[i].hit.sum_1_per_ort_velocity;
+		dst[i].hit.sum_v_ort += src[i].hit.sum_v_ort;
+		dst[i].hit.sum_1_per_velocity += src[i].hit.sum_1_per_velocity;
+		dst[i].hit.covering += src[i].hit.covering;
+	}
+}
+
 void UpdateMCHits(Dataport *dpHit, int prIdx, size_t nbMoments, DWORD timeout) {
 
 	BYTE *buffer;
@@ -173,13 +188,15 @@ void UpdateMCHits(Dataport *dpHit, int prIdx, size_t nbMoments, DWORD timeout) {
 	buffer = (BYTE*)dpHit->buff;
 	gHits = (GlobalHitBuffer *)buffer;
 
-	// Global hits and leaks: adding local hits to shared memory
-	gHits->globalHits.hit.nbMCHit += sHandle->tmpGlobalResult.globalHits.hit.nbMCHit;
-	gHits->globalHits.hit.nbHitEquiv += sHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv;
-	gHits->globalHits.hit.nbAbsEquiv += sHandle->tmpGlobalResult.globalHits.hit.nbAbsEquiv;
-	gHits->globalHits.hit.nbDesorbed += sHandle->tmpGlobalResult.globalHits.hit.nbDesorbed;
-	gHits->distTraveled_total += sHandle->tmpGlobalResult.distTraveled_total;
-	gHits->distTraveledTotal_fullHitsOnly += sHandle->tmpGlobalResult.distTraveledTotal_fullHitsOnly;
+	// Global hits and leaks: adding local hits of every thread to shared memory
+	for (const SimulationThread& t : sHandle->threads) {
+		gHits->globalHits.hit.nbMCHit += t.tmpGlobalResult.globalHits.hit.nbMCHit;
+		gHits->globalHits.hit.nbHitEquiv += t.tmpGlobalResult.globalHits.hit.nbHitEquiv;
+		gHits->globalHits.hit.nbAbsEquiv += t.tmpGlobalResult.globalHits.hit.nbAbsEquiv;
+		gHits->globalHits.hit.nbDesorbed += t.tmpGlobalResult.globalHits.hit.nbDesorbed;
+		gHits->distTraveled_total += t.tmpGlobalResult.distTraveled_total;
+		gHits->distTraveledTotal_fullHitsOnly += t.tmpGlobalResult.distTraveledTotal_fullHitsOnly;
+	}
 
 	//Memorize current limits, then do a min/max search
 	for (i = 0; i < 3; i++) {
@@ -192,76 +209,146 @@ void UpdateMCHits(Dataport *dpHit, int prIdx, size_t nbMoments, DWORD timeout) {
 	//for(i=0;i<BOUNCEMAX;i++) gHits->wallHits[i] += sHandle->wallHits[i];
 
 	// Leak
-	for (size_t leakIndex = 0; leakIndex < sHandle->tmpGlobalResult.leakCacheSize; leakIndex++)
-		gHits->leakCache[(leakIndex + gHits->lastLeakIndex) % LEAKCACHESIZE] = sHandle->tmpGlobalResult.leakCache[leakIndex];
-	gHits->nbLeakTotal += sHandle->tmpGlobalResult.nbLeakTotal;
-	gHits->lastLeakIndex = (gHits->lastLeakIndex + sHandle->tmpGlobalResult.leakCacheSize) % LEAKCACHESIZE;
-	gHits->leakCacheSize = Min(LEAKCACHESIZE, gHits->leakCacheSize + sHandle->tmpGlobalResult.leakCacheSize);
+	for (const SimulationThread& t : sHandle->threads) {
+		for (size_t leakIndex = 0; leakIndex < t.tmpGlobalResult.leakCacheSize; leakIndex++)
+			gHits->leakCache[(leakIndex + gHits->lastLeakIndex) % LEAKCACHESIZE] = t.tmpGlobalResult.leakCache[leakIndex];
+		gHits->nbLeakTotal += t.tmpGlobalResult.nbLeakTotal;
+		gHits->lastLeakIndex = (gHits->lastLeakIndex + t.tmpGlobalResult.leakCacheSize) % LEAKCACHESIZE;
+		gHits->leakCacheSize = Min(LEAKCACHESIZE, gHits->leakCacheSize + t.tmpGlobalResult.leakCacheSize);
+	}
 
-	// HHit (Only prIdx 0)
+	// HHit (Only prIdx 0, first thread, so that the trajectories stay continuous)
 	if (prIdx == 0) {
-		for (size_t hitIndex = 0; hitIndex < sHandle->tmpGlobalResult.hitCacheSize; hitIndex++)
-			gHits->hitCache[(hitIndex + gHits->lastHitIndex) % HITCACHESIZE] = sHandle->tmpGlobalResult.hitCache[hitIndex];
+		const GlobalHitBuffer& firstThreadResult = sHandle->threads[0].tmpGlobalResult;
+		for (size_t hitIndex = 0; hitIndex < firstThreadResult.hitCacheSize; hitIndex++)
+			gHits->hitCache[(hitIndex + gHits->lastHitIndex) % HITCACHESIZE] = firstThreadResult.hitCache[hitIndex];
 
-		if (sHandle->tmpGlobalResult.hitCacheSize > 0) {
-			gHits->lastHitIndex = (gHits->lastHitIndex + sHandle->tmpGlobalResult.hitCacheSize) % HITCACHESIZE;
+		if (firstThreadResult.hitCacheSize > 0) {
+			gHits->lastHitIndex = (gHits->lastHitIndex + firstThreadResult.hitCacheSize) % HITCACHESIZE;
 			gHits->hitCache[gHits->lastHitIndex].type = HIT_LAST; //Penup (border between blocks of consecutive hits in the hit cache)
-			gHits->hitCacheSize = Min(HITCACHESIZE, gHits->hitCacheSize + sHandle->tmpGlobalResult.hitCacheSize);
+			gHits->hitCacheSize = Min(HITCACHESIZE, gHits->hitCacheSize + firstThreadResult.hitCacheSize);
 		}
 	}
 
 	//Global histograms
-	
+	for (const SimulationThread& t : sHandle->threads) {
 		for (int m = 0; m < (1 + nbMoments); m++) {
 			BYTE *histCurrentMoment = buffer + sizeof(GlobalHitBuffer) + m * sHandle->wp.globalHistogramParams.GetDataSize();
 			if (sHandle->wp.globalHistogramParams.recordBounce) {
 				double* nbHitsHistogram = (double*)histCurrentMoment;
 				for (size_t i = 0; i < sHandle->wp.globalHistogramParams.GetBounceHistogramSize(); i++) {
-					nbHitsHistogram[i] += sHandle->tmpGlobalHistograms[m].nbHitsHistogram[i];
+					nbHitsHistogram[i] += t.tmpGlobalHistograms[m].nbHitsHistogram[i];
 				}
 			}
 			if (sHandle->wp.globalHistogramParams.recordDistance) {
 				double* distanceHistogram = (double*)(histCurrentMoment + sHandle->wp.globalHistogramParams.GetBouncesDataSize());
 				for (size_t i = 0; i < (sHandle->wp.globalHistogramParams.GetDistanceHistogramSize()); i++) {
-					distanceHistogram[i] += sHandle->tmpGlobalHistograms[m].distanceHistogram[i];
+					distanceHistogram[i] += t.tmpGlobalHistograms[m].distanceHistogram[i];
 				}
 			}
 			if (sHandle->wp.globalHistogramParams.recordTime) {
 				double* timeHistogram = (double*)(histCurrentMoment + sHandle->wp.globalHistogramParams.GetBouncesDataSize() + sHandle->wp.globalHistogramParams.GetDistanceDataSize());
 				for (size_t i = 0; i < (sHandle->wp.globalHistogramParams.GetTimeHistogramSize()); i++) {
-					timeHistogram[i] += sHandle->tmpGlobalHistograms[m].timeHistogram[i];
+					timeHistogram[i] += t.tmpGlobalHistograms[m].timeHistogram[i];
 				}
 			}
 		}
-	
+	}
 
 	size_t facetHitsSize = (1 + nbMoments) * sizeof(FacetHitBuffer);
 	// Facets
-	for (s = 0; s < sHandle->sh.nbSuper; s++) {
+	for (s = 0; s < sHandle->structures.size(); s++) {
 		for (SubprocessFacet& f : sHandle->structures[s].facets) {
-			if (f.hitted) {
-
-				for (int m = 0; m < (1 + nbMoments); m++) {
-					FacetHitBuffer *facetHitBuffer = (FacetHitBuffer *)(buffer + f.sh.hitOffset + m * sizeof(FacetHitBuffer));
-					facetHitBuffer->hit.nbAbsEquiv += f.tmpCounter[m].hit.nbAbsEquiv;
-					facetHitBuffer->hit.nbDesorbed += f.tmpCounter[m].hit.nbDesorbed;
-					facetHitBuffer->hit.nbMCHit += f.tmpCounter[m].hit.nbMCHit;
-					facetHitBuffer->hit.nbHitEquiv += f.tmpCounter[m].hit.nbHitEquiv;
-					facetHitBuffer->hit.sum_1_per_ort_velocity += f.tmpCounter[m].hit.sum_1_per_ort_velocity;
-					facetHitBuffer->hit.sum_v_ort += f.tmpCounter[m].hit.sum_v_ort;
-					facetHitBuffer->hit.sum_1_per_velocity += f.tmpCounter[m].hit.sum_1_per_velocity;
-					facetHitBuffer->hit.covering += f.tmpCounter[m].hit.covering;
-				}
+			bool hitted = false;
+			for (const SimulationThread& t : sHandle->threads) hitted |= t.facetStates[f.globalId].hitted;
+			if (hitted) {
+
+				for (const SimulationThread& t : sHandle->threads) {
+					const FacetHitState& state = t.facetStates[f.globalId];
+					if (!state.hitted) continue;
 
-				if (f.sh.isProfile) {
 					for (int m = 0; m < (1 + nbMoments); m++) {
-						ProfileSlice *shProfile = (ProfileSlice *)(buffer + f.sh.hitOffset + facetHitsSize + m * f.profileSize);
-						for (j = 0; j < PROFILE_SIZE; j++) {
-							shProfile[j] += f.profile[m][j];
+						FacetHitBuffer *facetHitBuffer = (FacetHitBuffer *)(buffer + f.sh.hitOffset + m * sizeof(FacetHitBuffer));
+						facetHitBuffer->hit.nbAbsEquiv += state.tmpCounter[m].hit.nbAbsEquiv;
+						facetHitBuffer->hit.nbDesorbed += state.tmpCounter[m].hit.nbDesorbed;
+						facetHitBuffer->hit.nbMCHit += state.tmpCounter[m].hit.nbMCHit;
+						facetHitBuffer->hit.nbHitEquiv += state.tmpCounter[m].hit.nbHitEquiv;
+						facetHitBuffer->hit.sum_1_per_ort_velocity += state.tmpCounter[m].hit.sum_1_per_ort_velocity;
+						facetHitBuffer->hit.sum_v_ort += state.tmpCounter[m].hit.sum_v_ort;
+						facetHitBuffer->hit.sum_1_per_velocity += state.tmpCounter[m].hit.sum_1_per_velocity;
+						facetHitBuffer->hit.covering += state.tmpCounter[m].hit.covering;
+					}
+
+					if (f.sh.isProfile) {
+						for (int m = 0; m < (1 + nbMoments); m++) {
+							ProfileSlice *shProfile = (ProfileSlice *)(buffer + f.sh.hitOffset + facetHitsSize + m * f.profileSize);
+							for (j = 0; j < PROFILE_SIZE; j++) {
+								shProfile[j] += state.profile[m][j];
+							}
 						}
 					}
-				}
 
+					if (f.sh.isTextured) {
+						for (int m = 0; m < (1 + nbMoments); m++) {
+							TextureCell *shTexture = (TextureCell *)(buffer + (f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + m * f.textureSize));
+							for (size_t add = 0; add < f.sh.texWidth*f.sh.texHeight; add++) {
+								//Add temporary hit counts
+								shTexture[add] += state.texture[m][add];
+							}
+						}
+					}
+
+					if (f.sh.countDirection) {
+						for (int m = 0; m < (1 + nbMoments); m++) {
+							DirectionCell *shDir = (DirectionCell *)(buffer + (f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*m));
+							for (y = 0; y < f.sh.texHeight; y++) {
+								for (x = 0; x < f.sh.texWidth; x++) {
+									size_t add = x + y * f.sh.texWidth;
+									shDir[add].dir.x += state.direction[m][add].dir.x;
+									shDir[add].dir.y += state.direction[m][add].dir.y;
+									shDir[add].dir.z += state.direction[m][add].dir.z;
+									//shDir[add].sumSpeed += state.direction[m][add].sumSpeed;
+									shDir[add].count += state.direction[m][add].count;
+								}
+							}
+						}
+					}
+
+					if (f.sh.anglemapParams.record) {
+						size_t *shAngleMap = (size_t *)(buffer + f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*(1 + nbMoments));
+						for (y = 0; y < (f.sh.anglemapParams.thetaLowerRes + f.sh.anglemapParams.thetaHigherRes); y++) {
+							for (x = 0; x < f.sh.anglemapParams.phiWidth; x++) {
+								size_t add = x + y * f.sh.anglemapParams.phiWidth;
+								shAngleMap[add] += state.angleMapPdf[add];
+							}
+						}
+					}
+
+					//Facet histograms
+					for (int m = 0; m < (1 + nbMoments); m++) {
+						BYTE *histCurrentMoment = buffer + f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*(1 + nbMoments) + f.sh.anglemapParams.GetRecordedDataSize() + m * f.sh.facetHistogramParams.GetDataSize();
+						if (f.sh.facetHistogramParams.recordBounce) {
+							double* nbHitsHistogram = (double*)histCurrentMoment;
+							for (size_t i = 0; i < f.sh.facetHistogramParams.GetBounceHistogramSize(); i++) {
+								nbHitsHistogram[i] += state.tmpHistograms[m].nbHitsHistogram[i];
+							}
+						}
+						if (f.sh.facetHistogramParams.recordDistance) {
+							double* distanceHistogram = (double*)(histCurrentMoment + f.sh.facetHistogramParams.GetBouncesDataSize());
+							for (size_t i = 0; i < (f.sh.facetHistogramParams.GetDistanceHistogramSize()); i++) {
+								distanceHistogram[i] += state.tmpHistograms[m].distanceHistogram[i];
+							}
+						}
+						if (f.sh.facetHistogramParams.recordTime) {
+							double* timeHistogram = (double*)(histCurrentMoment + f.sh.facetHistogramParams.GetBouncesDataSize() + f.sh.facetHistogramParams.GetDistanceDataSize());
+							for (size_t i = 0; i < (f.sh.facetHistogramParams.GetTimeHistogramSize()); i++) {
+								timeHistogram[i] += state.tmpHistograms[m].timeHistogram[i];
+							}
+						}
+					}
+				} // End nbThreads
+
+				//Texture autoscale, once all threads are summed
 				if (f.sh.isTextured) {
 					for (int m = 0; m < (1 + nbMoments); m++) {
 						TextureCell *shTexture = (TextureCell *)(buffer + (f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + m * f.textureSize));
@@ -273,9 +360,6 @@ void UpdateMCHits(Dataport *dpHit, int prIdx, size_t nbMoments, DWORD timeout) {
 							for (x = 0; x < f.sh.texWidth; x++) {
 								size_t add = x + y * f.sh.texWidth;
 
-								//Add temporary hit counts
-								shTexture[add] += f.texture[m][add];
-
 								double val[3];  //pre-calculated autoscaling values (Pressure, imp.rate, density)
 
 								val[0] = shTexture[add].sum_v_ort_per_area*timeCorrection; //pressure without dCoef_pressure
@@ -303,61 +387,60 @@ void UpdateMCHits(Dataport *dpHit, int prIdx, size_t nbMoments, DWORD timeout) {
 						}
 					}
 				}
-
-				if (f.sh.countDirection) {
-					for (int m = 0; m < (1 + nbMoments); m++) {
-						DirectionCell *shDir = (DirectionCell *)(buffer + (f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*m));
-						for (y = 0; y < f.sh.texHeight; y++) {
-							for (x = 0; x < f.sh.texWidth; x++) {
-								size_t add = x + y * f.sh.texWidth;
-								shDir[add].dir.x += f.direction[m][add].dir.x;
-								shDir[add].dir.y += f.direction[m][add].dir.y;
-								shDir[add].dir.z += f.direction[m][add].dir.z;
-								//shDir[add].sumSpeed += f.direction[m][add].sumSpeed;
-								shDir[add].count += f.direction[m][add].count;
-							}
-						}
-					}
-				}
-
-				if (f.sh.anglemapParams.record) {
-					size_t *shAngleMap = (size_t *)(buffer + f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*(1 + nbMoments));
-					for (y = 0; y < (f.sh.anglemapParams.thetaLowerRes + f.sh.anglemapParams.thetaHigherRes); y++) {
-						for (x = 0; x < f.sh.anglemapParams.phiWidth; x++) {
-							size_t add = x + y * f.sh.anglemapParams.phiWidth;
-							shAngleMap[add] += f.angleMap.pdf[add];
-						}
-					}
-				}
-
-				//Facet histograms
-				
-					for (int m = 0; m < (1 + nbMoments); m++) {
-						BYTE *histCurrentMoment = buffer + f.sh.hitOffset + facetHitsSize + f.profileSize*(1 + nbMoments) + f.textureSize*(1 + nbMoments) + f.directionSize*(1 + nbMoments) + f.sh.anglemapParams.GetRecordedDataSize() + m * f.sh.facetHistogramParams.GetDataSize();
-						if (f.sh.facetHistogramParams.recordBounce) {
-							double* nbHitsHistogram = (double*)histCurrentMoment;
-							for (size_t i = 0; i < f.sh.facetHistogramParams.GetBounceHistogramSize(); i++) {
-								nbHitsHistogram[i] += f.tmpHistograms[m].nbHitsHistogram[i];
-							}
-						}
-						if (f.sh.facetHistogramParams.recordDistance) {
-							double* distanceHistogram = (double*)(histCurrentMoment + f.sh.facetHistogramParams.GetBouncesDataSize());
-							for (size_t i = 0; i < (f.sh.facetHistogramParams.GetDistanceHistogramSize()); i++) {
-								distanceHistogram[i] += f.tmpHistograms[m].distanceHistogram[i];
-							}
-						}
-						if (f.sh.facetHistogramParams.recordTime) {
-							double* timeHistogram = (double*)(histCurrentMoment + f.sh.facetHistogramParams.GetBouncesDataSize() + f.sh.facetHistogramParams.GetDistanceDataSize());
-							for (size_t i = 0; i < (f.sh.facetHistogramParams.GetTimeHistogramSize()); i++) {
-								timeHistogram[i] += f.tmpHistograms[m].timeHistogram[i];
-							}
-						}
-					}
-				
 			} // End if(hitted)
 		} // End nbFacet
 	} // End nbSuper
 
+	// Extra species and sticking sweep facet counters, same layout as the thread buffers
+	for (const SimulationThread& t : sHandle->threads) {
+		AddFacetCounters((FacetHitBuffer*)(buffer + sHandle->speciesOffset), t.speciesCounters);
+		TextureCell* speciesTextures = (TextureCell*)(buffer + sHandle->speciesTextureOffset);
+		for (size_t i = 0; i < t.speciesTextures.size(); i++)
+			speciesTextures[i] += t.speciesTextures[i];
+		AddFacetCounters((FacetHitBuffer*)(buffer + sHandle->sweepOffset), t.sweepCounters);
+		AddFacetCounters((FacetHitBuffer*)(buffer + sHandle->estimatorOffset), t.estimatorCounters);
+		AdjointResult* adjointBuffer = (AdjointResult*)(buffer + sHandle->adjointOffset);
+		for (size_t i = 0; i < t.adjointCounters.size(); i++) {
+			adjointBuffer[i].nbHitEquiv += t.adjointCounters[i].nbHitEquiv;
+			adjointBuffer[i].transfer += t.adjointCounters[i].transfer;
+			adjointBuffer[i].flux += t.adjointCounters[i].flux;
+		}
+		FacetConvergence* convergenceBuffer = (FacetConvergence*)(buffer + sHandle->watchOffset);
+		for (size_t i = 0; i < t.convergenceStats.size(); i++)
+			convergenceBuffer[i] += t.convergenceStats[i];
+		double* transferLaunched = (double*)(buffer + sHandle->transferOffset);
+		TransferEntry* transferBuffer = (TransferEntry*)(transferLaunched + t.transferLaunched.size());
+		for (size_t i = 0; i < t.transferLaunched.size(); i++)
+			transferLaunched[i] += t.transferLaunched[i];
+		for (size_t i = 0; i < t.transferCounters.size(); i++) {
+			transferBuffer[i].sum += t.transferCounters[i].sum;
+			transferBuffer[i].sumSquares += t.transferCounters[i].sumSquares;
+		}
+	}
+
+	// Covering evolution: current coverings in the constant flow counters (the per-hit counting is replaced) and the finished steps
+	if (!sHandle->coveringIndex.empty()) {
+		for (size_t i = 0; i < sHandle->covering.size(); i++) {
+			FacetHitBuffer* facetHitBuffer = (FacetHitBuffer*)(buffer + sHandle->facetsByGlobalId[sHandle->ep.coveringFacets[i]]->sh.hitOffset);
+			facetHitBuffer->hit.covering = llround(sHandle->covering[i]);
+		}
+		*(llong*)(buffer + sHandle->coveringOffset) = (llong)sHandle->coveringStep;
+		memcpy(buffer + sHandle->coveringOffset + sizeof(llong), sHandle->coveringTimeline.data(), sHandle->coveringTimeline.size() * sizeof(double));
+	}
+
+	// Convergence of the watched facets, on the batches of all subprocesses
+	if (!sHandle->ep.watchFacets.empty()) {
+		FacetConvergence* convergenceBuffer = (FacetConvergence*)(buffer + sHandle->watchOffset);
+		bool allKnown = true;
+		sHandle->maxRelativeError = -1.0;
+		for (size_t i = 0; i < sHandle->ep.watchFacets.size(); i++) {
+			double error = convergenceBuffer[i].MaxRelativeError();
+			if (error < 0.0 || convergenceBuffer[i].absorption.nbBatches < minConvergenceBatches) allKnown = false;
+			sHandle->maxRelativeError = Max(sHandle->maxRelativeError, error);
+		}
+		sHandle->converged = sHandle->ep.targetRelativeError > 0.0 && allKnown && sHandle->maxRelativeError < sHandle->ep.targetRelativeError;
+	}
+
 	//if there were no textures:
 	for (int v = 0; v < 3; v++) {
 		if (gHits->texture_limits[v].min.all == HITMAX) gHits->texture_limits[v].min.all = texture_limits_old[v].min.all;
@@ -383,7 +466,9 @@ void UpdateMCHits(Dataport *dpHit, int prIdx, size_t nbMoments, DWORD timeout) {
 
 void UpdateLog(Dataport * dpLog, DWORD timeout)
 {
-	if (sHandle->tmpParticleLog.size()) {
+	size_t nbLogged = 0;
+	for (const SimulationThread& t : sHandle->threads) nbLogged += t.tmpParticleLog.size();
+	if (nbLogged) {
 #ifdef _DEBUG
 		double t0, t1;
 		t0 = GetTick();
@@ -394,16 +479,19 @@ void UpdateLog(Dataport * dpLog, DWORD timeout)
 		if (!sHandle->lastLogUpdateOK) return;
 
 		size_t* logBuff = (size_t*)dpLog->buff;
-		size_t recordedLogSize = *logBuff;
 		ParticleLoggerItem* logBuff2 = (ParticleLoggerItem*)(logBuff + 1);
 
-		size_t writeNb;
-		if (recordedLogSize > sHandle->ontheflyParams.logLimit) writeNb = 0;
-		else writeNb = Min(sHandle->tmpParticleLog.size(), sHandle->ontheflyParams.logLimit - recordedLogSize);
-		memcpy(&logBuff2[recordedLogSize], &sHandle->tmpParticleLog[0], writeNb * sizeof(ParticleLoggerItem)); //Knowing that vector memories are contigious
-		(*logBuff) += writeNb;
+		for (SimulationThread& t : sHandle->threads) {
+			if (t.tmpParticleLog.empty()) continue;
+			size_t recordedLogSize = *logBuff;
+			size_t writeNb;
+			if (recordedLogSize > sHandle->ontheflyParams.logLimit) writeNb = 0;
+			else writeNb = Min(t.tmpParticleLog.size(), sHandle->ontheflyParams.logLimit - recordedLogSize);
+			memcpy(&logBuff2[recordedLogSize], &t.tmpParticleLog[0], writeNb * sizeof(ParticleLoggerItem)); //Knowing that vector memories are contigious
+			(*logBuff) += writeNb;
+			t.tmpParticleLog.clear();
+		}
 		ReleaseDataport(dpLog);
-		sHandle->tmpParticleLog.clear();
 		extern char* GetSimuStatus();
 		SetState(NULL, GetSimuStatus(), false, true);
 
@@ -419,60 +507,43 @@ void UpdateLog(Dataport * dpLog, DWORD timeout)
 void PerformTeleport(SubprocessFacet *iFacet) {
 
 
-	//Search destination
+	//Destination (facet table and destination indices checked at load)
 	SubprocessFacet *destination;
-	bool found = false;
 	bool revert = false;
 	int destIndex;
 	if (iFacet->sh.teleportDest == -1) {
-		destIndex = sHandle->currentParticle.teleportedFrom;
+		destIndex = tHandle->currentParticle.teleportedFrom;
 		if (destIndex == -1) {
 			/*char err[128];
 			sprintf(err, "Facet %d tried to teleport to the facet where the particle came from, but there is no such facet.", iFacet->globalId + 1);
 			SetErrorSub(err);*/
 			RecordHit(HIT_REF);
-			sHandle->currentParticle.lastHitFacet = iFacet;
+			tHandle->currentParticle.lastHitFacet = iFacet;
 			return; //LEAK
 		}
 	}
 	else destIndex = iFacet->sh.teleportDest - 1;
 
-	//Look in which superstructure is the destination facet:
-	for (size_t i = 0; i < sHandle->sh.nbSuper && (!found); i++) {
-		for (size_t j = 0; j < sHandle->structures[i].facets.size() && (!found); j++) {
-			if (destIndex == sHandle->structures[i].facets[j].globalId) {
-				destination = &(sHandle->structures[i].facets[j]);
-				if (destination->sh.superIdx != -1) {
-					sHandle->currentParticle.structureId = destination->sh.superIdx; //change current superstructure, unless the target is a universal facet
-				}
-				sHandle->currentParticle.teleportedFrom = (int)iFacet->globalId; //memorize where the particle came from
-				found = true;
-			}
-		}
-	}
-	if (!found) {
-		/*char err[128];
-		sprintf(err, "Teleport destination of facet %d not found (facet %d does not exist)", iFacet->globalId + 1, iFacet->sh.teleportDest);
-		SetErrorSub(err);*/
-		RecordHit(HIT_REF);
-		sHandle->currentParticle.lastHitFacet = iFacet;
-		return; //LEAK
+	destination = sHandle->facetsByGlobalId[destIndex];
+	if (destination->sh.superIdx != -1) {
+		tHandle->currentParticle.structureId = destination->sh.superIdx; //change current superstructure, unless the target is a universal facet
 	}
+	tHandle->currentParticle.teleportedFrom = (int)iFacet->globalId; //memorize where the particle came from
 	// Count this hit as a transparent pass
 	RecordHit(HIT_TELEPORTSOURCE);
-	if (/*iFacet->texture && */iFacet->sh.countTrans) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 2.0);
-	if (/*iFacet->direction && */iFacet->sh.countDirection) RecordDirectionVector(iFacet, sHandle->currentParticle.flightTime);
-	ProfileFacet(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 2.0);
+	if (/*iFacet->texture && */iFacet->sh.countTrans) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 2.0);
+	if (/*iFacet->direction && */iFacet->sh.countDirection) RecordDirectionVector(iFacet, tHandle->currentParticle.flightTime);
+	ProfileFacet(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 2.0);
 	LogHit(iFacet);
 	if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
 
 	// Relaunch particle from new facet
-	auto[inTheta, inPhi] = CartesianToPolar(sHandle->currentParticle.direction, iFacet->sh.nU, iFacet->sh.nV, iFacet->sh.N);
+	auto[inTheta, inPhi] = CartesianToPolar(tHandle->currentParticle.direction, iFacet->sh.nU, iFacet->sh.nV, iFacet->sh.N);
 	PolarToCartesian(destination, inTheta, inPhi, false);
 	// Move particle to teleport destination point
-	double u = iFacet->colU;
-	double v = iFacet->colV;
-	sHandle->currentParticle.position = destination->sh.O + u * destination->sh.U + v * destination->sh.V;
+	double u = tHandle->currentParticle.colU;
+	double v = tHandle->currentParticle.colV;
+	tHandle->currentParticle.position = destination->sh.O + u * destination->sh.U + v * destination->sh.V;
 	RecordHit(HIT_TELEPORTDEST);
 	int nbTry = 0;
 	if (!IsInFacet(*destination, u, v)) { //source and destination facets not the same shape, would generate leak
@@ -480,133 +551,248 @@ void PerformTeleport(SubprocessFacet *iFacet) {
 		RecordHit(HIT_ABS);
 		bool found = false;
 		while (!found && nbTry < 1000) {
-			u = rnd();
-			v = rnd();
+			u = tHandle->rnd();
+			v = tHandle->rnd();
 			if (IsInFacet(*destination, u, v)) {
 				found = true;
-				sHandle->currentParticle.position = destination->sh.O + u * destination->sh.U + v * destination->sh.V;
+				tHandle->currentParticle.position = destination->sh.O + u * destination->sh.U + v * destination->sh.V;
 				RecordHit(HIT_DES);
 			}
 		}
 		nbTry++;
 	}
 
-	sHandle->currentParticle.lastHitFacet = destination;
+	tHandle->currentParticle.lastHitFacet = destination;
 
 	//Count hits on teleport facets
 	/*iFacet->sh.tmpCounter.hit.nbAbsEquiv++;
 	destination->sh.tmpCounter.hit.nbDesorbed++;*/
 
-	double ortVelocity = sHandle->currentParticle.velocity*abs(Dot(sHandle->currentParticle.direction, iFacet->sh.N));
+	double ortVelocity = tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, iFacet->sh.N));
 	//We count a teleport as a local hit, but not as a global one since that would affect the MFP calculation
 	/*iFacet->sh.tmpCounter.hit.nbMCHit++;
 	iFacet->sh.tmpCounter.hit.sum_1_per_ort_velocity += 2.0 / ortVelocity;
 	iFacet->sh.tmpCounter.hit.sum_v_ort += 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;*/
-	IncreaseFacetCounter(iFacet, sHandle->currentParticle.flightTime, 1, 0, 0, 2.0 / ortVelocity, 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
-	iFacet->hitted = true;
-	/*destination->sh.tmpCounter.hit.sum_1_per_ort_velocity += 2.0 / sHandle->currentParticle.velocity;
-	destination->sh.tmpCounter.hit.sum_v_ort += sHandle->currentParticle.velocity*abs(DOT3(
-	sHandle->currentParticle.direction.x, sHandle->currentParticle.direction.y, sHandle->currentParticle.direction.z,
+	IncreaseFacetCounter(iFacet, tHandle->currentParticle.flightTime, 1, 0, 0, 2.0 / ortVelocity, 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
+	tHandle->facetStates[iFacet->globalId].hitted = true;
+	/*destination->sh.tmpCounter.hit.sum_1_per_ort_velocity += 2.0 / tHandle->currentParticle.velocity;
+	destination->sh.tmpCounter.hit.sum_v_ort += tHandle->currentParticle.velocity*abs(DOT3(
+	tHandle->currentParticle.direction.x, tHandle->currentParticle.direction.y, tHandle->currentParticle.direction.z,
 	destination->sh.N.x, destination->sh.N.y, destination->sh.N.z));*/
 }
 
 // Perform nbStep simulation steps (a step is a bounce)
 
 bool SimulationMCStep(size_t nbStep) {
+	if (!tHandle->lanes.empty()) return SimulationMCPacketStep(nbStep);
 
 	// Perform simulation steps
 	for (size_t i = 0; i < nbStep; i++) {
 
 		//Prepare output values
-		auto[found, collidedFacet, d] = Intersect(sHandle, sHandle->currentParticle.position, sHandle->currentParticle.direction);
-
-		if (found) {
-
-			// Move particle to intersection point
-			sHandle->currentParticle.position = sHandle->currentParticle.position + d * sHandle->currentParticle.direction;
-			//sHandle->currentParticle.distanceTraveled += d;
-
-			double lastFLightTime = sHandle->currentParticle.flightTime; //memorize for partial hits
-			sHandle->currentParticle.flightTime += d / 100.0 / sHandle->currentParticle.velocity; //conversion from cm to m //anscheinend: [d] = cm
-
-			if ((!sHandle->wp.calcConstantFlow && (sHandle->currentParticle.flightTime > sHandle->wp.latestMoment))
-				|| (sHandle->wp.enableDecay && (sHandle->currentParticle.expectedDecayMoment < sHandle->currentParticle.flightTime))) {
-				//hit time over the measured period - we create a new particle
-				//OR particle has decayed
-				double remainderFlightPath = sHandle->currentParticle.velocity*100.0*
-					Min(sHandle->wp.latestMoment - lastFLightTime, sHandle->currentParticle.expectedDecayMoment - lastFLightTime); //distance until the point in space where the particle decayed
-				sHandle->tmpGlobalResult.distTraveled_total += remainderFlightPath * sHandle->currentParticle.oriRatio;
-				RecordHit(HIT_LAST);
-				//sHandle->distTraveledSinceUpdate += sHandle->currentParticle.distanceTraveled;
-				if (!StartFromSource())
-					// desorptionLimit reached
-					return false;
+		auto[found, collidedFacet, d] = ThreadIntersect(tHandle->currentParticle.position, tHandle->currentParticle.direction);
+		if (!ProcessIntersection(found, collidedFacet, d))
+			// desorptionLimit reached
+			return false;
+	}
+	return true;
+}
+
+bool SimulationMCPacketStep(size_t nbStep) {
+	// The thread's lanes advance together, one packet intersection per step. Each lane is then swapped into
+	// currentParticle to record its event with the scalar code, and refilled by StartFromSource() when its particle ends
+	SimulationThread& thread = *tHandle;
+	RayPacket& packet = thread.packet;
+	for (size_t i = 0; i < nbStep; i++) {
+		packet.nbRays = 0;
+		for (size_t l = 0; l < thread.lanes.size(); l++) {
+			if (thread.lanes[l].particle.lastHitFacet) packet.Add(l, thread.lanes[l].particle);
+		}
+		if (packet.nbRays == 0) return false; //desorptionLimit reached in every lane
+		PacketIntersect(packet);
+		for (size_t r = 0; r < packet.nbRays; r++) {
+			thread.SwapLane(packet.lane[r]);
+			auto[found, collidedFacet, d] = ResolvePacketRay(packet, r);
+			ProcessIntersection(found, collidedFacet, d); //false: lane done, lastHitFacet is NULL
+			thread.SwapLane(packet.lane[r]);
+		}
+		if (thread.lanesWaiting && thread.batchDesorbed < sHandle->ep.batchSize) { //The last lane of the batch closed it
+			thread.lanesWaiting = false;
+			thread.StartParticles();
+		}
+	}
+	return thread.IsRunning();
+}
+
+bool ProcessIntersection(const bool& found, SubprocessFacet* collidedFacet, const double& d) {
+	// Moves the current particle to its next event (hit or leak), false once the desorption limit is reached
+	if (found) {
+
+		// Move particle to intersection point
+		tHandle->currentParticle.position = tHandle->currentParticle.position + d * tHandle->currentParticle.direction;
+		//tHandle->currentParticle.distanceTraveled += d;
+
+		double lastFLightTime = tHandle->currentParticle.flightTime; //memorize for partial hits
+		tHandle->currentParticle.flightTime += d / 100.0 / tHandle->currentParticle.velocity; //conversion from cm to m //anscheinend: [d] = cm
+		for (size_t s = 0; s < sHandle->speciesSpeedFactors.size(); s++)
+			tHandle->currentParticle.speciesFlightTime[s] += d / 100.0 / (tHandle->currentParticle.velocity * sHandle->speciesSpeedFactors[s]);
+		if (!sHandle->isSplitFacet.empty() && sHandle->isSplitFacet[collidedFacet->globalId])
+			tHandle->currentParticle.splitPending = true;
+
+		if ((!sHandle->wp.calcConstantFlow && (tHandle->currentParticle.flightTime > sHandle->wp.latestMoment))
+			|| (sHandle->wp.enableDecay && (tHandle->currentParticle.expectedDecayMoment < tHandle->currentParticle.flightTime))) {
+			//hit time over the measured period - we create a new particle
+			//OR particle has decayed
+			double remainderFlightPath = tHandle->currentParticle.velocity*100.0*
+				Min(sHandle->wp.latestMoment - lastFLightTime, tHandle->currentParticle.expectedDecayMoment - lastFLightTime); //distance until the point in space where the particle decayed
+			tHandle->tmpGlobalResult.distTraveled_total += remainderFlightPath * tHandle->currentParticle.oriRatio;
+			RecordHit(HIT_LAST);
+			//sHandle->distTraveledSinceUpdate += tHandle->currentParticle.distanceTraveled;
+			if (!StartFromSource())
+				// desorptionLimit reached
+				return false;
+		}
+		else { //hit within measured time, particle still alive
+			if (sHandle->adjointTarget) RecordAdjointHit(collidedFacet);
+			if (!sHandle->estimatorIndex.empty() && sHandle->estimatorIndex[collidedFacet->globalId] != -1 && !tHandle->currentParticle.nextEventCovered) {
+				//Analog hit on a forced detection target, not estimated at the last emission
+				RecordEstimator(sHandle->estimatorIndex[collidedFacet->globalId], tHandle->currentParticle.flightTime, tHandle->currentParticle.oriRatio,
+					tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, collidedFacet->sh.N)));
 			}
-			else { //hit within measured time, particle still alive
-				if (collidedFacet->sh.teleportDest != 0) { //Teleport
-					IncreaseDistanceCounters(d * sHandle->currentParticle.oriRatio);
-					PerformTeleport(collidedFacet);
+			if (collidedFacet->sh.teleportDest != 0) { //Teleport
+				IncreaseDistanceCounters(d * tHandle->currentParticle.oriRatio);
+				tHandle->currentParticle.nextEventCovered = false;
+				PerformTeleport(collidedFacet);
+			}
+			/*else if ((GetOpacityAt(collidedFacet, tHandle->currentParticle.flightTime) < 1.0) && (rnd() > GetOpacityAt(collidedFacet, tHandle->currentParticle.flightTime))) {
+				//Transparent pass
+				tHandle->tmpGlobalResult.distTraveled_total += d;
+				PerformTransparentPass(collidedFacet);
+			}*/
+			else { //Not teleport
+				IncreaseDistanceCounters(d * tHandle->currentParticle.oriRatio);
+				double stickingProbability = GetStickingAt(collidedFacet, tHandle->currentParticle.flightTime);
+				const std::vector<double>* sweep = sHandle->sweepStickings.empty() || sHandle->sweepStickings[collidedFacet->globalId].empty() ?
+					NULL : &sHandle->sweepStickings[collidedFacet->globalId];
+				if (!sHandle->ontheflyParams.lowFluxMode) { //Regular stick or bounce
+					double drawProbability = stickingProbability;
+					if (sweep && !(stickingProbability > 0.0 && stickingProbability < 1.0)) {
+						//The base sticking excludes one outcome, which the scenarios may need: draw from the mean of all stickings, the base run weighted too
+						for (const double& s : *sweep) drawProbability += s;
+						drawProbability /= (double)(sweep->size() + 1);
+					}
+					bool stuck = drawProbability == 1.0 || ((drawProbability > 0.0) && (tHandle->rnd() < (drawProbability)));
+					if (sweep) { //Correlated sampling: the scenarios follow the same outcome, weighted by its likelihood ratio
+						double drawn = stuck ? drawProbability : 1.0 - drawProbability; //Not 0 for the drawn outcome
+						tHandle->currentParticle.oriRatio *= (stuck ? stickingProbability : 1.0 - stickingProbability) / drawn;
+						std::vector<double>& scenarioRatio = tHandle->currentParticle.scenarioRatio;
+						for (size_t k = 0; k < scenarioRatio.size(); k++)
+							scenarioRatio[k] *= (stuck ? (*sweep)[k] : 1.0 - (*sweep)[k]) / drawn;
+					}
+					if (stuck) {
+						//Absorbed
+						RecordAbsorb(collidedFacet);
+						//sHandle->distTraveledSinceUpdate += tHandle->currentParticle.distanceTraveled;
+						if (!StartFromSource())
+							// desorptionLimit reached
+							return false;
+					}
+					else {
+						//Reflected
+						PerformBounce(collidedFacet);
+					}
 				}
-				/*else if ((GetOpacityAt(collidedFacet, sHandle->currentParticle.flightTime) < 1.0) && (rnd() > GetOpacityAt(collidedFacet, sHandle->currentParticle.flightTime))) {
-					//Transparent pass
-					sHandle->tmpGlobalResult.distTraveled_total += d;
-					PerformTransparentPass(collidedFacet);
-				}*/
-				else { //Not teleport
-					IncreaseDistanceCounters(d * sHandle->currentParticle.oriRatio);
-					double stickingProbability = GetStickingAt(collidedFacet, sHandle->currentParticle.flightTime);
-					if (!sHandle->ontheflyParams.lowFluxMode) { //Regular stick or bounce
-						if (stickingProbability == 1.0 || ((stickingProbability > 0.0) && (rnd() < (stickingProbability)))) {
-							//Absorbed
-							RecordAbsorb(collidedFacet);
-							//sHandle->distTraveledSinceUpdate += sHandle->currentParticle.distanceTraveled;
-							if (!StartFromSource())
-								// desorptionLimit reached
-								return false;
+				else { //Low flux mode: sticking and reflected parts, the scenarios differ only in their weights
+					std::vector<double>& scenarioRatio = tHandle->currentParticle.scenarioRatio;
+					double maxRatio = 0.0;
+					if (stickingProbability > 0.0 || sweep) {
+						double oriRatioBeforeCollision = tHandle->currentParticle.oriRatio; //Local copy
+						tHandle->currentParticle.scenarioRatioBeforeCollision = scenarioRatio;
+						tHandle->currentParticle.oriRatio *= (stickingProbability); //Sticking part
+						bool absorbed = tHandle->currentParticle.oriRatio > 0.0;
+						for (size_t k = 0; k < scenarioRatio.size(); k++) {
+							scenarioRatio[k] *= sweep ? (*sweep)[k] : stickingProbability;
+							if (scenarioRatio[k] > 0.0) absorbed = true;
 						}
-						else {
-							//Reflected
-							PerformBounce(collidedFacet);
+						if (absorbed) RecordAbsorb(collidedFacet); //Not for a swept facet with zero sticking in every scenario
+						tHandle->currentParticle.oriRatio = oriRatioBeforeCollision * (1.0 - stickingProbability); //Reflected part
+						for (size_t k = 0; k < scenarioRatio.size(); k++) {
+							scenarioRatio[k] = tHandle->currentParticle.scenarioRatioBeforeCollision[k] * (1.0 - (sweep ? (*sweep)[k] : stickingProbability));
+							maxRatio = Max(maxRatio, scenarioRatio[k]);
 						}
 					}
-					else { //Low flux mode
-						if (stickingProbability > 0.0) {
-							double oriRatioBeforeCollision = sHandle->currentParticle.oriRatio; //Local copy
-							sHandle->currentParticle.oriRatio *= (stickingProbability); //Sticking part
-							RecordAbsorb(collidedFacet);
-							sHandle->currentParticle.oriRatio = oriRatioBeforeCollision * (1.0 - stickingProbability); //Reflected part
-						}
-						else
-							sHandle->currentParticle.oriRatio *= (1.0 - stickingProbability);
-						if (sHandle->currentParticle.oriRatio > sHandle->ontheflyParams.lowFluxCutoff) {
-							PerformBounce(collidedFacet);
-						}
-						else { //eliminate remainder and create new particle
-							if (!StartFromSource())
-								// desorptionLimit reached
-								return false;
-						}
+					else {
+						tHandle->currentParticle.oriRatio *= (1.0 - stickingProbability);
+						for (const double& r : scenarioRatio) maxRatio = Max(maxRatio, r);
+					}
+					double weight = Max(tHandle->currentParticle.oriRatio, maxRatio);
+					bool alive = (sHandle->ep.rouletteThreshold > 0.0) ? (weight >= sHandle->ep.rouletteThreshold || PlayRoulette(weight))
+						: (weight > sHandle->ontheflyParams.lowFluxCutoff);
+					if (alive) {
+						PerformBounce(collidedFacet);
+					}
+					else { //eliminate remainder and create new particle
+						if (!StartFromSource())
+							// desorptionLimit reached
+							return false;
 					}
 				}
-			} //end hit within measured time
-		} //end intersection found
-		else {
-			// No intersection found: Leak
-			sHandle->tmpGlobalResult.nbLeakTotal++;
-			RecordLeakPos();
-			if (!StartFromSource())
-				// desorptionLimit reached
-				return false;
-		}
+			}
+		} //end hit within measured time
+		if (tHandle->currentParticle.splitPending) SplitParticle(); //Crossed a splitting facet (or a link, teleport) and still alive
+	} //end intersection found
+	else {
+		// No intersection found: Leak
+		tHandle->tmpGlobalResult.nbLeakTotal++;
+		RecordLeakPos();
+		if (!StartFromSource())
+			// desorptionLimit reached
+			return false;
 	}
 	return true;
 }
 
 void IncreaseDistanceCounters(double distanceIncrement)
 {
-	sHandle->tmpGlobalResult.distTraveled_total += distanceIncrement;
-	sHandle->tmpGlobalResult.distTraveledTotal_fullHitsOnly += distanceIncrement;
-	sHandle->currentParticle.distanceTraveled += distanceIncrement;
+	tHandle->tmpGlobalResult.distTraveled_total += distanceIncrement;
+	tHandle->tmpGlobalResult.distTraveledTotal_fullHitsOnly += distanceIncrement;
+	tHandle->currentParticle.distanceTraveled += distanceIncrement;
+}
+
+bool PlayRoulette(double weight) {
+	// Russian roulette: survive with probability weight/threshold and carry the threshold weight, unbiased
+	double threshold = sHandle->ep.rouletteThreshold;
+	if (tHandle->rnd() * threshold < weight) {
+		double scale = threshold / weight;
+		tHandle->currentParticle.oriRatio *= scale;
+		for (double& r : tHandle->currentParticle.scenarioRatio) r *= scale;
+		return true;
+	}
+	tHandle->nbRouletteKilled++;
+	return false;
+}
+
+void SplitParticle(SubprocessFacet *reflectionFacet) {
+	// Split into splitFactor copies sharing the weight. Copies must stay above the roulette threshold
+	// (or the low flux cutoff), otherwise they would be killed again right away.
+	// reflectionFacet: split during a bounce, the copies draw their own reflection off it when resumed
+	CurrentParticleStatus& particle = tHandle->currentParticle;
+	particle.splitPending = false;
+	size_t n = sHandle->ep.splitFactor;
+	double weight = particle.oriRatio;
+	for (const double& r : particle.scenarioRatio) weight = Max(weight, r);
+	double lowerBound = (sHandle->ep.rouletteThreshold > 0.0) ? sHandle->ep.rouletteThreshold : sHandle->ontheflyParams.lowFluxCutoff;
+	if (weight / (double)n < lowerBound || tHandle->splitParticles.size() + n - 1 > maxPendingSplits) return;
+
+	particle.oriRatio /= (double)n;
+	for (double& r : particle.scenarioRatio) r /= (double)n;
+	CurrentParticleStatus copy = particle;
+	copy.pendingReflection = reflectionFacet;
+	copy.transferOriginal = false; //Scored as a trajectory of its own, the molecule is launched once
+	copy.transferScores.clear();
+	for (size_t i = 1; i < n; i++)
+		tHandle->splitParticles.push_back(copy);
+	tHandle->nbSplit += n - 1;
 }
 
 // Launch a ray from a source facet. The ray 
@@ -618,99 +804,91 @@ bool StartFromSource() {
 	bool reverse;
 	size_t mapPositionW, mapPositionH;
 	SubprocessFacet *src = NULL;
-	double srcRnd;
-	double sumA = 0.0;
-	int i = 0, j = 0;
 	int nbTry = 0;
 
-	// Check end of simulation
-	if (sHandle->ontheflyParams.desorptionLimit > 0) {
-		if (sHandle->totalDesorbed >= sHandle->ontheflyParams.desorptionLimit / sHandle->ontheflyParams.nbProcess) {
-			sHandle->currentParticle.lastHitFacet = NULL;
-			return false;
+	if (tHandle->currentParticle.transferRow != -1) FlushTransferScores(); //Trajectory over
+
+	// Copies left by splitting are finished first, they belong to a particle already desorbed
+	tHandle->currentParticle.splitPending = false;
+	tHandle->currentParticle.nextEventCovered = false;
+	if (!tHandle->splitParticles.empty()) {
+		tHandle->currentParticle = std::move(tHandle->splitParticles.back());
+		tHandle->splitParticles.pop_back();
+		if (SubprocessFacet *reflectionFacet = tHandle->currentParticle.pendingReflection) {
+			tHandle->currentParticle.pendingReflection = NULL;
+			PerformReflection(reflectionFacet);
 		}
+		return true;
 	}
 
-	// Select source
-	srcRnd = rnd() * sHandle->wp.totalDesorbedMolecules;
-
-	while (!found && j < sHandle->sh.nbSuper) { //Go through superstructures
-		i = 0;
-		while (!found && i < sHandle->structures[j].facets.size()) { //Go through facets in a structure
-			SubprocessFacet& f = sHandle->structures[j].facets[i];
-			if (f.sh.desorbType != DES_NONE) { //there is some kind of outgassing
-				if (f.sh.useOutgassingFile) { //Using SynRad-generated outgassing map
-					if (f.sh.totalOutgassing > 0.0) {
-						found = (srcRnd >= sumA) && (srcRnd < (sumA + sHandle->wp.latestMoment * f.sh.totalOutgassing / (1.38E-23*f.sh.temperature)));
-						if (found) {
-							//look for exact position in map
-							double rndRemainder = (srcRnd - sumA) / sHandle->wp.latestMoment*(1.38E-23*f.sh.temperature); //remainder, should be less than f.sh.totalOutgassing
-							/*double sumB = 0.0;
-							for (w = 0; w < f.sh.outgassingMapWidth && !foundInMap; w++) {
-								for (h = 0; h < f.sh.outgassingMapHeight && !foundInMap; h++) {
-									double cellOutgassing = f.outgassingMap[h*f.sh.outgassingMapWidth + w];
-									if (cellOutgassing > 0.0) {
-										foundInMap = (rndRemainder >= sumB) && (rndRemainder < (sumB + cellOutgassing));
-										if (foundInMap) mapPositionW = w; mapPositionH = h;
-										sumB += cellOutgassing;
-									}
-								}
-							}*/
-							double lookupValue = rndRemainder;
-							int outgLowerIndex = my_lower_bound(lookupValue, f.outgassingMap); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
-							outgLowerIndex++;
-							mapPositionH = (size_t)((double)outgLowerIndex / (double)f.sh.outgassingMapWidth);
-							mapPositionW = (size_t)outgLowerIndex - mapPositionH * f.sh.outgassingMapWidth;
-							foundInMap = true;
-							/*if (!foundInMap) {
-								SetErrorSub("Starting point not found in imported desorption map");
-								return false;
-							}*/
-						}
-						sumA += sHandle->wp.latestMoment * f.sh.totalOutgassing / (1.38E-23*f.sh.temperature);
-					}
-				} //end outgassing file block
-				else { //constant or time-dependent outgassing
-					double facetOutgassing =
-						(f.sh.outgassing_paramId >= 0)
-						? sHandle->IDs[f.sh.IDid].back().second / (1.38E-23*f.sh.temperature)
-						: sHandle->wp.latestMoment*f.sh.outgassing / (1.38E-23*f.sh.temperature);
-					found = (srcRnd >= sumA) && (srcRnd < (sumA + facetOutgassing));
-					sumA += facetOutgassing;
-				} //end constant or time-dependent outgassing block
-			} //end 'there is some kind of outgassing'
-			if (!found) i++;
-			if (f.sh.is2sided) reverse = rnd() > 0.5;
-			else reverse = false;
-		}
-		if (!found) j++;
+	// Packet mode: a full batch is closed only once the particles of all lanes have ended, this lane waits meanwhile
+	if (!sHandle->watchIndex.empty() && tHandle->batchDesorbed == sHandle->ep.batchSize && tHandle->OtherLanesInFlight()) {
+		tHandle->currentParticle.lastHitFacet = NULL;
+		tHandle->lanesWaiting = true;
+		return true;
 	}
-	if (!found) {
-		SetErrorSub("No starting point, aborting");
+
+	// Check end of simulation
+	llong particleIndex;
+	if (!tHandle->ClaimParticle(particleIndex)) {
+		tHandle->currentParticle.lastHitFacet = NULL;
 		return false;
 	}
-	src = &(sHandle->structures[j].facets[i]);
+	// Random stream of this particle (same stream whichever thread traces it)
+	tHandle->random.SetParticle((uint64_t)particleIndex);
 
-	sHandle->currentParticle.lastHitFacet = src;
-	//sHandle->currentParticle.distanceTraveled = 0.0;  //for mean free path calculations
-	//sHandle->currentParticle.flightTime = sHandle->desorptionStartTime + (sHandle->desorptionStopTime - sHandle->desorptionStartTime)*rnd();
-	sHandle->currentParticle.flightTime = GenerateDesorptionTime(src);
-	if (sHandle->wp.useMaxwellDistribution) sHandle->currentParticle.velocity = GenerateRandomVelocity(src->sh.CDFid);
-	else sHandle->currentParticle.velocity = 145.469*sqrt(src->sh.temperature / sHandle->wp.gasMass);  //sqrt(8*R/PI/1000)=145.47
-	sHandle->currentParticle.oriRatio = 1.0;
+	// Select source (alias table built in LoadSimulation, weights are the desorbed molecules of each facet)
+	bool forcedSource = sHandle->adjointTarget || !sHandle->transferIndex.empty(); //Cosine law, regardless of the facet's own desorption
+	if (sHandle->adjointTarget) { //Adjoint mode: every particle starts from the target, cosine law
+		src = sHandle->adjointTarget;
+	}
+	else if (forcedSource) { //Transfer matrix mode: the transfer facets in turn
+		size_t row = (size_t)(particleIndex % (llong)sHandle->ep.transferFacets.size());
+		src = sHandle->facetsByGlobalId[sHandle->ep.transferFacets[row]];
+		tHandle->currentParticle.transferRow = (int)row;
+		tHandle->currentParticle.transferOriginal = true;
+	}
+	else {
+		if (sHandle->sourceFacets.empty()) {
+			SetErrorSub("No starting point, aborting");
+			return false;
+		}
+		src = sHandle->sourceFacets[sHandle->sourceTable.Sample(tHandle->rnd())];
+	}
+	int desorbType = forcedSource ? DES_COSINE : src->sh.desorbType;
+
+	if (src->sh.useOutgassingFile && !forcedSource) { //Using SynRad-generated outgassing map
+		//look for exact position in map
+		size_t outgIndex = src->outgassingMapTable.Sample(tHandle->rnd());
+		mapPositionH = outgIndex / src->sh.outgassingMapWidth;
+		mapPositionW = outgIndex - mapPositionH * src->sh.outgassingMapWidth;
+		foundInMap = true;
+	}
+	if (src->sh.is2sided) reverse = tHandle->rnd() > 0.5;
+	else reverse = false;
+
+	tHandle->currentParticle.lastHitFacet = src;
+	//tHandle->currentParticle.distanceTraveled = 0.0;  //for mean free path calculations
+	//tHandle->currentParticle.flightTime = sHandle->desorptionStartTime + (sHandle->desorptionStopTime - sHandle->desorptionStartTime)*rnd();
+	tHandle->currentParticle.flightTime = GenerateDesorptionTime(src);
+	std::fill(tHandle->currentParticle.speciesFlightTime.begin(), tHandle->currentParticle.speciesFlightTime.end(), tHandle->currentParticle.flightTime);
+	if (sHandle->wp.useMaxwellDistribution) tHandle->currentParticle.velocity = GenerateRandomVelocity(src->sh.CDFid);
+	else tHandle->currentParticle.velocity = 145.469*sqrt(src->sh.temperature / sHandle->wp.gasMass);  //sqrt(8*R/PI/1000)=145.47
+	tHandle->currentParticle.oriRatio = 1.0;
+	std::fill(tHandle->currentParticle.scenarioRatio.begin(), tHandle->currentParticle.scenarioRatio.end(), 1.0);
 	if (sHandle->wp.enableDecay) { //decaying gas
-		sHandle->currentParticle.expectedDecayMoment = sHandle->currentParticle.flightTime + sHandle->wp.halfLife*1.44269*-log(rnd()); //1.44269=1/ln2
+		tHandle->currentParticle.expectedDecayMoment = tHandle->currentParticle.flightTime + sHandle->wp.halfLife*1.44269*-log(tHandle->rnd()); //1.44269=1/ln2
 		//Exponential distribution PDF: probability of 't' life = 1/TAU*exp(-t/TAU) where TAU = half_life/ln2
 		//Exponential distribution CDF: probability of life shorter than 't" = 1-exp(-t/TAU)
 		//Equation: rnd()=1-exp(-t/TAU)
 		//Solution: t=TAU*-log(1-rnd()) and 1-rnd()=rnd() therefore t=half_life/ln2*-log(rnd())
 	}
 	else {
-		sHandle->currentParticle.expectedDecayMoment = 1e100; //never decay
+		tHandle->currentParticle.expectedDecayMoment = 1e100; //never decay
 	}
 	//sHandle->temperature = src->sh.temperature; //Thermalize particle
-	sHandle->currentParticle.nbBounces = 0;
-	sHandle->currentParticle.distanceTraveled = 0;
+	tHandle->currentParticle.nbBounces = 0;
+	tHandle->currentParticle.distanceTraveled = 0;
 
 	found = false; //Starting point within facet
 
@@ -721,31 +899,31 @@ bool StartFromSource() {
 		if (foundInMap) {
 			if (mapPositionW < (src->sh.outgassingMapWidth - 1)) {
 				//Somewhere in the middle of the facet
-				u = ((double)mapPositionW + rnd()) / src->outgassingMapWidthD;
+				u = ((double)mapPositionW + tHandle->rnd()) / src->outgassingMapWidthD;
 			}
 			else {
 				//Last element, prevent from going out of facet
-				u = ((double)mapPositionW + rnd() * (src->outgassingMapWidthD - (src->sh.outgassingMapWidth - 1))) / src->outgassingMapWidthD;
+				u = ((double)mapPositionW + tHandle->rnd() * (src->outgassingMapWidthD - (src->sh.outgassingMapWidth - 1))) / src->outgassingMapWidthD;
 			}
 			if (mapPositionH < (src->sh.outgassingMapHeight - 1)) {
 				//Somewhere in the middle of the facet
-				v = ((double)mapPositionH + rnd()) / src->outgassingMapHeightD;
+				v = ((double)mapPositionH + tHandle->rnd()) / src->outgassingMapHeightD;
 			}
 			else {
 				//Last element, prevent from going out of facet
-				v = ((double)mapPositionH + rnd() * (src->outgassingMapHeightD - (src->sh.outgassingMapHeight - 1))) / src->outgassingMapHeightD;
+				v = ((double)mapPositionH + tHandle->rnd() * (src->outgassingMapHeightD - (src->sh.outgassingMapHeight - 1))) / src->outgassingMapHeightD;
 			}
 		}
 		else {
-			u = rnd();
-			v = rnd();
+			u = tHandle->rnd();
+			v = tHandle->rnd();
 		}
 		if (IsInFacet(*src, u, v)) {
 
 			// (U,V) -> (x,y,z)
-			sHandle->currentParticle.position = src->sh.O + u * src->sh.U + v * src->sh.V;
-			src->colU = u;
-			src->colV = v;
+			tHandle->currentParticle.position = src->sh.O + u * src->sh.U + v * src->sh.V;
+			tHandle->currentParticle.colU = u;
+			tHandle->currentParticle.colV = v;
 			found = true;
 
 		}
@@ -759,14 +937,14 @@ bool StartFromSource() {
 			//double vLength = sqrt(pow(src->sh.V.x, 2) + pow(src->sh.V.y, 2) + pow(src->sh.V.z, 2));
 			double u = ((double)mapPositionW + 0.5) / src->outgassingMapWidthD;
 			double v = ((double)mapPositionH + 0.5) / src->outgassingMapHeightD;
-			sHandle->currentParticle.position = src->sh.O + u * src->sh.U + v * src->sh.V;
-			src->colU = u;
-			src->colV = v;
+			tHandle->currentParticle.position = src->sh.O + u * src->sh.U + v * src->sh.V;
+			tHandle->currentParticle.colU = u;
+			tHandle->currentParticle.colV = v;
 		}
 		else {
-			src->colU = 0.5;
-			src->colV = 0.5;
-			sHandle->currentParticle.position = sHandle->structures[j].facets[i].sh.center;
+			tHandle->currentParticle.colU = 0.5;
+			tHandle->currentParticle.colV = 0.5;
+			tHandle->currentParticle.position = src->sh.center;
 		}
 
 	}
@@ -775,21 +953,22 @@ bool StartFromSource() {
 	else RecordHit(HIT_DES); //create blue hit point for created particle
 
 	//See docs/theta_gen.png for further details on angular distribution generation
-	switch (src->sh.desorbType) {
+	switch (desorbType) {
 	case DES_UNIFORM:
-		sHandle->currentParticle.direction = PolarToCartesian(src, acos(rnd()), rnd()*2.0*PI, reverse);
+		tHandle->currentParticle.direction = PolarToCartesian(src, acos(tHandle->rnd()), tHandle->rnd()*2.0*PI, reverse);
 		break;
 	case DES_NONE: //for file-based
 	case DES_COSINE:
-		sHandle->currentParticle.direction = PolarToCartesian(src, acos(sqrt(rnd())), rnd()*2.0*PI, reverse);
+		tHandle->currentParticle.direction = PolarToCartesian(src, acos(sqrt(tHandle->rnd())), tHandle->rnd()*2.0*PI, reverse);
 		break;
 	case DES_COSINE_N:
-		sHandle->currentParticle.direction = PolarToCartesian(src, acos(pow(rnd(), 1.0 / (src->sh.desorbTypeN + 1.0))), rnd()*2.0*PI, reverse);
+		tHandle->currentParticle.direction = PolarToCartesian(src, acos(pow(tHandle->rnd(), 1.0 / (src->sh.desorbTypeN + 1.0))), tHandle->rnd()*2.0*PI, reverse);
 		break;
 	case DES_ANGLEMAP:
 	{
-		auto [theta, thetaLowerIndex, thetaOvershoot] = src->angleMap.GenerateThetaFromAngleMap(src->sh.anglemapParams);
-		auto phi = src->angleMap.GeneratePhiFromAngleMap(thetaLowerIndex, thetaOvershoot, src->sh.anglemapParams);
+		double r1 = tHandle->rnd();
+		double r2 = tHandle->rnd();
+		auto [theta, phi] = src->angleMap.SampleInverse(r1, r2, src->sh.anglemapParams);
 		/*
 
 		size_t angleMapSum = src->angleMapLineSums[(src->sh.anglemapParams.thetaLowerRes + src->sh.anglemapParams.thetaHigherRes) - 1];
@@ -881,8 +1060,8 @@ bool StartFromSource() {
 
 		/////////////////////////////
 		*/
-		sHandle->currentParticle.direction = PolarToCartesian(src, PI - theta, phi, false); //angle map contains incident angle (between N and source dir) and theta is dir (between N and dest dir)
-		_ASSERTE(sHandle->currentParticle.direction.x == sHandle->currentParticle.direction.x);
+		tHandle->currentParticle.direction = PolarToCartesian(src, PI - theta, phi, false); //angle map contains incident angle (between N and source dir) and theta is dir (between N and dest dir)
+		_ASSERTE(tHandle->currentParticle.direction.x == tHandle->currentParticle.direction.x);
 
 	}
 	}
@@ -894,48 +1073,131 @@ bool StartFromSource() {
 		SetErrorSub(out.str().c_str());
 		return false;
 	}
-	sHandle->currentParticle.structureId = src->sh.superIdx;
-	sHandle->currentParticle.teleportedFrom = -1;
+	tHandle->currentParticle.structureId = src->sh.superIdx;
+	tHandle->currentParticle.teleportedFrom = -1;
 
 	// Count
 
-	src->hitted = true;
-	sHandle->totalDesorbed++;
-	sHandle->tmpGlobalResult.globalHits.hit.nbDesorbed++;
+	tHandle->facetStates[src->globalId].hitted = true;
+	if (!sHandle->watchIndex.empty() && tHandle->batchDesorbed == sHandle->ep.batchSize) CloseBatch();
+	tHandle->batchDesorbed++;
+	tHandle->totalDesorbed++;
+	tHandle->tmpGlobalResult.globalHits.hit.nbDesorbed++;
 	//sHandle->nbPHit = 0;
 
 	if (src->sh.isMoving) {
 		TreatMovingFacet();
 	}
 
-	double ortVelocity = sHandle->currentParticle.velocity*abs(Dot(sHandle->currentParticle.direction, src->sh.N));
+	double ortVelocity = tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, src->sh.N));
 	/*src->sh.tmpCounter.hit.nbDesorbed++;
 	src->sh.tmpCounter.hit.sum_1_per_ort_velocity += 2.0 / ortVelocity; //was 2.0 / ortV
 	src->sh.tmpCounter.hit.sum_v_ort += (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;*/
-	IncreaseFacetCounter(src, sHandle->currentParticle.flightTime, 0, 1, 0, 2.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
+	IncreaseFacetCounter(src, tHandle->currentParticle.flightTime, 0, 1, 0, 2.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
 	//Desorption doesn't contribute to angular profiles, nor to angle maps
-	ProfileFacet(src, sHandle->currentParticle.flightTime, false, 2.0, 1.0); //was 2.0, 1.0
+	ProfileFacet(src, tHandle->currentParticle.flightTime, false, 2.0, 1.0); //was 2.0, 1.0
 	LogHit(src);
-	if (/*src->texture && */src->sh.countDes) RecordHitOnTexture(src, sHandle->currentParticle.flightTime, true, 2.0, 1.0); //was 2.0, 1.0
-	//if (src->direction && src->sh.countDirection) RecordDirectionVector(src, sHandle->currentParticle.flightTime);
-
-	// Reset volatile state
-	if (sHandle->hasVolatile) {
-		for (auto& s : sHandle->structures) {
-			for (auto& f : s.facets) {
-				f.ready = true;
-			}
-		}
+	if (/*src->texture && */src->sh.countDes) RecordHitOnTexture(src, tHandle->currentParticle.flightTime, true, 2.0, 1.0); //was 2.0, 1.0
+	//if (src->direction && src->sh.countDirection) RecordDirectionVector(src, tHandle->currentParticle.flightTime);
+
+	// Reset volatile state (only the facets triggered by the previous trajectory)
+	for (const size_t& id : tHandle->triggeredVolatiles) {
+		tHandle->facetStates[id].ready = true;
 	}
+	tHandle->triggeredVolatiles.clear();
+
+	if (!sHandle->estimatorFacets.empty() && (desorbType == DES_COSINE || desorbType == DES_NONE)) RecordNextEvent(src);
 
 	found = false;
 	return true;
 }
 
-std::tuple<double, int, double> Anglemap::GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams)
+void RecordNextEvent(SubprocessFacet *src) {
+	// Forced detection after a diffuse (cosine law) emission from src: expected number of hits on each target
+	// before the next hard hit, estimated with one uniform point of the target's U,V parallelogram and a shadow ray.
+	// Analog hits on the targets are then skipped until the next emission (nextEventCovered)
+	CurrentParticleStatus& particle = tHandle->currentParticle;
+	particle.nextEventCovered = true;
+	double side = (Dot(particle.direction, src->sh.N) > 0.0) ? 1.0 : -1.0; //Emission hemisphere
+	for (size_t i = 0; i < sHandle->estimatorFacets.size(); i++) {
+		SubprocessFacet* target = sHandle->estimatorFacets[i];
+		if (target == src || (target->sh.superIdx != -1 && target->sh.superIdx != (int)particle.structureId)) continue;
+		double u = tHandle->rnd();
+		double v = tHandle->rnd();
+		if (!target->IsInside(u, v)) continue;
+		Vector3d toTarget = target->sh.O + u * target->sh.U + v * target->sh.V - particle.position;
+		double r = toTarget.Norme();
+		if (r == 0.0) continue;
+		Vector3d dir = (1.0 / r) * toTarget;
+		double cosSource = side * Dot(dir, src->sh.N);
+		double cosTarget = Dot(dir, target->sh.N);
+		if (cosSource <= 0.0 || (!target->sh.is2sided && cosTarget >= 0.0)) continue; //Not emitted that way or target seen from the back
+		double arrivalTime = particle.flightTime + r / 100.0 / particle.velocity;
+		if ((!sHandle->wp.calcConstantFlow && arrivalTime > sHandle->wp.latestMoment)
+			|| (sHandle->wp.enableDecay && particle.expectedDecayMoment < arrivalTime)) continue;
+		double transmission = ThreadTransmission(particle.position, dir, r, src, target);
+		if (transmission == 0.0) continue;
+		double probability = target->sh.Nuv.Norme() * cosSource * abs(cosTarget) / (PI * r * r) * transmission;
+		RecordEstimator(i, arrivalTime, particle.oriRatio * probability, particle.velocity * abs(cosTarget));
+	}
+}
+
+void RecordAdjointHit(SubprocessFacet *f) {
+	// Reciprocity: an adjoint particle arriving on f stands for the forward paths emitted from f that reach the target
+	double scale = sHandle->adjointScale[f->globalId];
+	if (scale == 0.0) return;
+	AdjointResult& result = tHandle->adjointCounters[f->globalId];
+	result.nbHitEquiv += tHandle->currentParticle.oriRatio;
+	result.transfer += tHandle->currentParticle.oriRatio * scale;
+	result.flux += tHandle->currentParticle.oriRatio * scale * sHandle->adjointSourceRate[f->globalId];
+}
+
+void RecordEstimator(size_t targetIndex, double time, double weight, double ortVelocity) {
+	// Incoming flux on a target only (hits, 1/v_ort, v_ort, 1/v): outgoing part depends on the target's own sticking
+	tHandle->FindActiveMoments(time, tHandle->estimatorMoments);
+	FacetHitBuffer* counters = &tHandle->estimatorCounters[targetIndex * (1 + sHandle->moments.size())];
+	for (const size_t& m : tHandle->estimatorMoments) {
+		counters[m].hit.nbMCHit++;
+		counters[m].hit.nbHitEquiv += weight;
+		counters[m].hit.sum_1_per_ort_velocity += weight / ortVelocity;
+		counters[m].hit.sum_v_ort += weight * (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;
+		counters[m].hit.sum_1_per_velocity += weight / tHandle->currentParticle.velocity;
+	}
+}
+
+std::pair<double, double> Anglemap::SampleInverse(const double& r1, const double& r2, const AnglemapParams& anglemapParams)
 {
-	double lookupValue = rnd();
-	int thetaLowerIndex = my_lower_bound(lookupValue, theta_CDF); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
+	// Exact inversion by the generators, their CDF searches started from the guide tables
+	auto [theta, thetaLowerIndex, thetaOvershoot] = GenerateThetaFromAngleMap(anglemapParams, r1);
+	return { theta, GeneratePhiFromAngleMap(thetaLowerIndex, thetaOvershoot, anglemapParams, r2) };
+}
+
+int Anglemap::FindThetaLowerIndex(const double& lookupValue)
+{
+	// Same result as my_lower_bound: last theta_CDF index below lookupValue, -1 if none
+	if (thetaGuide.empty()) return my_lower_bound(lookupValue, theta_CDF);
+	int i = thetaGuide[Min((size_t)(lookupValue * (double)thetaGuide.size()), thetaGuide.size() - 1)];
+	while (i + 1 < (int)theta_CDF.size() && theta_CDF[i + 1] < lookupValue) i++;
+	return i;
+}
+
+int Anglemap::FindPhiLowerIndex(const double& lookupValue, const double& weigh, const size_t& line1, const size_t& line2, const AnglemapParams& anglemapParams)
+{
+	// Same result as weighed_lower_bound_X (my_lower_bound if line1==line2) on the blended CDF (1-weigh)*line1 + weigh*line2.
+	// Below both lines' guide entries the blend is below lookupValue too, so the walk starts at the smaller one
+	size_t width = anglemapParams.phiWidth;
+	const double* cdf1 = &phi_CDFs[line1 * width];
+	const double* cdf2 = &phi_CDFs[line2 * width];
+	if (phiGuide.empty()) return (line1 == line2) ? my_lower_bound(lookupValue, cdf1, width) : weighed_lower_bound_X(lookupValue, weigh, cdf1, cdf2, width);
+	size_t g = Min((size_t)(lookupValue * (double)phiGuideCells), phiGuideCells - 1); //Lookup values can exceed 1 (periodic shift)
+	int k = Min(phiGuide[line1 * phiGuideCells + g], phiGuide[line2 * phiGuideCells + g]);
+	while (k + 1 < (int)width && Weigh(cdf1[k + 1], cdf2[k + 1], weigh) < lookupValue) k++;
+	return k;
+}
+
+std::tuple<double, int, double> Anglemap::GenerateThetaFromAngleMap(const AnglemapParams& anglemapParams, double lookupValue)
+{
+	int thetaLowerIndex = FindThetaLowerIndex(lookupValue); //returns line number AFTER WHICH LINE lookup value resides in ( -1 .. size-2 )
 	double theta, thetaOvershoot;
 
 	if (thetaLowerIndex == -1) { //first half section
@@ -981,20 +1243,19 @@ std::tuple<double, int, double> Anglemap::GenerateThetaFromAngleMap(const Anglem
 	return { theta, thetaLowerIndex, thetaOvershoot };
 }
 
-double Anglemap::GeneratePhiFromAngleMap(const int & thetaLowerIndex, const double & thetaOvershoot, const AnglemapParams & anglemapParams)
+double Anglemap::GeneratePhiFromAngleMap(const int & thetaLowerIndex, const double & thetaOvershoot, const AnglemapParams & anglemapParams, double lookupValue)
 {
-	double lookupValue = rnd();
 	if (anglemapParams.phiWidth == 1) return -PI + 2.0 * PI * lookupValue; //special case, uniform phi distribution
 	int phiLowerIndex;
 	double weigh; //0: take previous theta line, 1: take next theta line, 0..1: interpolate in-between
 	if (thetaLowerIndex == -1) { //first theta half section
 		lookupValue += phi_CDFs[0]; //periodic BCs over -PI...PI, can be larger than 1
-		phiLowerIndex = my_lower_bound(lookupValue, &phi_CDFs[0], anglemapParams.phiWidth); //take entirely the phi ditro belonging to first theta
+		phiLowerIndex = FindPhiLowerIndex(lookupValue, 0.0, 0, 0, anglemapParams); //take entirely the phi ditro belonging to first theta
 		weigh = thetaOvershoot; // [0.5 - 1], will subtract 0.5 when evaluating thetaIndex
 	}
 	else if (thetaLowerIndex == (anglemapParams.thetaLowerRes + anglemapParams.thetaHigherRes - 1)) { //last theta half section
 		lookupValue += phi_CDFs[thetaLowerIndex*anglemapParams.phiWidth]; //periodic BCs over -PI...PI, can be larger than 1
-		phiLowerIndex = my_lower_bound(lookupValue, &phi_CDFs[thetaLowerIndex*anglemapParams.phiWidth], anglemapParams.phiWidth); //take entirely the phi ditro belonging to latest theta
+		phiLowerIndex = FindPhiLowerIndex(lookupValue, 0.0, thetaLowerIndex, thetaLowerIndex, anglemapParams); //take entirely the phi ditro belonging to latest theta
 		weigh = thetaOvershoot; // [0 - 0.5], will add 0.5 when evaluating thetaIndex
 	}
 	else {
@@ -1015,7 +1276,7 @@ double Anglemap::GeneratePhiFromAngleMap(const int & thetaLowerIndex, const doub
 			weigh = thetaOvershoot;
 		}
 		lookupValue += Weigh((double)phi_CDFs[thetaLowerIndex*anglemapParams.phiWidth], (double)phi_CDFs[(thetaLowerIndex + 1) * anglemapParams.phiWidth], weigh);
-		phiLowerIndex = weighed_lower_bound_X(lookupValue, weigh, &phi_CDFs[thetaLowerIndex*anglemapParams.phiWidth], &phi_CDFs[(thetaLowerIndex + 1) * anglemapParams.phiWidth], anglemapParams.phiWidth);
+		phiLowerIndex = FindPhiLowerIndex(lookupValue, weigh, thetaLowerIndex, thetaLowerIndex + 1, anglemapParams);
 	}
 
 	double phi, phiOvershoot;
@@ -1142,17 +1403,19 @@ double Anglemap::GetPhiCDFSum(const double & thetaIndex, const AnglemapParams& a
 	}
 }
 
-void PerformBounce(SubprocessFacet *iFacet) {
+template <bool instrumented> void PerformReflectionKernel(SubprocessFacet *iFacet);
 
-	bool revert = false;
+template <bool instrumented> void PerformBounceKernel(SubprocessFacet *iFacet) {
+	// instrumented=false: facet without recording features, all recorder calls compiled out
 
-	sHandle->tmpGlobalResult.globalHits.hit.nbMCHit++; //global
-	sHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv += sHandle->currentParticle.oriRatio;
+	tHandle->tmpGlobalResult.globalHits.hit.nbMCHit++; //global
+	tHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv += tHandle->currentParticle.oriRatio;
 
 	// Handle super structure link facet. Can be 
 	if (iFacet->sh.superDest) {
-		IncreaseFacetCounter(iFacet, sHandle->currentParticle.flightTime, 1, 0, 0, 0, 0);
-		sHandle->currentParticle.structureId = iFacet->sh.superDest - 1;
+		tHandle->currentParticle.nextEventCovered = false;
+		IncreaseFacetCounter(iFacet, tHandle->currentParticle.flightTime, 1, 0, 0, 0, 0);
+		tHandle->currentParticle.structureId = iFacet->sh.superDest - 1;
 		if (iFacet->sh.isMoving) { //A very special case where link facets can be used as transparent but moving facets
 			RecordHit(HIT_MOVING);
 			TreatMovingFacet();
@@ -1161,11 +1424,13 @@ void PerformBounce(SubprocessFacet *iFacet) {
 			// Count this hit as a transparent pass
 			RecordHit(HIT_TRANS);
 		}
-		LogHit(iFacet);
-		ProfileFacet(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 2.0);
-		if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
-		if (/*iFacet->texture &&*/ iFacet->sh.countTrans) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 2.0);
-		if (/*iFacet->direction &&*/ iFacet->sh.countDirection) RecordDirectionVector(iFacet, sHandle->currentParticle.flightTime);
+		if (instrumented) {
+			LogHit(iFacet);
+			ProfileFacet(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 2.0);
+			if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
+			if (/*iFacet->texture &&*/ iFacet->sh.countTrans) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 2.0);
+			if (/*iFacet->direction &&*/ iFacet->sh.countDirection) RecordDirectionVector(iFacet, tHandle->currentParticle.flightTime);
+		}
 
 		return;
 
@@ -1173,217 +1438,270 @@ void PerformBounce(SubprocessFacet *iFacet) {
 
 	// Handle volatile facet
 	if (iFacet->sh.isVolatile) {
-
-		if (iFacet->ready) {
-			IncreaseFacetCounter(iFacet, sHandle->currentParticle.flightTime, 0, 0, 1, 0, 0);
-			iFacet->ready = false;
-			LogHit(iFacet);
-			ProfileFacet(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 1.0);
-			if (/*iFacet->texture && */iFacet->sh.countAbs) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 1.0);
-			if (/*iFacet->direction && */iFacet->sh.countDirection) RecordDirectionVector(iFacet, sHandle->currentParticle.flightTime);
+		tHandle->currentParticle.nextEventCovered = false;
+
+		FacetHitState& state = tHandle->facetStates[iFacet->globalId];
+		if (state.ready) {
+			IncreaseFacetCounter(iFacet, tHandle->currentParticle.flightTime, 0, 0, 1, 0, 0);
+			state.ready = false;
+			tHandle->triggeredVolatiles.push_back(iFacet->globalId);
+			if (instrumented) {
+				LogHit(iFacet);
+				ProfileFacet(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 1.0);
+				if (/*iFacet->texture && */iFacet->sh.countAbs) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 1.0);
+				if (/*iFacet->direction && */iFacet->sh.countDirection) RecordDirectionVector(iFacet, tHandle->currentParticle.flightTime);
+			}
 		}
 		return;
 
 	}
 
-	if (iFacet->sh.is2sided) {
-		// We may need to revert normal in case of 2 sided hit
-		revert = Dot(sHandle->currentParticle.direction, iFacet->sh.N) > 0.0;
-	}
-
 	//Texture/Profile incoming hit
 
 
 	//Register (orthogonal) velocity
-	double ortVelocity = sHandle->currentParticle.velocity*abs(Dot(sHandle->currentParticle.direction, iFacet->sh.N));
+	double ortVelocity = tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, iFacet->sh.N));
 
 	/*iFacet->sh.tmpCounter.hit.nbMCHit++; //hit facet
 	iFacet->sh.tmpCounter.hit.sum_1_per_ort_velocity += 1.0 / ortVelocity;
 	iFacet->sh.tmpCounter.hit.sum_v_ort += (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;*/
 
-	IncreaseFacetCounter(iFacet, sHandle->currentParticle.flightTime, 1, 0, 0, 1.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
-	sHandle->currentParticle.nbBounces++;
-	if (/*iFacet->texture &&*/ iFacet->sh.countRefl) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime, true, 1.0, 1.0);
-	if (/*iFacet->direction &&*/ iFacet->sh.countDirection) RecordDirectionVector(iFacet, sHandle->currentParticle.flightTime);
-	LogHit(iFacet);
-	ProfileFacet(iFacet, sHandle->currentParticle.flightTime, true, 1.0, 1.0);
-	if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
+	IncreaseFacetCounter(iFacet, tHandle->currentParticle.flightTime, 1, 0, 0, 1.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
+	tHandle->currentParticle.nbBounces++;
+	if (instrumented) {
+		if (/*iFacet->texture &&*/ iFacet->sh.countRefl) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime, true, 1.0, 1.0);
+		if (/*iFacet->direction &&*/ iFacet->sh.countDirection) RecordDirectionVector(iFacet, tHandle->currentParticle.flightTime);
+		LogHit(iFacet);
+		ProfileFacet(iFacet, tHandle->currentParticle.flightTime, true, 1.0, 1.0);
+		if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
+	}
+
+	if (tHandle->currentParticle.splitPending) SplitParticle(iFacet); //Before the reflection: each copy draws its own
+	PerformReflectionKernel<instrumented>(iFacet);
+}
+
+template <bool instrumented> void PerformReflectionKernel(SubprocessFacet *iFacet) {
+	// Outgoing half of a bounce: new velocity and direction, then the outgoing counters
+
+	bool revert = false;
+	if (iFacet->sh.is2sided) {
+		// We may need to revert normal in case of 2 sided hit
+		revert = Dot(tHandle->currentParticle.direction, iFacet->sh.N) > 0.0;
+	}
 
 	// Relaunch particle
 	UpdateVelocity(iFacet);
 	//Sojourn time
 	if (iFacet->sh.enableSojournTime) {
 		double A = exp(-iFacet->sh.sojournE / (8.31*iFacet->sh.temperature));
-		sHandle->currentParticle.flightTime += -log(rnd()) / (A*iFacet->sh.sojournFreq);
+		double sojournTime = -log(tHandle->rnd()) / (A*iFacet->sh.sojournFreq);
+		tHandle->currentParticle.flightTime += sojournTime;
+		for (double& t : tHandle->currentParticle.speciesFlightTime) t += sojournTime; //Mass independent
 	}
 
+	bool diffuse = false;
 	if (iFacet->sh.reflection.diffusePart > 0.999999) { //Speedup branch for most common, diffuse case
-		sHandle->currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(rnd())), rnd()*2.0*PI, revert);
+		tHandle->currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(tHandle->rnd())), tHandle->rnd()*2.0*PI, revert);
+		diffuse = true;
 	}
 	else {
-		double reflTypeRnd = rnd();
+		double reflTypeRnd = tHandle->rnd();
 		if (reflTypeRnd < iFacet->sh.reflection.diffusePart)
 		{
 			//diffuse reflection
 			//See docs/theta_gen.png for further details on angular distribution generation
-			sHandle->currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(rnd())), rnd()*2.0*PI, revert);
+			tHandle->currentParticle.direction = PolarToCartesian(iFacet, acos(sqrt(tHandle->rnd())), tHandle->rnd()*2.0*PI, revert);
+			diffuse = true;
 		}
 		else  if (reflTypeRnd < (iFacet->sh.reflection.diffusePart + iFacet->sh.reflection.specularPart))
 		{
 			//specular reflection
-			auto [inTheta, inPhi] = CartesianToPolar(sHandle->currentParticle.direction, iFacet->sh.nU, iFacet->sh.nV, iFacet->sh.N);
-			sHandle->currentParticle.direction = PolarToCartesian(iFacet, PI - inTheta, inPhi, false);
+			auto [inTheta, inPhi] = CartesianToPolar(tHandle->currentParticle.direction, iFacet->sh.nU, iFacet->sh.nV, iFacet->sh.N);
+			tHandle->currentParticle.direction = PolarToCartesian(iFacet, PI - inTheta, inPhi, false);
 
 		}
 		else {
 			//Cos^N reflection
-			sHandle->currentParticle.direction = PolarToCartesian(iFacet, acos(pow(rnd(), 1.0 / (iFacet->sh.reflection.cosineExponent + 1.0))), rnd()*2.0*PI, revert);
+			tHandle->currentParticle.direction = PolarToCartesian(iFacet, acos(pow(tHandle->rnd(), 1.0 / (iFacet->sh.reflection.cosineExponent + 1.0))), tHandle->rnd()*2.0*PI, revert);
 		}
 	}
 
 	if (iFacet->sh.isMoving) {
 		TreatMovingFacet();
 	}
+	if (!sHandle->estimatorFacets.empty()) {
+		if (diffuse) RecordNextEvent(iFacet);
+		else tHandle->currentParticle.nextEventCovered = false;
+	}
 
 	//Texture/Profile outgoing particle
 	//Register outgoing velocity
-	ortVelocity = sHandle->currentParticle.velocity*abs(Dot(sHandle->currentParticle.direction, iFacet->sh.N));
+	double ortVelocity = tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, iFacet->sh.N));
 
 	/*iFacet->sh.tmpCounter.hit.sum_1_per_ort_velocity += 1.0 / ortVelocity;
 	iFacet->sh.tmpCounter.hit.sum_v_ort += (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;*/
-	IncreaseFacetCounter(iFacet, sHandle->currentParticle.flightTime, 0, 0, 0, 1.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
-	if (/*iFacet->texture &&*/ iFacet->sh.countRefl) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime, false, 1.0, 1.0); //count again for outward velocity
-	ProfileFacet(iFacet, sHandle->currentParticle.flightTime, false, 1.0, 1.0);
-	//no direction count on outgoing, neither angle map
+	IncreaseFacetCounter(iFacet, tHandle->currentParticle.flightTime, 0, 0, 0, 1.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
+	if (instrumented) {
+		if (/*iFacet->texture &&*/ iFacet->sh.countRefl) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime, false, 1.0, 1.0); //count again for outward velocity
+		ProfileFacet(iFacet, tHandle->currentParticle.flightTime, false, 1.0, 1.0);
+		//no direction count on outgoing, neither angle map
+	}
 
 	if (iFacet->sh.isMoving && sHandle->wp.motionType) RecordHit(HIT_MOVING);
 	else RecordHit(HIT_REF);
-	sHandle->currentParticle.lastHitFacet = iFacet;
+	tHandle->currentParticle.lastHitFacet = iFacet;
 	//sHandle->nbPHit++;
 }
 
+void PerformBounce(SubprocessFacet *iFacet) {
+	if (iFacet->isInstrumented) PerformBounceKernel<true>(iFacet);
+	else PerformBounceKernel<false>(iFacet);
+}
+
+void PerformReflection(SubprocessFacet *iFacet) {
+	if (iFacet->isInstrumented) PerformReflectionKernel<true>(iFacet);
+	else PerformReflectionKernel<false>(iFacet);
+}
+
 void PerformTransparentPass(SubprocessFacet *iFacet) { //disabled, caused finding hits with the same facet
 	/*double directionFactor = abs(DOT3(
-		sHandle->currentParticle.direction.x, sHandle->currentParticle.direction.y, sHandle->currentParticle.direction.z,
+		tHandle->currentParticle.direction.x, tHandle->currentParticle.direction.y, tHandle->currentParticle.direction.z,
 		iFacet->sh.N.x, iFacet->sh.N.y, iFacet->sh.N.z));
 	iFacet->sh.tmpCounter.hit.nbMCHit++;
-	iFacet->sh.tmpCounter.hit.sum_1_per_ort_velocity += 2.0 / (sHandle->currentParticle.velocity*directionFactor);
-	iFacet->sh.tmpCounter.hit.sum_v_ort += 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*sHandle->currentParticle.velocity*directionFactor;
+	iFacet->sh.tmpCounter.hit.sum_1_per_ort_velocity += 2.0 / (tHandle->currentParticle.velocity*directionFactor);
+	iFacet->sh.tmpCounter.hit.sum_v_ort += 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*tHandle->currentParticle.velocity*directionFactor;
 	iFacet->hitted = true;
-	if (iFacet->texture && iFacet->sh.countTrans) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime + iFacet->colDist / 100.0 / sHandle->currentParticle.velocity,
+	if (iFacet->texture && iFacet->sh.countTrans) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime + iFacet->colDist / 100.0 / tHandle->currentParticle.velocity,
 		true, 2.0, 2.0);
-	if (iFacet->direction && iFacet->sh.countDirection) RecordDirectionVector(iFacet, sHandle->currentParticle.flightTime + iFacet->colDist / 100.0 / sHandle->currentParticle.velocity);
-	ProfileFacet(iFacet, sHandle->currentParticle.flightTime + iFacet->colDist / 100.0 / sHandle->currentParticle.velocity,
+	if (iFacet->direction && iFacet->sh.countDirection) RecordDirectionVector(iFacet, tHandle->currentParticle.flightTime + iFacet->colDist / 100.0 / tHandle->currentParticle.velocity);
+	ProfileFacet(iFacet, tHandle->currentParticle.flightTime + iFacet->colDist / 100.0 / tHandle->currentParticle.velocity,
 		true, 2.0, 2.0);
 	RecordHit(HIT_TRANS);
 	sHandle->lastHit = iFacet;*/
 }
 
-void RecordAbsorb(SubprocessFacet *iFacet) {
-	sHandle->tmpGlobalResult.globalHits.hit.nbMCHit++; //global	
-	sHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv += sHandle->currentParticle.oriRatio;
-	sHandle->tmpGlobalResult.globalHits.hit.nbAbsEquiv += sHandle->currentParticle.oriRatio;
+template <bool instrumented> void RecordAbsorbKernel(SubprocessFacet *iFacet) {
+	tHandle->tmpGlobalResult.globalHits.hit.nbMCHit++; //global	
+	tHandle->tmpGlobalResult.globalHits.hit.nbHitEquiv += tHandle->currentParticle.oriRatio;
+	tHandle->tmpGlobalResult.globalHits.hit.nbAbsEquiv += tHandle->currentParticle.oriRatio;
 
-	RecordHistograms(iFacet);
+	if (instrumented) RecordHistograms(iFacet);
 
 	RecordHit(HIT_ABS);
-	double ortVelocity = sHandle->currentParticle.velocity*abs(Dot(sHandle->currentParticle.direction, iFacet->sh.N));
-	IncreaseFacetCounter(iFacet, sHandle->currentParticle.flightTime, 1, 0, 1, 2.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
-	LogHit(iFacet);
-	ProfileFacet(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 1.0); //was 2.0, 1.0
-	if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
-	if (/*iFacet->texture &&*/ iFacet->sh.countAbs) RecordHitOnTexture(iFacet, sHandle->currentParticle.flightTime, true, 2.0, 1.0); //was 2.0, 1.0
-	if (/*iFacet->direction &&*/ iFacet->sh.countDirection) RecordDirectionVector(iFacet, sHandle->currentParticle.flightTime);
+	double ortVelocity = tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, iFacet->sh.N));
+	IncreaseFacetCounter(iFacet, tHandle->currentParticle.flightTime, 1, 0, 1, 2.0 / ortVelocity, (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity);
+	if (instrumented) {
+		LogHit(iFacet);
+		ProfileFacet(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 1.0); //was 2.0, 1.0
+		if (iFacet->sh.anglemapParams.record) RecordAngleMap(iFacet);
+		if (/*iFacet->texture &&*/ iFacet->sh.countAbs) RecordHitOnTexture(iFacet, tHandle->currentParticle.flightTime, true, 2.0, 1.0); //was 2.0, 1.0
+		if (/*iFacet->direction &&*/ iFacet->sh.countDirection) RecordDirectionVector(iFacet, tHandle->currentParticle.flightTime);
+	}
+}
+
+void RecordAbsorb(SubprocessFacet *iFacet) {
+	if (iFacet->isInstrumented) RecordAbsorbKernel<true>(iFacet);
+	else RecordAbsorbKernel<false>(iFacet);
 }
 
 void RecordHistograms(SubprocessFacet * iFacet)
 {
+	FacetHitState& state = tHandle->facetStates[iFacet->globalId];
 	//Record in global and facet histograms
-	for (size_t m = 0; m <= sHandle->moments.size(); m++) {
-		if (m == 0 || abs(sHandle->currentParticle.flightTime - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-			size_t binIndex;
-			if (sHandle->wp.globalHistogramParams.recordBounce) {
-				binIndex = Min(sHandle->currentParticle.nbBounces / sHandle->wp.globalHistogramParams.nbBounceBinsize, sHandle->wp.globalHistogramParams.GetBounceHistogramSize() - 1);
-				sHandle->tmpGlobalHistograms[m].nbHitsHistogram[binIndex] += sHandle->currentParticle.oriRatio;
-			}
-			if (sHandle->wp.globalHistogramParams.recordDistance) {
-				binIndex = Min(static_cast<size_t>(sHandle->currentParticle.distanceTraveled / sHandle->wp.globalHistogramParams.distanceBinsize), sHandle->wp.globalHistogramParams.GetDistanceHistogramSize() - 1);
-				sHandle->tmpGlobalHistograms[m].distanceHistogram[binIndex] += sHandle->currentParticle.oriRatio;
-			}
-			if (sHandle->wp.globalHistogramParams.recordTime) {
-				binIndex = Min(static_cast<size_t>(sHandle->currentParticle.flightTime / sHandle->wp.globalHistogramParams.timeBinsize), sHandle->wp.globalHistogramParams.GetTimeHistogramSize() - 1);
-				sHandle->tmpGlobalHistograms[m].timeHistogram[binIndex] += sHandle->currentParticle.oriRatio;
-			}
-			if (iFacet->sh.facetHistogramParams.recordBounce) {
-				binIndex = Min(sHandle->currentParticle.nbBounces / iFacet->sh.facetHistogramParams.nbBounceBinsize, iFacet->sh.facetHistogramParams.GetBounceHistogramSize() - 1);
-				iFacet->tmpHistograms[m].nbHitsHistogram[binIndex] += sHandle->currentParticle.oriRatio;
-			}
-			if (iFacet->sh.facetHistogramParams.recordDistance) {
-				binIndex = Min(static_cast<size_t>(sHandle->currentParticle.distanceTraveled / iFacet->sh.facetHistogramParams.distanceBinsize), iFacet->sh.facetHistogramParams.GetDistanceHistogramSize() - 1);
-				iFacet->tmpHistograms[m].distanceHistogram[binIndex] += sHandle->currentParticle.oriRatio;
-			}
-			if (iFacet->sh.facetHistogramParams.recordTime) {
-				binIndex = Min(static_cast<size_t>(sHandle->currentParticle.flightTime / iFacet->sh.facetHistogramParams.timeBinsize), iFacet->sh.facetHistogramParams.GetTimeHistogramSize() - 1);
-				iFacet->tmpHistograms[m].timeHistogram[binIndex] += sHandle->currentParticle.oriRatio;
-			}
+	for (const size_t& m : tHandle->GetActiveMoments(tHandle->currentParticle.flightTime)) {
+		size_t binIndex;
+		if (sHandle->wp.globalHistogramParams.recordBounce) {
+			binIndex = Min(tHandle->currentParticle.nbBounces / sHandle->wp.globalHistogramParams.nbBounceBinsize, sHandle->wp.globalHistogramParams.GetBounceHistogramSize() - 1);
+			tHandle->tmpGlobalHistograms[m].nbHitsHistogram[binIndex] += tHandle->currentParticle.oriRatio;
+		}
+		if (sHandle->wp.globalHistogramParams.recordDistance) {
+			binIndex = Min(static_cast<size_t>(tHandle->currentParticle.distanceTraveled / sHandle->wp.globalHistogramParams.distanceBinsize), sHandle->wp.globalHistogramParams.GetDistanceHistogramSize() - 1);
+			tHandle->tmpGlobalHistograms[m].distanceHistogram[binIndex] += tHandle->currentParticle.oriRatio;
+		}
+		if (sHandle->wp.globalHistogramParams.recordTime) {
+			binIndex = Min(static_cast<size_t>(tHandle->currentParticle.flightTime / sHandle->wp.globalHistogramParams.timeBinsize), sHandle->wp.globalHistogramParams.GetTimeHistogramSize() - 1);
+			tHandle->tmpGlobalHistograms[m].timeHistogram[binIndex] += tHandle->currentParticle.oriRatio;
+		}
+		if (iFacet->sh.facetHistogramParams.recordBounce) {
+			binIndex = Min(tHandle->currentParticle.nbBounces / iFacet->sh.facetHistogramParams.nbBounceBinsize, iFacet->sh.facetHistogramParams.GetBounceHistogramSize() - 1);
+			state.tmpHistograms[m].nbHitsHistogram[binIndex] += tHandle->currentParticle.oriRatio;
+		}
+		if (iFacet->sh.facetHistogramParams.recordDistance) {
+			binIndex = Min(static_cast<size_t>(tHandle->currentParticle.distanceTraveled / iFacet->sh.facetHistogramParams.distanceBinsize), iFacet->sh.facetHistogramParams.GetDistanceHistogramSize() - 1);
+			state.tmpHistograms[m].distanceHistogram[binIndex] += tHandle->currentParticle.oriRatio;
+		}
+		if (iFacet->sh.facetHistogramParams.recordTime) {
+			binIndex = Min(static_cast<size_t>(tHandle->currentParticle.flightTime / iFacet->sh.facetHistogramParams.timeBinsize), iFacet->sh.facetHistogramParams.GetTimeHistogramSize() - 1);
+			state.tmpHistograms[m].timeHistogram[binIndex] += tHandle->currentParticle.oriRatio;
 		}
 	}
 }
 
 void RecordHitOnTexture(SubprocessFacet *f, double time, bool countHit, double velocity_factor, double ortSpeedFactor) {
 
-	size_t tu = (size_t)(f->colU * f->sh.texWidthD);
-	size_t tv = (size_t)(f->colV * f->sh.texHeightD);
+	FacetHitState& state = tHandle->facetStates[f->globalId];
+	size_t tu = (size_t)(tHandle->currentParticle.colU * f->sh.texWidthD);
+	size_t tv = (size_t)(tHandle->currentParticle.colV * f->sh.texHeightD);
 	size_t add = tu + tv * (f->sh.texWidth);
-	double ortVelocity = (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*sHandle->currentParticle.velocity*abs(Dot(sHandle->currentParticle.direction, f->sh.N)); //surface-orthogonal velocity component
-
-	for (size_t m = 0; m <= sHandle->moments.size(); m++)
-		if (m == 0 || abs(time - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-			if (countHit) f->texture[m][add].countEquiv += sHandle->currentParticle.oriRatio;
-			f->texture[m][add].sum_1_per_ort_velocity += sHandle->currentParticle.oriRatio * velocity_factor / ortVelocity;
-			f->texture[m][add].sum_v_ort_per_area += sHandle->currentParticle.oriRatio * ortSpeedFactor*ortVelocity*f->textureCellIncrements[add]; // sum ortho_velocity[m/s] / cell_area[cm2]
+	double ortVelocity = (sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, f->sh.N)); //surface-orthogonal velocity component
+
+	for (const size_t& m : tHandle->GetActiveMoments(time)) {
+		if (countHit) state.texture[m][add].countEquiv += tHandle->currentParticle.oriRatio;
+		state.texture[m][add].sum_1_per_ort_velocity += tHandle->currentParticle.oriRatio * velocity_factor / ortVelocity;
+		state.texture[m][add].sum_v_ort_per_area += tHandle->currentParticle.oriRatio * ortSpeedFactor*ortVelocity*f->textureCellIncrements[add]; // sum ortho_velocity[m/s] / cell_area[cm2]
+	}
+
+	// Extra species: same cell, speeds scaled by the species' factor
+	size_t cellsPerMoment = f->sh.texWidth * f->sh.texHeight;
+	for (size_t s = 0; s < sHandle->speciesSpeedFactors.size(); s++) {
+		double speciesTime;
+		if (!GetSpeciesTime(s, time, speciesTime)) continue;
+		double k = sHandle->speciesSpeedFactors[s];
+		TextureCell* texture = &tHandle->speciesTextures[s * sHandle->speciesTextureCells + sHandle->speciesTextureStart[f->globalId] + add];
+		tHandle->FindActiveMoments(speciesTime, tHandle->speciesMoments);
+		for (const size_t& m : tHandle->speciesMoments) {
+			TextureCell& cell = texture[m * cellsPerMoment];
+			if (countHit) cell.countEquiv += tHandle->currentParticle.oriRatio;
+			cell.sum_1_per_ort_velocity += tHandle->currentParticle.oriRatio * velocity_factor / (ortVelocity * k);
+			cell.sum_v_ort_per_area += tHandle->currentParticle.oriRatio * ortSpeedFactor * ortVelocity * k * f->textureCellIncrements[add];
 		}
+	}
 }
 
 void RecordDirectionVector(SubprocessFacet *f, double time) {
-	size_t tu = (size_t)(f->colU * f->sh.texWidthD);
-	size_t tv = (size_t)(f->colV * f->sh.texHeightD);
+	FacetHitState& state = tHandle->facetStates[f->globalId];
+	size_t tu = (size_t)(tHandle->currentParticle.colU * f->sh.texWidthD);
+	size_t tv = (size_t)(tHandle->currentParticle.colV * f->sh.texHeightD);
 	size_t add = tu + tv * (f->sh.texWidth);
 
-	for (size_t m = 0; m <= sHandle->moments.size(); m++) {
-		if (m == 0 || abs(time - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-			f->direction[m][add].dir = f->direction[m][add].dir + sHandle->currentParticle.oriRatio * sHandle->currentParticle.direction * sHandle->currentParticle.velocity;
-			f->direction[m][add].count++;
-		}
+	for (const size_t& m : tHandle->GetActiveMoments(time)) {
+		state.direction[m][add].dir = state.direction[m][add].dir + tHandle->currentParticle.oriRatio * tHandle->currentParticle.direction * tHandle->currentParticle.velocity;
+		state.direction[m][add].count++;
 	}
 
 }
 
 void ProfileFacet(SubprocessFacet *f, double time, bool countHit, double velocity_factor, double ortSpeedFactor) {
 
-	size_t nbMoments = sHandle->moments.size();
+	FacetHitState& state = tHandle->facetStates[f->globalId];
 
 	if (countHit && f->sh.profileType == PROFILE_ANGULAR) {
-		double dot = Dot(f->sh.N, sHandle->currentParticle.direction);
+		double dot = Dot(f->sh.N, tHandle->currentParticle.direction);
 		double theta = acos(abs(dot));     // Angle to normal (PI/2 => PI)
 		size_t pos = (size_t)(theta / (PI / 2)*((double)PROFILE_SIZE)); // To Grad
 		Saturate(pos, 0, PROFILE_SIZE - 1);
-		for (size_t m = 0; m <= nbMoments; m++) {
-			if (m == 0 || abs(time - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-				f->profile[m][pos].countEquiv += sHandle->currentParticle.oriRatio;
-			}
+		for (const size_t& m : tHandle->GetActiveMoments(time)) {
+			state.profile[m][pos].countEquiv += tHandle->currentParticle.oriRatio;
 		}
 	}
 	else if (f->sh.profileType == PROFILE_U || f->sh.profileType == PROFILE_V) {
-		size_t pos = (size_t)((f->sh.profileType == PROFILE_U ? f->colU : f->colV)*(double)PROFILE_SIZE);
+		size_t pos = (size_t)((f->sh.profileType == PROFILE_U ? tHandle->currentParticle.colU : tHandle->currentParticle.colV)*(double)PROFILE_SIZE);
 		if (pos >= 0 && pos < PROFILE_SIZE) {
-			for (size_t m = 0; m <= nbMoments; m++) {
-				if (m == 0 || abs(time - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-					if (countHit) f->profile[m][pos].countEquiv += sHandle->currentParticle.oriRatio;
-					double ortVelocity = sHandle->currentParticle.velocity*abs(Dot(f->sh.N, sHandle->currentParticle.direction));
-					f->profile[m][pos].sum_1_per_ort_velocity += sHandle->currentParticle.oriRatio * velocity_factor / ortVelocity;
-					f->profile[m][pos].sum_v_ort += sHandle->currentParticle.oriRatio * ortSpeedFactor*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;
-				}
+			for (const size_t& m : tHandle->GetActiveMoments(time)) {
+				if (countHit) state.profile[m][pos].countEquiv += tHandle->currentParticle.oriRatio;
+				double ortVelocity = tHandle->currentParticle.velocity*abs(Dot(f->sh.N, tHandle->currentParticle.direction));
+				state.profile[m][pos].sum_1_per_ort_velocity += tHandle->currentParticle.oriRatio * velocity_factor / ortVelocity;
+				state.profile[m][pos].sum_v_ort += tHandle->currentParticle.oriRatio * ortSpeedFactor*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*ortVelocity;
 			}
 		}
 	}
@@ -1393,17 +1711,15 @@ void ProfileFacet(SubprocessFacet *f, double time, bool countHit, double velocit
 			dot = 1.0;
 		}
 		else if (f->sh.profileType == PROFILE_ORT_VELOCITY) {
-			dot = abs(Dot(f->sh.N, sHandle->currentParticle.direction));  //cos(theta) as "dot" value
+			dot = abs(Dot(f->sh.N, tHandle->currentParticle.direction));  //cos(theta) as "dot" value
 		}
 		else { //Tangential
-			dot = sqrt(1 - Sqr(abs(Dot(f->sh.N, sHandle->currentParticle.direction))));  //tangential
+			dot = sqrt(1 - Sqr(abs(Dot(f->sh.N, tHandle->currentParticle.direction))));  //tangential
 		}
-		size_t pos = (size_t)(dot*sHandle->currentParticle.velocity / f->sh.maxSpeed*(double)PROFILE_SIZE); //"dot" default value is 1.0
+		size_t pos = (size_t)(dot*tHandle->currentParticle.velocity / f->sh.maxSpeed*(double)PROFILE_SIZE); //"dot" default value is 1.0
 		if (pos >= 0 && pos < PROFILE_SIZE) {
-			for (size_t m = 0; m <= nbMoments; m++) {
-				if (m == 0 || abs(time - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-					f->profile[m][pos].countEquiv += sHandle->currentParticle.oriRatio;
-				}
+			for (const size_t& m : tHandle->GetActiveMoments(time)) {
+				state.profile[m][pos].countEquiv += tHandle->currentParticle.oriRatio;
 			}
 		}
 	}
@@ -1413,20 +1729,20 @@ void LogHit(SubprocessFacet * f)
 {
 	if (sHandle->ontheflyParams.enableLogging &&
 		sHandle->ontheflyParams.logFacetId == f->globalId &&
-		sHandle->tmpParticleLog.size() < (sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess)) {
+		tHandle->tmpParticleLog.size() < (sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess / sHandle->threads.size())) {
 		ParticleLoggerItem log;
-		log.facetHitPosition = Vector2d(f->colU, f->colV);
-		std::tie(log.hitTheta, log.hitPhi) = CartesianToPolar(sHandle->currentParticle.direction, f->sh.nU, f->sh.nV, f->sh.N);
-		log.oriRatio = sHandle->currentParticle.oriRatio;
-		log.particleDecayMoment = sHandle->currentParticle.expectedDecayMoment;
-		log.time = sHandle->currentParticle.flightTime;
-		log.velocity = sHandle->currentParticle.velocity;
-		sHandle->tmpParticleLog.push_back(log);
+		log.facetHitPosition = Vector2d(tHandle->currentParticle.colU, tHandle->currentParticle.colV);
+		std::tie(log.hitTheta, log.hitPhi) = CartesianToPolar(tHandle->currentParticle.direction, f->sh.nU, f->sh.nV, f->sh.N);
+		log.oriRatio = tHandle->currentParticle.oriRatio;
+		log.particleDecayMoment = tHandle->currentParticle.expectedDecayMoment;
+		log.time = tHandle->currentParticle.flightTime;
+		log.velocity = tHandle->currentParticle.velocity;
+		tHandle->tmpParticleLog.push_back(log);
 	}
 }
 
 void RecordAngleMap(SubprocessFacet* collidedFacet) {
-	auto[inTheta, inPhi] = CartesianToPolar(sHandle->currentParticle.direction, collidedFacet->sh.nU, collidedFacet->sh.nV, collidedFacet->sh.N);
+	auto[inTheta, inPhi] = CartesianToPolar(tHandle->currentParticle.direction, collidedFacet->sh.nU, collidedFacet->sh.nV, collidedFacet->sh.N);
 	if (inTheta > PI / 2.0) inTheta = abs(PI - inTheta); //theta is originally respective to N, but we'd like the angle between 0 and PI/2
 	bool countTheta = true;
 	size_t thetaIndex;
@@ -1449,52 +1765,50 @@ void RecordAngleMap(SubprocessFacet* collidedFacet) {
 	}
 	if (countTheta) {
 		size_t phiIndex = (size_t)((inPhi + 3.1415926) / (2.0*PI)*(double)collidedFacet->sh.anglemapParams.phiWidth); //Phi: -PI..PI , and shifting by a number slightly smaller than PI to store on interval [0,2PI[
-		collidedFacet->angleMap.pdf[thetaIndex*collidedFacet->sh.anglemapParams.phiWidth + phiIndex]++;
+		tHandle->facetStates[collidedFacet->globalId].angleMapPdf[thetaIndex*collidedFacet->sh.anglemapParams.phiWidth + phiIndex]++;
 	}
 }
 
 void UpdateVelocity(SubprocessFacet *collidedFacet) {
 	if (collidedFacet->sh.accomodationFactor > 0.9999) { //speedup for the most common case: perfect thermalization
-		if (sHandle->wp.useMaxwellDistribution) sHandle->currentParticle.velocity = GenerateRandomVelocity(collidedFacet->sh.CDFid);
-		else sHandle->currentParticle.velocity = 145.469*sqrt(collidedFacet->sh.temperature / sHandle->wp.gasMass);
+		if (sHandle->wp.useMaxwellDistribution) tHandle->currentParticle.velocity = GenerateRandomVelocity(collidedFacet->sh.CDFid);
+		else tHandle->currentParticle.velocity = 145.469*sqrt(collidedFacet->sh.temperature / sHandle->wp.gasMass);
 	}
 	else {
-		double oldSpeed2 = pow(sHandle->currentParticle.velocity, 2);
+		double oldSpeed2 = pow(tHandle->currentParticle.velocity, 2);
 		double newSpeed2;
 		if (sHandle->wp.useMaxwellDistribution) newSpeed2 = pow(GenerateRandomVelocity(collidedFacet->sh.CDFid), 2);
 		else newSpeed2 = /*145.469*/ 29369.939*(collidedFacet->sh.temperature / sHandle->wp.gasMass);
 		//sqrt(29369)=171.3766= sqrt(8*R*1000/PI)*3PI/8, that is, the constant part of the v_avg=sqrt(8RT/PI/m/0.001)) found in literature, multiplied by
 		//the corrective factor of 3PI/8 that accounts for moving from volumetric speed distribution to wall collision speed distribution
-		sHandle->currentParticle.velocity = sqrt(oldSpeed2 + (newSpeed2 - oldSpeed2)*collidedFacet->sh.accomodationFactor);
+		tHandle->currentParticle.velocity = sqrt(oldSpeed2 + (newSpeed2 - oldSpeed2)*collidedFacet->sh.accomodationFactor);
 	}
 }
 
 double GenerateRandomVelocity(int CDFId) {
 	//return FastLookupY(rnd(),sHandle->CDFs[CDFId],false);
-	double r = rnd();
-	double v = InterpolateX(r, sHandle->CDFs[CDFId], false, true); //Allow extrapolate
-	return v;
+	return sHandle->inverseCDFs[CDFId].Sample(tHandle->rnd());
 }
 
 double GenerateDesorptionTime(SubprocessFacet *src) {
 	if (src->sh.outgassing_paramId >= 0) { //time-dependent desorption
-		return InterpolateX(rnd()*sHandle->IDs[src->sh.IDid].back().second, sHandle->IDs[src->sh.IDid], false, true); //allow extrapolate
+		return sHandle->desorptionTimeTables[src->sh.IDid].Get(tHandle->rnd()*sHandle->IDs[src->sh.IDid].back().second); //allow extrapolate
 	}
 	else {
-		return rnd()*sHandle->wp.latestMoment; //continous desorption between 0 and latestMoment
+		return tHandle->rnd()*sHandle->wp.latestMoment; //continous desorption between 0 and latestMoment
 	}
 }
 
 double GetStickingAt(SubprocessFacet *f, double time) {
 	if (f->sh.sticking_paramId == -1) //constant sticking
 		return f->sh.sticking;
-	else return sHandle->parameters[f->sh.sticking_paramId].InterpolateY(time, false);
+	else return sHandle->parameterTables[f->sh.sticking_paramId].Get(time);
 }
 
 double GetOpacityAt(SubprocessFacet *f, double time) {
 	if (f->sh.opacity_paramId == -1) //constant sticking
 		return f->sh.opacity;
-	else return sHandle->parameters[f->sh.opacity_paramId].InterpolateY(time, false);
+	else return sHandle->parameterTables[f->sh.opacity_paramId].Get(time);
 }
 
 void TreatMovingFacet() {
@@ -1503,67 +1817,200 @@ void TreatMovingFacet() {
 		localVelocityToAdd = sHandle->wp.motionVector2;
 	}
 	else if (sHandle->wp.motionType == 2) {
-		Vector3d distanceVector = 0.01*(sHandle->currentParticle.position - sHandle->wp.motionVector1); //distance from base, with cm->m conversion
+		Vector3d distanceVector = 0.01*(tHandle->currentParticle.position - sHandle->wp.motionVector1); //distance from base, with cm->m conversion
 		localVelocityToAdd = CrossProduct(sHandle->wp.motionVector2, distanceVector);
 	}
 	Vector3d oldVelocity, newVelocity;
-	oldVelocity = sHandle->currentParticle.direction*sHandle->currentParticle.velocity;
+	oldVelocity = tHandle->currentParticle.direction*tHandle->currentParticle.velocity;
 	newVelocity = oldVelocity + localVelocityToAdd;
-	sHandle->currentParticle.direction = newVelocity.Normalized();
-	sHandle->currentParticle.velocity = newVelocity.Norme();
+	tHandle->currentParticle.direction = newVelocity.Normalized();
+	tHandle->currentParticle.velocity = newVelocity.Norme();
 }
 
 void IncreaseFacetCounter(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort) {
+	FacetHitState& state = tHandle->facetStates[f->globalId];
+	for (const size_t& m : tHandle->GetActiveMoments(time)) {
+		state.tmpCounter[m].hit.nbMCHit += hit;
+		double hitEquiv = static_cast<double>(hit)*tHandle->currentParticle.oriRatio;
+		state.tmpCounter[m].hit.nbHitEquiv += hitEquiv;
+		state.tmpCounter[m].hit.nbDesorbed += desorb;
+		state.tmpCounter[m].hit.nbAbsEquiv += static_cast<double>(absorb)*tHandle->currentParticle.oriRatio;
+		state.tmpCounter[m].hit.sum_1_per_ort_velocity += tHandle->currentParticle.oriRatio * sum_1_per_v;
+		state.tmpCounter[m].hit.sum_v_ort += tHandle->currentParticle.oriRatio * sum_v_ort;
+		state.tmpCounter[m].hit.sum_1_per_velocity += (hitEquiv + static_cast<double>(desorb)) / tHandle->currentParticle.velocity;
+		if(absorb>0)
+			state.tmpCounter[m].hit.covering += 1;
+		if (desorb > 0)
+			if(state.tmpCounter[m].hit.covering!=0)
+				state.tmpCounter[m].hit.covering -= 1;
+
+		//Fr den Fall,
+		//dass covering kleiner Null wrde. Das ist aber nicht die physikalisch richtige Lsung => berlegen.
+		//berlegungen siehe MolflowLinux
+	}
+	if (!sHandle->speciesSpeedFactors.empty()) IncreaseSpeciesCounters(f, time, hit, desorb, absorb, sum_1_per_v, sum_v_ort);
+	if (sHandle->nbScenarios) IncreaseSweepCounters(f, time, hit, desorb, absorb, sum_1_per_v, sum_v_ort);
+	if (!sHandle->watchIndex.empty() && sHandle->watchIndex[f->globalId] != -1) { //Open batch, constant flow
+		double* batch = &tHandle->batchValues[3 * sHandle->watchIndex[f->globalId]];
+		batch[0] += static_cast<double>(absorb)*tHandle->currentParticle.oriRatio;
+		batch[1] += static_cast<double>(absorb) - static_cast<double>(desorb);
+		batch[2] += tHandle->currentParticle.oriRatio * sum_v_ort;
+	}
+	if (absorb > 0 && !sHandle->coveringIndex.empty() && sHandle->coveringIndex[f->globalId] != -1)
+		tHandle->stepAbsorbed[sHandle->coveringIndex[f->globalId]] += static_cast<double>(absorb)*tHandle->currentParticle.oriRatio;
+	if (absorb > 0 && tHandle->currentParticle.transferRow != -1 && sHandle->transferIndex[f->globalId] != -1)
+		tHandle->currentParticle.transferScores.emplace_back(sHandle->transferIndex[f->globalId], static_cast<double>(absorb)*tHandle->currentParticle.oriRatio);
+}
+
+void FlushTransferScores() {
+	// Each trajectory adds its total weight on every target once, the spread between trajectories gives the error bars
+	CurrentParticleStatus& particle = tHandle->currentParticle;
+	size_t nbTransfer = sHandle->ep.transferFacets.size();
+	if (particle.transferOriginal) tHandle->transferLaunched[particle.transferRow] += 1.0;
+	std::sort(particle.transferScores.begin(), particle.transferScores.end());
+	for (size_t i = 0; i < particle.transferScores.size();) {
+		size_t column = particle.transferScores[i].first;
+		double weight = 0.0;
+		for (; i < particle.transferScores.size() && particle.transferScores[i].first == column; i++)
+			weight += particle.transferScores[i].second;
+		TransferEntry& entry = tHandle->transferCounters[particle.transferRow * nbTransfer + column];
+		entry.sum += weight;
+		entry.sumSquares += weight * weight;
+	}
+	particle.transferScores.clear();
+	particle.transferRow = -1;
+}
+
+void CloseBatch() {
+	// Called when the thread starts the first particle of the next batch
+	for (size_t i = 0; i < tHandle->convergenceStats.size(); i++) {
+		double* batch = &tHandle->batchValues[3 * i];
+		tHandle->convergenceStats[i].absorption.Add(batch[0]);
+		tHandle->convergenceStats[i].covering.Add(batch[1]);
+		tHandle->convergenceStats[i].pressure.Add(batch[2]);
+		batch[0] = batch[1] = batch[2] = 0.0;
+	}
+	tHandle->batchDesorbed = 0;
+}
+
+void IncreaseSweepCounters(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort) {
+	// Same hit for every sticking scenario, weighted by the scenario's own ratio instead of oriRatio
 	size_t nbMoments = sHandle->moments.size();
-	for (size_t m = 0; m <= nbMoments; m++) {
-		if (m == 0 || abs(time - sHandle->moments[m - 1]) < sHandle->wp.timeWindowSize / 2.0) {
-			f->tmpCounter[m].hit.nbMCHit += hit;
-			double hitEquiv = static_cast<double>(hit)*sHandle->currentParticle.oriRatio;
-			f->tmpCounter[m].hit.nbHitEquiv += hitEquiv;
-			f->tmpCounter[m].hit.nbDesorbed += desorb;
-			f->tmpCounter[m].hit.nbAbsEquiv += static_cast<double>(absorb)*sHandle->currentParticle.oriRatio;
-			f->tmpCounter[m].hit.sum_1_per_ort_velocity += sHandle->currentParticle.oriRatio * sum_1_per_v;
-			f->tmpCounter[m].hit.sum_v_ort += sHandle->currentParticle.oriRatio * sum_v_ort;
-			f->tmpCounter[m].hit.sum_1_per_velocity += (hitEquiv + static_cast<double>(desorb)) / sHandle->currentParticle.velocity;
-			if(absorb>0)
-				f->tmpCounter[m].hit.covering += 1;
+	const std::vector<size_t>& moments = tHandle->GetActiveMoments(time);
+	for (size_t k = 0; k < sHandle->nbScenarios; k++) {
+		double ratio = tHandle->currentParticle.scenarioRatio[k];
+		FacetHitBuffer* counters = &tHandle->sweepCounters[(k * sHandle->sh.nbFacet + f->globalId) * (1 + nbMoments)];
+		for (const size_t& m : moments) {
+			counters[m].hit.nbMCHit += hit;
+			double hitEquiv = static_cast<double>(hit)*ratio;
+			counters[m].hit.nbHitEquiv += hitEquiv;
+			counters[m].hit.nbDesorbed += desorb;
+			counters[m].hit.nbAbsEquiv += static_cast<double>(absorb)*ratio;
+			counters[m].hit.sum_1_per_ort_velocity += ratio * sum_1_per_v;
+			counters[m].hit.sum_v_ort += ratio * sum_v_ort;
+			counters[m].hit.sum_1_per_velocity += (hitEquiv + static_cast<double>(desorb)) / tHandle->currentParticle.velocity;
+			if (absorb > 0)
+				counters[m].hit.covering += 1;
 			if (desorb > 0)
-				if(f->tmpCounter[m].hit.covering!=0)
-					f->tmpCounter[m].hit.covering -= 1;
+				if (counters[m].hit.covering != 0)
+					counters[m].hit.covering -= 1;
+		}
+	}
+}
+
+bool GetSpeciesTime(const size_t& species, const double& time, double& speciesTime) {
+	// Time of a hit recorded at 'time' for an extra species (transparent passes are recorded ahead of the particle).
+	// Extra species are heavier, so they reach latestMoment or decay before the traced gas: false once they did
+	speciesTime = tHandle->currentParticle.speciesFlightTime[species] + (time - tHandle->currentParticle.flightTime) / sHandle->speciesSpeedFactors[species];
+	return (sHandle->wp.calcConstantFlow || speciesTime <= sHandle->wp.latestMoment)
+		&& !(sHandle->wp.enableDecay && tHandle->currentParticle.expectedDecayMoment < speciesTime);
+}
 
-			//Fr den Fall,
-			//dass covering kleiner Null wrde. Das ist aber nicht die physikalisch richtige Lsung => berlegen.
-			//berlegungen siehe MolflowLinux
+void IncreaseSpeciesCounters(SubprocessFacet *f, double time, size_t hit, size_t desorb, size_t absorb, double sum_1_per_v, double sum_v_ort) {
+	// Same hit for the extra species: all speeds scale by the species' factor, flight times follow
+	size_t nbMoments = sHandle->moments.size();
+	for (size_t s = 0; s < sHandle->speciesSpeedFactors.size(); s++) {
+		double k = sHandle->speciesSpeedFactors[s];
+		double speciesTime;
+		if (!GetSpeciesTime(s, time, speciesTime)) continue;
+		FacetHitBuffer* counters = &tHandle->speciesCounters[(s * sHandle->sh.nbFacet + f->globalId) * (1 + nbMoments)];
+		tHandle->FindActiveMoments(speciesTime, tHandle->speciesMoments);
+		for (const size_t& m : tHandle->speciesMoments) {
+			counters[m].hit.nbMCHit += hit;
+			double hitEquiv = static_cast<double>(hit)*tHandle->currentParticle.oriRatio;
+			counters[m].hit.nbHitEquiv += hitEquiv;
+			counters[m].hit.nbDesorbed += desorb;
+			counters[m].hit.nbAbsEquiv += static_cast<double>(absorb)*tHandle->currentParticle.oriRatio;
+			counters[m].hit.sum_1_per_ort_velocity += tHandle->currentParticle.oriRatio * sum_1_per_v / k;
+			counters[m].hit.sum_v_ort += tHandle->currentParticle.oriRatio * sum_v_ort * k;
+			counters[m].hit.sum_1_per_velocity += (hitEquiv + static_cast<double>(desorb)) / (tHandle->currentParticle.velocity * k);
+			if (absorb > 0)
+				counters[m].hit.covering += 1;
+			if (desorb > 0)
+				if (counters[m].hit.covering != 0)
+					counters[m].hit.covering -= 1;
 		}
 	}
 }
 
-void SubprocessFacet::ResetCounter() {
-	std::fill(tmpCounter.begin(), tmpCounter.end(), FacetHitBuffer());
+const std::vector<size_t>& SimulationThread::GetActiveMoments(const double& time) {
+	// Hit buffers to record in for a given time, resolved once and reused by all recorders of the same hit
+	if (time == activeMomentsTime) return activeMoments;
+	activeMomentsTime = time;
+	FindActiveMoments(time, activeMoments);
+	return activeMoments;
+}
+
+void SimulationThread::FindActiveMoments(const double& time, std::vector<size_t>& moments) const {
+	moments.clear();
+	moments.push_back(0); //Constant flow
+	double halfWindow = sHandle->wp.timeWindowSize / 2.0;
+	auto it = std::upper_bound(sHandle->sortedMoments.begin(), sHandle->sortedMoments.end(), time - halfWindow);
+	for (; it != sHandle->sortedMoments.end() && *it - time < halfWindow; ++it) {
+		moments.push_back(sHandle->sortedMomentIndices[it - sHandle->sortedMoments.begin()]);
+	}
 }
 
-void SubprocessFacet::ResizeCounter(size_t nbMoments) {
-	tmpCounter = std::vector<FacetHitBuffer>(nbMoments + 1); //Includes 0-init
-	tmpCounter.shrink_to_fit();
-	tmpHistograms = std::vector<FacetHistogramBuffer>(nbMoments + 1);
-	tmpHistograms.shrink_to_fit();
+void FacetHitState::ResetCounter() {
+	std::fill(tmpCounter.begin(), tmpCounter.end(), FacetHitBuffer());
 }
 
 void SubprocessFacet::RegisterTransparentPass()
 {
-	double directionFactor = abs(Dot(sHandle->currentParticle.direction, this->sh.N));
-	IncreaseFacetCounter(this, sHandle->currentParticle.flightTime + this->colDist / 100.0 / sHandle->currentParticle.velocity, 1, 0, 0, 2.0 / (sHandle->currentParticle.velocity*directionFactor), 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*sHandle->currentParticle.velocity*directionFactor);
+	//Called by the shared Intersect(), the collision coordinates are on the facet
+	tHandle->currentParticle.colU = this->colU;
+	tHandle->currentParticle.colV = this->colV;
+	RecordTransparentPass(this, this->colDist);
+}
+
+template <bool instrumented> void RecordTransparentPassKernel(SubprocessFacet *f, double colDist)
+{
+	double directionFactor = abs(Dot(tHandle->currentParticle.direction, f->sh.N));
+	IncreaseFacetCounter(f, tHandle->currentParticle.flightTime + colDist / 100.0 / tHandle->currentParticle.velocity, 1, 0, 0, 2.0 / (tHandle->currentParticle.velocity*directionFactor), 2.0*(sHandle->wp.useMaxwellDistribution ? 1.0 : 1.1781)*tHandle->currentParticle.velocity*directionFactor);
 
-	this->hitted = true;
-	if (/*this->texture &&*/ this->sh.countTrans) {
-		RecordHitOnTexture(this, sHandle->currentParticle.flightTime + this->colDist / 100.0 / sHandle->currentParticle.velocity,
+	tHandle->facetStates[f->globalId].hitted = true;
+	if (!instrumented) return;
+	if (/*f->texture &&*/ f->sh.countTrans) {
+		RecordHitOnTexture(f, tHandle->currentParticle.flightTime + colDist / 100.0 / tHandle->currentParticle.velocity,
 			true, 2.0, 2.0);
 	}
-	if (/*this->direction &&*/ this->sh.countDirection) {
-		RecordDirectionVector(this, sHandle->currentParticle.flightTime + this->colDist / 100.0 / sHandle->currentParticle.velocity);
+	if (/*f->direction &&*/ f->sh.countDirection) {
+		RecordDirectionVector(f, tHandle->currentParticle.flightTime + colDist / 100.0 / tHandle->currentParticle.velocity);
 	}
-	LogHit(this);
-	ProfileFacet(this, sHandle->currentParticle.flightTime + this->colDist / 100.0 / sHandle->currentParticle.velocity,
+	LogHit(f);
+	ProfileFacet(f, tHandle->currentParticle.flightTime + colDist / 100.0 / tHandle->currentParticle.velocity,
 		true, 2.0, 2.0);
-	if (this->sh.anglemapParams.record) RecordAngleMap(this);
+	if (f->sh.anglemapParams.record) RecordAngleMap(f);
 }
+
+void RecordTransparentPass(SubprocessFacet *f, double colDist)
+{
+	if (!sHandle->isSplitFacet.empty() && sHandle->isSplitFacet[f->globalId])
+		tHandle->currentParticle.splitPending = true;
+	if (sHandle->adjointTarget) RecordAdjointHit(f);
+	if (!sHandle->estimatorIndex.empty() && sHandle->estimatorIndex[f->globalId] != -1 && !tHandle->currentParticle.nextEventCovered)
+		RecordEstimator(sHandle->estimatorIndex[f->globalId], tHandle->currentParticle.flightTime + colDist / 100.0 / tHandle->currentParticle.velocity,
+			tHandle->currentParticle.oriRatio, tHandle->currentParticle.velocity*abs(Dot(tHandle->currentParticle.direction, f->sh.N)));
+	if (f->isInstrumented) RecordTransparentPassKernel<true>(f, colDist);
+	else RecordTransparentPassKernel<false>(f, colDist);
+}
\ No newline at end of file
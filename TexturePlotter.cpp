@@ -87,6 +87,12 @@ TexturePlotter::TexturePlotter() :GLWindow() {
 	viewCombo->SetSelectedIndex(5); //Pressure by default
 	Add(viewCombo);
 
+	gasLabel = new GLLabel("Gas:");
+	Add(gasLabel);
+	gasCombo = new GLCombo(0);
+	Add(gasCombo);
+	RefreshGasCombo();
+
 	saveButton = new GLButton(0, "Save");
 	Add(saveButton);
 
@@ -125,6 +131,8 @@ void TexturePlotter::PlaceComponents() {
 	maxButton->SetBounds(90, height - 70, 70, 19);
 	viewLabel->SetBounds(320, height - 70, 30, 19);
 	viewCombo->SetBounds(350, height - 70, 130, 19);
+	gasLabel->SetBounds(320, height - 45, 30, 19);
+	gasCombo->SetBounds(350, height - 45, 130, 19);
 	cancelButton->SetBounds(width - 90, height - 45, 80, 19);
 
 }
@@ -174,7 +182,6 @@ void TexturePlotter::Update(float appTime, bool force) {
 
 void TexturePlotter::UpdateTable() {
 	size_t nbMoments = mApp->worker.moments.size();
-	size_t facetHitsSize = (1 + nbMoments) * sizeof(FacetHitBuffer);
 	maxValue = 0.0f;
 	//double scale;
 	GetSelected();
@@ -218,7 +225,7 @@ void TexturePlotter::UpdateTable() {
 				if (buffer) {
 					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
 					size_t profSize = (selFacet->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)*(1 + nbMoments)) : 0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + facetHitsSize + profSize + mApp->worker.displayedMoment*w*h * sizeof(TextureCell)));
+					TextureCell *texture = GetTexture(buffer, profSize);
 					for (size_t i = 0; i < w; i++) {
 						for (size_t j = 0; j < h; j++) {
 							//int tSize = selFacet->wp.texWidth*selFacet->wp.texHeight;
@@ -250,7 +257,7 @@ void TexturePlotter::UpdateTable() {
 				if (buffer) {
 					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
 					size_t profSize = (selFacet->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)*(1 + nbMoments)) : 0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + facetHitsSize + profSize + mApp->worker.displayedMoment*w*h * sizeof(TextureCell)));
+					TextureCell *texture = GetTexture(buffer, profSize);
 					double dCoef =1E4; //1E4: conversion m2->cm2
 					/*if (shGHit->sMode == MC_MODE) dCoef *= ((mApp->worker.displayedMoment == 0) ? 1.0 : ((worker->desorptionStopTime - worker->desorptionStartTime)
 						/ worker->wp.wp.timeWindowSize));*/
@@ -284,7 +291,7 @@ void TexturePlotter::UpdateTable() {
 				if (buffer) {
 					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
 					size_t profSize = (selFacet->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)*(1 + nbMoments)) : 0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + facetHitsSize + profSize + mApp->worker.displayedMoment*w*h * sizeof(TextureCell)));
+					TextureCell *texture = GetTexture(buffer, profSize);
 					double dCoef =1E4 * selFacet->DensityCorrection();   //1E4 m2 -> cm2
 					
 					if (worker->wp.sMode == MC_MODE) dCoef *= mApp->worker.GetMoleculesPerTP(worker->displayedMoment);
@@ -321,7 +328,7 @@ void TexturePlotter::UpdateTable() {
 				if (buffer) {
 					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
 					size_t profSize = (selFacet->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)*(1 + nbMoments)) : 0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + facetHitsSize + profSize + mApp->worker.displayedMoment*w*h * sizeof(TextureCell)));
+					TextureCell *texture = GetTexture(buffer, profSize);
 					//float dCoef = (float)totalOutgassing / 8.31 * wp.gasMass / 100 * MAGIC_CORRECTION_FACTOR;
 					double dCoef = 1E4 * selFacet->DensityCorrection();
 
@@ -333,7 +340,7 @@ void TexturePlotter::UpdateTable() {
 							double imp_rate = texture[i + j*w].count / (selFacet->mesh[i + j*w].area*(selFacet->wp.is2sided ? 2.0 : 1.0))*dCoef;
 							double rho = 4.0*imp_rate / v_avg;*/
 							double rho = texture[i + j*w].sum_1_per_ort_velocity / selFacet->GetMeshArea(i + j*w,true)*dCoef;
-							double rho_mass = rho*worker->wp.gasMass / 1000.0 / 6E23;
+							double rho_mass = rho*GetGasMass() / 1000.0 / 6E23;
 							if (rho_mass > maxValue) {
 								maxValue = rho_mass;
 								maxX = i; maxY = j;
@@ -360,8 +367,8 @@ void TexturePlotter::UpdateTable() {
 				if (buffer) {
 					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
 					size_t profSize = (selFacet->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)*(1 + nbMoments)) : 0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + facetHitsSize + profSize + mApp->worker.displayedMoment*w*h * sizeof(TextureCell)));
-					double dCoef = 1E4 * (worker->wp.gasMass / 1000 / 6E23) * 0.0100;  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar
+					TextureCell *texture = GetTexture(buffer, profSize);
+					double dCoef = 1E4 * (GetGasMass() / 1000 / 6E23) * 0.0100;  //1E4 is conversion from m2 to cm2; 0.01 is Pa->mbar
 					
 					if (worker->wp.sMode == MC_MODE) dCoef *= worker->GetMoleculesPerTP(worker->displayedMoment);
 					for (size_t i = 0; i < w; i++) {
@@ -395,7 +402,7 @@ void TexturePlotter::UpdateTable() {
 				if (buffer) {
 					GlobalHitBuffer *shGHit = (GlobalHitBuffer *)buffer;
 					size_t profSize = (selFacet->sh.isProfile) ? (PROFILE_SIZE * sizeof(ProfileSlice)*(1 + nbMoments)) : 0;
-					TextureCell *texture = (TextureCell *)((BYTE *)buffer + (selFacet->sh.hitOffset + facetHitsSize + profSize + mApp->worker.displayedMoment*w*h * sizeof(TextureCell)));
+					TextureCell *texture = GetTexture(buffer, profSize);
 					for (size_t i = 0; i < w; i++) {
 						for (size_t j = 0; j < h; j++) {
 							size_t tSize = selFacet->sh.texWidth*selFacet->sh.texHeight;
@@ -421,7 +428,10 @@ void TexturePlotter::UpdateTable() {
 		case 7: {// Gas velocity vector
 			for (size_t i = 0; i < w; i++) {
 				for (size_t j = 0; j < h; j++) {
-					if (selFacet->dirCache) {
+					if (gasCombo->GetSelectedIndex() > 0) {
+						sprintf(tmp, "Not recorded per species");
+					}
+					else if (selFacet->dirCache) {
 						sprintf(tmp, "%g,%g,%g",
 							selFacet->dirCache[i + j*w].dir.x / (double)selFacet->dirCache[i + j*w].count,
 							selFacet->dirCache[i + j*w].dir.y / (double)selFacet->dirCache[i + j*w].count,
@@ -445,7 +455,10 @@ void TexturePlotter::UpdateTable() {
 		case 8: {// # of velocity vectors
 			for (size_t i = 0; i < w; i++) {
 				for (size_t j = 0; j < h; j++) {
-					if (selFacet->dirCache) {
+					if (gasCombo->GetSelectedIndex() > 0) {
+						sprintf(tmp, "Not recorded per species");
+					}
+					else if (selFacet->dirCache) {
 						llong val = selFacet->dirCache[i + j*w].count;
 						if (val > maxValue) {
 							maxValue = (double)val;
@@ -466,9 +479,45 @@ void TexturePlotter::UpdateTable() {
 	if (autoSizeOnUpdate->GetState()) mapList->AutoSizeColumn();
 }
 
+void TexturePlotter::RefreshGasCombo() {
+	//Main gas, then the extra species tallied on the same trajectories (Global settings)
+	const std::vector<double>& speciesMasses = mApp->engineParams.speciesMasses;
+	int selected = gasCombo->GetSelectedIndex();
+	gasCombo->SetSize(1 + speciesMasses.size());
+	gasCombo->SetValueAt(0, "Main gas");
+	for (size_t s = 0; s < speciesMasses.size(); s++) {
+		char tmp[64];
+		sprintf(tmp, "Species %zd (%g g/mol)", s + 1, speciesMasses[s]);
+		gasCombo->SetValueAt(s + 1, tmp);
+	}
+	gasCombo->SetSelectedIndex((selected > 0 && selected <= (int)speciesMasses.size()) ? selected : 0);
+	gasCombo->SetEnabled(!speciesMasses.empty());
+}
+
+TextureCell* TexturePlotter::GetTexture(BYTE *buffer, size_t profSize) {
+	size_t nbMoments = mApp->worker.moments.size();
+	size_t w = selFacet->sh.texWidth;
+	size_t h = selFacet->sh.texHeight;
+	int gas = gasCombo->GetSelectedIndex();
+	if (gas > 0) {
+		MolflowGeometry *geom = worker->GetMolflowGeometry();
+		size_t facetId = 0;
+		while (geom->GetFacet(facetId) != selFacet) facetId++;
+		return (TextureCell *)(buffer + geom->GetSpeciesTextureOffset(gas - 1, facetId, nbMoments) + worker->displayedMoment*w*h * sizeof(TextureCell));
+	}
+	size_t facetHitsSize = (1 + nbMoments) * sizeof(FacetHitBuffer);
+	return (TextureCell *)(buffer + selFacet->sh.hitOffset + facetHitsSize + profSize + worker->displayedMoment*w*h * sizeof(TextureCell));
+}
+
+double TexturePlotter::GetGasMass() {
+	int gas = gasCombo->GetSelectedIndex();
+	return (gas > 0) ? mApp->engineParams.speciesMasses[gas - 1] : worker->wp.gasMass;
+}
+
 void TexturePlotter::Display(Worker *w) {
 
 	worker = w;
+	RefreshGasCombo();
 	UpdateTable();
 	SetVisible(true);
 
@@ -557,7 +606,7 @@ void TexturePlotter::ProcessMessage(GLComponent *src, int message) {
 		break;
 
 	case MSG_COMBO:
-		if (src == viewCombo) {
+		if (src == viewCombo || src == gasCombo) {
 			UpdateTable();
 			maxButton->SetEnabled(true);
 			//maxButton->SetEnabled(viewCombo->GetSelectedIndex()!=2);
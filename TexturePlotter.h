@@ -30,6 +30,7 @@ class Geometry;
 class GeometryViewer;
 class Worker;
 class Facet;
+class TextureCell;
 
 class TexturePlotter : public GLWindow {
 
@@ -53,6 +54,9 @@ private:
   void PlaceComponents();
   void Close();
   void SaveFile();
+  void RefreshGasCombo();
+  TextureCell *GetTexture(BYTE *buffer, size_t profSize); //Displayed moment of the chosen gas
+  double GetGasMass();
 
   Worker       *worker;
   Facet        *selFacet;
@@ -66,6 +70,8 @@ private:
   GLButton    *sizeButton;
   GLLabel     *viewLabel;
   GLCombo     *viewCombo;
+  GLLabel     *gasLabel;
+  GLCombo     *gasCombo;
   GLToggle    *autoSizeOnUpdate;
 
   GLButton    *cancelButton;
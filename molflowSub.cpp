@@ -24,6 +24,7 @@ Full license text: https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html
 //#include <iostream>
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 
@@ -119,6 +120,7 @@ char *GetSimuStatus() {
   static char ret[128];
   llong count = sHandle->totalDesorbed;
   llong max   = sHandle->ontheflyParams.desorptionLimit/sHandle->ontheflyParams.nbProcess;
+  llong claimed = sHandle->desorptionQuota ? sHandle->desorptionQuota->load() : 0; //All subprocesses
 
   
   if( GetLocalState()==PROCESS_RUNAC ) sHandle->wp.sMode = AC_MODE;
@@ -126,12 +128,26 @@ char *GetSimuStatus() {
   switch(sHandle->wp.sMode) {
 
     case MC_MODE:
-      if( max!=0 ) {
-        double percent = (double)(count)*100.0 / (double)(max);
-        sprintf(ret,"(%s) MC %I64d/%I64d (%.1f%%)",sHandle->sh.name.c_str(),count,max,percent);
+      if( max!=0 ) { //Shares of the limit are claimed dynamically: progress of all subprocesses
+        llong limit = sHandle->ontheflyParams.desorptionLimit;
+        if( claimed>limit ) claimed = limit;
+        double percent = (double)(claimed)*100.0 / (double)(limit);
+        sprintf(ret,"(%s) MC %I64d, all %I64d/%I64d (%.1f%%)",sHandle->sh.name.c_str(),count,claimed,limit,percent);
       } else {
         sprintf(ret,"(%s) MC %I64d",sHandle->sh.name.c_str(),count);
       }
+      if( sHandle->ep.rouletteThreshold>0.0 || sHandle->ep.splitFactor>1 ) { //Variance reduction statistics
+        size_t len = strlen(ret);
+        snprintf(ret+len,sizeof(ret)-len," RR killed %I64d split %I64d",sHandle->nbRouletteKilled,sHandle->nbSplit);
+      }
+      if( !sHandle->coveringIndex.empty() ) { //Covering evolution progress
+        size_t len = strlen(ret);
+        snprintf(ret+len,sizeof(ret)-len," step %zd/%zd",sHandle->coveringStep,sHandle->ep.coveringSteps);
+      }
+      if( sHandle->maxRelativeError>=0.0 ) { //Batch-means error of the worst watched facet
+        size_t len = strlen(ret);
+        snprintf(ret+len,sizeof(ret)-len," err %.2g%%%s",sHandle->maxRelativeError*100.0,sHandle->converged?" (converged)":"");
+      }
       break;
 
     case AC_MODE:
@@ -240,7 +256,7 @@ void Load() {
   
   printf("Connected to %s\n",loadDpName);
 
-  if( !LoadSimulation(loader) ) {
+  if( !LoadSimulation(loader,prIdx) ) {
     CLOSEDP(loader);
     return;
   }
@@ -271,6 +287,8 @@ void Load() {
   }
 
   printf("Connected to %s (%zd bytes)\n",hitsDpName,hSize);
+  sHandle->desorptionQuota = (std::atomic<llong>*)((BYTE*)dpHit->buff + sHandle->quotaOffset);
+  InitCoveringEvolution((BYTE*)dpHit->buff);
 
 }
 
@@ -299,9 +317,11 @@ bool UpdateParams() {
 		}
 		//*((size_t*)dpLog->buff) = 0; //Autofill with 0, besides we would need access first
 	}
-	sHandle->tmpParticleLog.clear();
-	sHandle->tmpParticleLog.shrink_to_fit();
-	if (sHandle->ontheflyParams.enableLogging) sHandle->tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess);
+	for (auto& t : sHandle->threads) {
+		t.tmpParticleLog.clear();
+		t.tmpParticleLog.shrink_to_fit();
+		if (sHandle->ontheflyParams.enableLogging) t.tmpParticleLog.reserve(sHandle->ontheflyParams.logLimit / sHandle->ontheflyParams.nbProcess / sHandle->threads.size());
+	}
 
 	return result;
 }
@@ -404,7 +424,7 @@ int main(int argc,char* argv[])
 
       case COMMAND_CLOSE:
         printf("COMMAND: CLOSE (%zd,%llu)\n",prParam,prParam2);
-        ClearSimulation();
+        ClearSimulation(); //New sHandle, desorption quota disconnected
         CLOSEDP(dpHit);
 		CLOSEDP(dpLog);
         SetReady();